@@ -0,0 +1,492 @@
+// Runs the sink firmware against the FUSB302 model and a source partner, and
+// reports how much I2C traffic and bus time attach and negotiation cost.
+//
+// Only I2C bus time moves the emulated clock while the firmware runs - CPU
+// time isn't modelled, so latencies are a lower bound set by the bus.
+//
+// With -r the source is unplugged once there's a contract, and plugged back
+// in the other way round, to measure detach and recovery.
+//
+// With -s the sniffer runs instead of the sink, against a source sending the
+// longest messages there are back to back, to see whether reading them out
+// keeps up with the line.
+//
+// With -p the sink asks the source's PPS for mv (which mustn't be one a fixed
+// PDO gives, or that would be picked), then steps it up 20 mV at a time, and
+// holds the last step long enough to need keep-alive Requests.
+//
+// Once there's a contract the sink also asks the source for everything
+// sink_get_info() can, one answer of which comes in two chunks.
+//
+// Every run also times PDO selection on the host for each policy, against the
+// longest Source_Capabilities there can be. That is the one part of answering
+// Source_Capabilities that isn't I2C, so it's there to show it doesn't grow
+// with the policy. On the device it's the pdo_select zone of PROFILE=1 builds.
+// Encoding the longest messages into TX FIFO frames is timed the same way (the
+// tx_build zone on the device).
+//
+// Usage: pd_bench [-v] [-r] [-s] [-p mv] [-c i2c_hz]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fusb302.h"
+#include "host.h"
+#include "pd.h"
+#include "pdo.h"
+#include "sink.h"
+#include "sniffer.h"
+#include "source.h"
+#include "swtimer.h"
+
+// Give up if there's no contract after this long
+#define BENCH_TIMEOUT_US (5000000)
+// How long after attach the source starts advertising
+#define BENCH_FIRST_CAPS_US (20000)
+// How long the cable is out for with -r
+#define BENCH_REPLUG_US (50000)
+// How many messages the source sends with -s
+#define BENCH_BURST_MESSAGES (200)
+// Current asked for with -p, how many 20 mV steps are taken, and how long the
+// last one is held
+#define BENCH_PPS_MA (1000)
+#define BENCH_PPS_STEPS (5)
+#define BENCH_PPS_HOLD_US (30000000)
+// Times round for timing PDO selection and message encoding
+#define BENCH_SELECT_ROUNDS (1000000)
+// Information asked for on top of what the sink asks for itself
+#define BENCH_INFO (SINK_INFO_BATTERY_STATUS | SINK_INFO_COUNTRY_CODES)
+#define BENCH_INFO_COUNT (5)
+
+static void bench_print_phase(
+	const char *name, const struct host_bus_stats *start, const struct host_bus_stats *end
+) {
+	struct host_bus_stats phase = {
+		.transactions = end->transactions - start->transactions,
+		.bytes = end->bytes - start->bytes,
+		.clocks = end->clocks - start->clocks,
+	};
+
+	printf(
+		"%-20s %6u transactions %6u bytes %10.3f ms bus\n",
+		name, phase.transactions, phase.bytes, host_bus_time_us(&phase) / 1000.0
+	);
+}
+
+static int attached = 0;
+static uint64_t attach_done_us;
+static struct host_bus_stats negotiation_start;
+
+static void bench_attached();
+
+static void bench_detached() {
+	pd_attach_start(bench_attached);
+}
+
+static void bench_attached() {
+	if (!attached) {
+		attached = 1;
+		attach_done_us = host_time_us;
+		negotiation_start = host_bus_stats;
+	}
+
+	sink_start(bench_detached);
+}
+
+// Emulated time of the firmware's or the partner's next scheduled action
+static uint64_t bench_next_event_us() {
+	uint64_t next = source_next_event_us();
+	if (fusb302_next_event_us() < next) {
+		next = fusb302_next_event_us();
+	}
+
+	uint32_t deadline;
+	if (swtimer_next_deadline(&deadline)) {
+		int32_t remaining = deadline - swtimer_now();
+		uint64_t timer_next = host_time_us + (remaining > 0 ? remaining : 0);
+		if (timer_next < next) {
+			next = timer_next;
+		}
+	}
+
+	return next;
+}
+
+// Run the firmware's main loop until done() or the partner has nothing left
+// to do
+static void bench_run(int (*done)(), uint64_t timeout_us) {
+	uint64_t end_us = host_time_us + timeout_us;
+	while (!done() && host_time_us < end_us) {
+		uint32_t transactions = host_bus_stats.transactions;
+		swtimer_poll();
+		pd_attach_poll();
+		sink_poll();
+		sniffer_poll();
+
+		if (host_bus_stats.transactions == transactions) {
+			// Firmware is idle - skip ahead to whichever side acts next
+			uint64_t next = bench_next_event_us();
+			if (next == SOURCE_NEVER) {
+				break;
+			}
+			host_advance(next > host_time_us ? next - host_time_us : 1);
+		}
+	}
+}
+
+static uint32_t contracts_wanted = 1;
+
+static int bench_contract() {
+	return sink_stats.contracts >= contracts_wanted;
+}
+
+static int bench_detach_seen() {
+	return sink_stats.detaches != 0;
+}
+
+static int bench_replug() {
+	uint64_t unplug_us = host_time_us;
+	fusb302_detach();
+	source_setup(SOURCE_NEVER);
+
+	bench_run(bench_detach_seen, BENCH_TIMEOUT_US);
+	if (!bench_detach_seen()) {
+		printf("detach not seen\n");
+		return 0;
+	}
+	uint64_t detach_seen_us = host_time_us;
+
+	host_advance(BENCH_REPLUG_US);
+	uint64_t replug_us = host_time_us;
+	fusb302_attach(2, 1);
+	source_setup(BENCH_FIRST_CAPS_US);
+
+	contracts_wanted = 2;
+	bench_run(bench_contract, BENCH_TIMEOUT_US);
+	if (!bench_contract()) {
+		printf("no contract after replug\n");
+		return 0;
+	}
+
+	printf("%-20s %10.3f ms\n", "detach seen after", (detach_seen_us - unplug_us) / 1000.0);
+	printf(
+		"%-20s %10.3f ms (%.3f ms from detach), attach %.3f ms\n",
+		"replug to contract", (host_time_us - replug_us) / 1000.0,
+		sink_stats.recovery_time / 1000.0, pd_attach_stats.attach_time / 1000.0
+	);
+	printf(
+		"%-20s attaches=%u detaches=%u (vbus=%u cc=%u)\n",
+		"transitions", pd_attach_stats.attaches, sink_stats.detaches,
+		sink_stats.detaches_vbus, sink_stats.detaches_cc
+	);
+	return 1;
+}
+
+static void bench_sniffer_attached();
+
+static void bench_sniffer_detached() {
+	pd_attach_start(bench_sniffer_attached);
+}
+
+static void bench_sniffer_attached() {
+	sniffer_start(bench_sniffer_detached);
+}
+
+static int bench_burst_done() {
+	return source_stats.burst_sent == BENCH_BURST_MESSAGES && !pd_interrupt_pending();
+}
+
+static int bench_sniff() {
+	source_burst(BENCH_BURST_MESSAGES, BENCH_FIRST_CAPS_US);
+	pd_attach_start(bench_sniffer_attached);
+
+	uint64_t start_us = host_time_us;
+	bench_run(bench_burst_done, BENCH_TIMEOUT_US);
+
+	printf("i2c clock            %u Hz\n", host_i2c_hz);
+	printf(
+		"%-20s %u messages in %.3f ms\n",
+		"burst", source_stats.burst_sent, (host_time_us - start_us - BENCH_FIRST_CAPS_US) / 1000.0
+	);
+	printf(
+		"%-20s captured=%u dropped=%u\n",
+		"sniffer", sniffer_stats.captured, sniffer_stats.dropped
+	);
+	printf(
+		"%-20s messages=%u full=%u flushed=%u lost=%u\n",
+		"rx fifo", pd_rx_stats.messages, pd_rx_stats.full, pd_rx_stats.flushed,
+		fusb302_stats.rx_overflows
+	);
+
+	return sniffer_stats.captured == source_stats.burst_sent;
+}
+
+static uint32_t steps_wanted;
+
+static int bench_step_done() {
+	return sink_stats.steps >= steps_wanted;
+}
+
+static int bench_never() {
+	return 0;
+}
+
+// Soft and hard resets either side has seen. Once there's a contract, any at
+// all mean a message was taken the wrong way.
+static uint32_t bench_resets() {
+	return sink_stats.soft_resets + sink_stats.hard_resets_sent + sink_stats.hard_resets_received +
+		source_stats.hard_resets_received;
+}
+
+static int bench_pps(uint32_t mv) {
+	// Output voltage field of a programmable RDO
+	if (pdo_rdo_pps_mv(source_stats.last_rdo) != mv - mv % PDO_PPS_STEP_MV) {
+		printf("pps not selected\n");
+		return 0;
+	}
+
+	uint32_t resets = bench_resets();
+
+	for (int i = 1; i <= BENCH_PPS_STEPS; ++i) {
+		steps_wanted = sink_stats.steps + 1;
+		sink_set_policy(&(struct pdo_policy) {
+			.type = PDO_POLICY_VOLTAGE_WINDOW,
+			.min_mv = mv + i * 20,
+			.max_mv = mv + i * 20,
+			.min_ma = BENCH_PPS_MA,
+		});
+		bench_run(bench_step_done, BENCH_TIMEOUT_US);
+		if (!bench_step_done()) {
+			printf("step %d not reached\n", i);
+			return 0;
+		}
+	}
+
+	printf(
+		"%-20s %u steps, %.3f ms last, %.3f ms max, rdo=%08x\n",
+		"pps steps", BENCH_PPS_STEPS, sink_stats.step_time / 1000.0,
+		sink_stats.step_time_max / 1000.0, source_stats.last_rdo
+	);
+
+	uint32_t contracts = source_stats.contracts;
+	bench_run(bench_never, BENCH_PPS_HOLD_US);
+
+	printf(
+		"%-20s %.0f s held, keep_alives=%u contracts=%u timeouts=%u resets=%u\n",
+		"pps hold", BENCH_PPS_HOLD_US / 1000000.0, sink_stats.pps_keep_alives,
+		source_stats.contracts - contracts, source_stats.pps_timeouts, bench_resets() - resets
+	);
+
+	return source_stats.pps_timeouts == 0 && bench_resets() == resets;
+}
+
+static int bench_info_done() {
+	uint32_t done = sink_stats.info_answered + sink_stats.info_refused;
+	return done >= BENCH_INFO_COUNT && sink_idle();
+}
+
+static int bench_info() {
+	uint64_t start_us = host_time_us;
+	sink_get_info(BENCH_INFO);
+	bench_run(bench_info_done, BENCH_TIMEOUT_US);
+
+	printf(
+		"%-20s %10.3f ms requests=%u answered=%u refused=%u\n",
+		"info", (host_time_us - start_us) / 1000.0, sink_stats.info_requests,
+		sink_stats.info_answered, sink_stats.info_refused
+	);
+	printf(
+		"%-20s requests=%u/%u timeouts=%u/%u, %.3f ms max response, %.3f ms max request\n",
+		"chunks", sink_stats.chunk_requests, source_stats.chunk_requests, sink_stats.chunk_timeouts,
+		source_stats.chunk_request_timeouts, sink_stats.chunk_response_time_max / 1000.0,
+		source_stats.chunk_request_latency_max_us / 1000.0
+	);
+
+	return sink_stats.info_answered == BENCH_INFO_COUNT && sink_stats.chunk_timeouts == 0;
+}
+
+// One of each kind of PDO, seven in all
+static const uint32_t bench_select_pdos[] = {
+	(100 << 10) | 300,
+	(180 << 10) | 300,
+	(400 << 10) | 225,
+	(0b10u << 30) | (240 << 20) | (100 << 10) | 150,
+	(0b01u << 30) | (240 << 20) | (100 << 10) | 240,
+	(0b11u << 30) | (110 << 17) | (33 << 8) | 60,
+	(0b11u << 30) | (210 << 17) | (33 << 8) | 60,
+};
+
+static const struct {
+	const char *name;
+	struct pdo_policy policy;
+} bench_policies[] = {
+	{ "max power", { .type = PDO_POLICY_MAX_POWER } },
+	{ "9-12 V >= 2 A", { .type = PDO_POLICY_VOLTAGE_WINDOW, .min_mv = 9000, .max_mv = 12000, .min_ma = 2000 } },
+	{ ">= 27 W", { .type = PDO_POLICY_MIN_VOLTAGE, .min_mw = 27000 } },
+	{ ">= 100 W", { .type = PDO_POLICY_MIN_VOLTAGE, .min_mw = 100000 } },
+};
+
+static double bench_ns_since(const struct timespec *start) {
+	struct timespec end;
+	timespec_get(&end, TIME_UTC);
+	return ((end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec)) / BENCH_SELECT_ROUNDS;
+}
+
+static void bench_encode() {
+	static struct pd_tx tx;
+	struct pd_message_standard standard;
+	memcpy(standard.data_objects, bench_select_pdos, sizeof(standard.data_objects));
+	struct pd_message_extended extended = { .extended_header = sizeof(extended.data) };
+	for (size_t i = 0; i < sizeof(extended.data); ++i) {
+		extended.data[i] = i;
+	}
+
+	struct timespec start;
+	timespec_get(&start, TIME_UTC);
+	for (int i = 0; i < BENCH_SELECT_ROUNDS; ++i) {
+		pd_tx_encode_standard(&tx, PD_DATA_SOURCE_CAPABILITIES | (7 << 12) | (i & 0b111) << 9, &standard);
+		__asm__ volatile("" : : "r"(&tx) : "memory");
+	}
+	printf("%-20s %4u bytes %7.1f ns\n", "encode standard", tx.frame_size, bench_ns_since(&start));
+
+	timespec_get(&start, TIME_UTC);
+	for (int i = 0; i < BENCH_SELECT_ROUNDS; ++i) {
+		pd_tx_encode_extended(&tx, PD_EXTENDED_STATUS | (1 << 15) | (i & 0b111) << 9, &extended);
+		__asm__ volatile("" : : "r"(&tx) : "memory");
+	}
+	printf("%-20s %4u bytes %7.1f ns\n", "encode extended", tx.frame_size, bench_ns_since(&start));
+}
+
+static void bench_select() {
+	int count = sizeof(bench_select_pdos) / sizeof(bench_select_pdos[0]);
+
+	for (size_t p = 0; p < sizeof(bench_policies) / sizeof(bench_policies[0]); ++p) {
+		struct pdo_choice choice;
+		struct timespec start;
+
+		timespec_get(&start, TIME_UTC);
+		for (int i = 0; i < BENCH_SELECT_ROUNDS; ++i) {
+			pdo_select(bench_select_pdos, count, &bench_policies[p].policy, &choice);
+			__asm__ volatile("" : : "r"(&choice) : "memory");
+		}
+
+		double ns = bench_ns_since(&start);
+		printf(
+			"select %-13s pdo=%d mv=%u rdo=%08x mismatch=%d %7.1f ns\n",
+			bench_policies[p].name, choice.position - 1, choice.mv, pdo_rdo(&choice), choice.mismatch, ns
+		);
+	}
+}
+
+int main(int argc, char **argv) {
+	int replug = 0;
+	int sniff = 0;
+	uint32_t pps_mv = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-v") == 0) {
+			host_verbose = 1;
+		} else if (strcmp(argv[i], "-r") == 0) {
+			replug = 1;
+		} else if (strcmp(argv[i], "-s") == 0) {
+			sniff = 1;
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			pps_mv = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			host_i2c_hz = strtoul(argv[++i], NULL, 0);
+		} else {
+			fprintf(stderr, "usage: %s [-v] [-r] [-s] [-p mv] [-c i2c_hz]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	swtimer_setup();
+	pd_setup();
+	fusb302_set_partner(&source_partner);
+	fusb302_attach(1, 1);
+
+	if (sniff) {
+		return bench_sniff() ? 0 : 1;
+	}
+
+	source_setup(BENCH_FIRST_CAPS_US);
+	if (pps_mv != 0) {
+		sink_set_policy(&(struct pdo_policy) {
+			.type = PDO_POLICY_VOLTAGE_WINDOW,
+			.min_mv = pps_mv,
+			.max_mv = pps_mv,
+			.min_ma = BENCH_PPS_MA,
+		});
+	}
+
+	struct host_bus_stats attach_start = host_bus_stats;
+	pd_attach_start(bench_attached);
+
+	bench_run(bench_contract, BENCH_TIMEOUT_US);
+
+	if (!attached) {
+		printf("attach failed\n");
+		return 1;
+	}
+
+	printf("i2c clock            %u Hz\n", host_i2c_hz);
+	bench_print_phase("attach", &attach_start, &negotiation_start);
+	bench_print_phase("negotiation", &negotiation_start, &host_bus_stats);
+	printf("%-20s %6u\n", "transactions saved", pd_reg_stats.avoided_transactions);
+	printf("%-20s %10.3f ms\n", "attach time", attach_done_us / 1000.0);
+	printf(
+		"%-20s %10.3f ms last, %.3f ms max (tSenderResponse %.3f ms)\n",
+		"caps -> request", source_stats.request_latency_us / 1000.0,
+		source_stats.request_latency_max_us / 1000.0, 24.0
+	);
+	printf(
+		"%-20s caps=%u requests=%u missed=%u hard_resets=%u rdo=%08x\n",
+		"source", source_stats.caps_sent, source_stats.requests,
+		source_stats.missed_responses, source_stats.hard_resets_received, source_stats.last_rdo
+	);
+
+	printf(
+		"%-20s %10.3f ms last, %.3f ms max, %u late\n",
+		"sink response", sink_stats.response_time / 1000.0, sink_stats.response_time_max / 1000.0,
+		sink_stats.responses_late
+	);
+	printf(
+		"%-20s contracts=%u soft_resets=%u hard_resets=%u/%u tx_failures=%u\n",
+		"sink", sink_stats.contracts, sink_stats.soft_resets, sink_stats.hard_resets_sent,
+		sink_stats.hard_resets_received, sink_stats.tx_failures
+	);
+
+	printf(
+		"%-20s sent=%u failed=%u discarded=%u back_to_back=%u\n",
+		"tx", pd_tx_stats.sent, pd_tx_stats.failed, pd_tx_stats.discarded,
+		pd_tx_stats.back_to_back
+	);
+
+	if (sink_stats.contracts == 0) {
+		printf("no contract\n");
+		return 1;
+	}
+
+	printf("%-20s %10.3f ms\n", "contract at", source_stats.contract_time_us / 1000.0);
+	printf(
+		"%-20s %10.3f ms first request, %.3f ms contract\n",
+		"boot to", sink_stats.first_request_time / 1000.0, sink_stats.first_contract_time / 1000.0
+	);
+
+	bench_select();
+	bench_encode();
+
+	if (!bench_info()) {
+		return 1;
+	}
+
+	if (pps_mv != 0 && !bench_pps(pps_mv)) {
+		return 1;
+	}
+
+	if (replug && !bench_replug()) {
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,388 @@
+// See FUSB302-D datasheet Rev 2 (July 2017) for register layouts and TX/RX
+// FIFO token formats.
+#include "fusb302.h"
+#include <string.h>
+#include "host.h"
+#include "pd.h"
+
+#define FUSB302_REGISTER_COUNT (PD_REG_FIFOS + 1)
+
+#define FUSB302_TX_TOKEN_TXON (0xa1)
+#define FUSB302_TX_TOKEN_PACKSYM_MASK (0xe0)
+
+// Time from enabling toggle to I_TOGDONE with a source attached. The datasheet
+// gives tTOG1/tTOG2 (the time spent presenting each side) as 30/20 ms, and a
+// sink-only toggle settles within about one of those.
+#define FUSB302_TOGGLE_US (10000)
+
+struct fusb302_stats fusb302_stats;
+
+static uint8_t regs[FUSB302_REGISTER_COUNT];
+
+static uint8_t rx_fifo[FUSB302_RX_FIFO_SIZE];
+static size_t rx_head;
+static size_t rx_count;
+
+static uint8_t tx_fifo[FUSB302_TX_FIFO_SIZE];
+static size_t tx_count;
+
+static const struct fusb302_partner *partner;
+
+// Orientation of the attached source (which CC pin its Rp is on, 0 if
+// nothing is attached), and whether VBUS is present
+static int attached_cc = 0;
+static int vbus_present = 0;
+
+// When CONTROL2 TOGGLE was last set, while the toggle state machine is running
+static int toggling = 0;
+static uint64_t toggle_start_us;
+
+static uint32_t crc32(const uint8_t *data, size_t count) {
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < count; ++i) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+void fusb302_reset() {
+	memset(regs, 0, sizeof(regs));
+	regs[PD_REG_DEVICE_ID] = 0x91;
+	regs[PD_REG_SWITCHES0] = 0x03;
+	regs[PD_REG_SWITCHES1] = 0x20;
+	regs[PD_REG_MEASURE] = 0x31;
+	regs[PD_REG_SLICE] = 0x60;
+	regs[PD_REG_CONTROL0] = 0x24;
+	regs[PD_REG_CONTROL2] = 0x02;
+	regs[PD_REG_CONTROL3] = 0x06;
+	regs[PD_REG_POWER] = 0x01;
+	regs[PD_REG_OCPREG] = 0x0f;
+
+	rx_head = 0;
+	rx_count = 0;
+	tx_count = 0;
+	toggling = 0;
+}
+
+void fusb302_set_partner(const struct fusb302_partner *p) {
+	partner = p;
+}
+
+static void fusb302_rx_push(uint8_t value) {
+	rx_fifo[(rx_head + rx_count) % FUSB302_RX_FIFO_SIZE] = value;
+	rx_count++;
+}
+
+static uint8_t fusb302_rx_pop() {
+	if (rx_count == 0) {
+		return 0;
+	}
+
+	uint8_t value = rx_fifo[rx_head];
+	rx_head = (rx_head + 1) % FUSB302_RX_FIFO_SIZE;
+	rx_count--;
+	return value;
+}
+
+// CC pin the PD receiver and transmitter are connected to (0 if neither)
+static int fusb302_pd_cc() {
+	uint8_t switches1 = regs[PD_REG_SWITCHES1];
+	if (switches1 & PD_SWITCHES1_TXCC1) {
+		return 1;
+	}
+	if (switches1 & PD_SWITCHES1_TXCC2) {
+		return 2;
+	}
+	return 0;
+}
+
+static uint8_t fusb302_bc_lvl() {
+	uint8_t switches0 = regs[PD_REG_SWITCHES0];
+	int measured_cc = 0;
+	if (switches0 & PD_SWITCHES0_MEAS_CC1) {
+		measured_cc = 1;
+	} else if (switches0 & PD_SWITCHES0_MEAS_CC2) {
+		measured_cc = 2;
+	}
+
+	// Default USB power Rp, seen through our Rd
+	return measured_cc != 0 && measured_cc == attached_cc ? 0b01 : 0b00;
+}
+
+// Finish toggling if a source has been seen for long enough
+static void fusb302_update_toggle() {
+	if (!toggling || attached_cc == 0 || host_time_us < toggle_start_us + FUSB302_TOGGLE_US) {
+		return;
+	}
+
+	// Only sink-only mode is modelled
+	if ((regs[PD_REG_CONTROL2] & (0b11 << 1)) != PD_CONTROL2_MODE_SNK) {
+		return;
+	}
+
+	toggling = 0;
+	regs[PD_REG_STATUS1A] = attached_cc == 1 ? PD_STATUS1A_TOGSS_SNK_CC1 : PD_STATUS1A_TOGSS_SNK_CC2;
+	regs[PD_REG_INTERRUPTA] |= PD_INTERRUPTA_I_TOGDONE;
+}
+
+static void fusb302_update_status() {
+	uint8_t status0 = fusb302_bc_lvl();
+	if (vbus_present) {
+		status0 |= PD_STATUS0_VBUSOK;
+	}
+	regs[PD_REG_STATUS0] = status0;
+
+	uint8_t status1 = 0;
+	if (rx_count == 0) {
+		status1 |= PD_STATUS1_RX_EMPTY;
+	}
+	if (rx_count == FUSB302_RX_FIFO_SIZE) {
+		status1 |= PD_STATUS1_RX_FULL;
+	}
+	if (tx_count == 0) {
+		status1 |= PD_STATUS1_TX_EMPTY;
+	}
+	if (tx_count == FUSB302_TX_FIFO_SIZE) {
+		status1 |= PD_STATUS1_TX_FULL;
+	}
+	regs[PD_REG_STATUS1] = status1;
+}
+
+// Put a message into the RX FIFO as the FUSB302 would: token, header, data
+// objects and CRC. Returns 0 if it didn't fit.
+static int fusb302_rx_message(uint8_t token, uint16_t header, const uint8_t *payload, size_t payload_size) {
+	size_t size = 1 + 2 + payload_size + 4;
+	if (rx_count + size > FUSB302_RX_FIFO_SIZE) {
+		fusb302_stats.rx_overflows++;
+		return 0;
+	}
+
+	uint8_t message[2 + 7 * 4];
+	message[0] = header & 0xff;
+	message[1] = header >> 8;
+	memcpy(&message[2], payload, payload_size);
+	uint32_t crc = crc32(message, 2 + payload_size);
+
+	fusb302_rx_push(token);
+	for (size_t i = 0; i < 2 + payload_size; ++i) {
+		fusb302_rx_push(message[i]);
+	}
+	for (int i = 0; i < 4; ++i) {
+		fusb302_rx_push(crc >> (i * 8));
+	}
+
+	return 1;
+}
+
+// Decode the TX FIFO's token stream and hand the message to the partner
+static void fusb302_transmit() {
+	size_t i = 0;
+	uint8_t tokens[4];
+	while (i < tx_count && i < 4) {
+		tokens[i] = tx_fifo[i];
+		i++;
+	}
+
+	int valid = i == 4 &&
+		tokens[0] == PD_TXFIFO_TOK_SOP1 && tokens[1] == PD_TXFIFO_TOK_SOP1 &&
+		tokens[2] == PD_TXFIFO_TOK_SOP1 && tokens[3] == PD_TXFIFO_TOK_SOP2;
+
+	uint8_t message[2 + 7 * 4];
+	size_t message_size = 0;
+	if (valid && i < tx_count && (tx_fifo[i] & FUSB302_TX_TOKEN_PACKSYM_MASK) == PD_TXFIFO_TOK_PACKSYM(0)) {
+		message_size = tx_fifo[i++] & 0x1f;
+		valid = message_size >= 2 && message_size <= sizeof(message) && i + message_size <= tx_count;
+	} else {
+		valid = 0;
+	}
+
+	if (valid) {
+		memcpy(message, &tx_fifo[i], message_size);
+		i += message_size;
+		valid = i + 2 <= tx_count &&
+			tx_fifo[i] == PD_TXFIFO_TOK_JAM_CRC && tx_fifo[i + 1] == PD_TXFIFO_TOK_EOP;
+	}
+
+	tx_count = 0;
+
+	int acked = 0;
+	if (valid && partner != NULL && attached_cc != 0 && fusb302_pd_cc() == attached_cc) {
+		uint16_t header = message[0] | (message[1] << 8);
+		// With AUTO_RETRY the FUSB302 resends up to N_RETRIES times before
+		// giving up, but the partner model answers the first time or never
+		acked = partner->receive(header, &message[2], message_size - 2);
+	}
+
+	if (acked) {
+		// The partner's GoodCRC goes into the RX FIFO like any other message,
+		// with the MessageID of the message it acknowledges and the partner's
+		// roles
+		uint16_t header = message[0] | (message[1] << 8);
+		uint16_t roles = PD_HEADER_DATA_ROLE_DFP | PD_HEADER_POWER_ROLE_SOURCE;
+		uint16_t kept = (0b11 << PD_HEADER_REVISION_POS) | (0b111 << PD_HEADER_MESSAGE_ID_POS);
+		uint16_t goodcrc = PD_CONTROL_GOODCRC | (header & kept) | (~header & roles);
+		fusb302_rx_message(FUSB302_RX_TOKEN_SOP, goodcrc, message, 0);
+		regs[PD_REG_INTERRUPTA] |= PD_INTERRUPTA_I_TXSENT;
+	} else {
+		regs[PD_REG_INTERRUPTA] |= PD_INTERRUPTA_I_RETRYFAIL;
+	}
+}
+
+uint8_t fusb302_read(uint8_t reg) {
+	if (reg >= FUSB302_REGISTER_COUNT) {
+		return 0;
+	}
+
+	fusb302_update_toggle();
+	fusb302_update_status();
+
+	if (reg == PD_REG_FIFOS) {
+		return fusb302_rx_pop();
+	}
+
+	uint8_t value = regs[reg];
+	if (reg == PD_REG_INTERRUPT || reg == PD_REG_INTERRUPTA || reg == PD_REG_INTERRUPTB) {
+		regs[reg] = 0;
+	}
+
+	return value;
+}
+
+void fusb302_write(uint8_t reg, uint8_t value) {
+	if (reg >= FUSB302_REGISTER_COUNT || reg == PD_REG_DEVICE_ID || reg >= PD_REG_STATUS0A) {
+		if (reg == PD_REG_FIFOS) {
+			if (value == FUSB302_TX_TOKEN_TXON) {
+				fusb302_transmit();
+			} else if (tx_count < FUSB302_TX_FIFO_SIZE) {
+				tx_fifo[tx_count++] = value;
+			}
+		}
+		return;
+	}
+
+	switch (reg) {
+	case PD_REG_RESET:
+		if (value & PD_RESET_SW_RES) {
+			fusb302_reset();
+		} else if (value & PD_RESET_PD_RESET) {
+			rx_count = 0;
+			tx_count = 0;
+		}
+		return;
+
+	case PD_REG_CONTROL0:
+		if (value & PD_CONTROL0_TX_FLUSH) {
+			tx_count = 0;
+		}
+		regs[reg] = value & ~(PD_CONTROL0_TX_FLUSH | PD_CONTROL0_TX_START);
+		if (value & PD_CONTROL0_TX_START) {
+			fusb302_transmit();
+		}
+		return;
+
+	case PD_REG_CONTROL1:
+		if (value & PD_CONTROL1_RX_FLUSH) {
+			rx_count = 0;
+		}
+		regs[reg] = value & ~PD_CONTROL1_RX_FLUSH;
+		return;
+
+	case PD_REG_CONTROL2:
+		if ((value & PD_CONTROL2_TOGGLE) && !(regs[reg] & PD_CONTROL2_TOGGLE)) {
+			toggling = 1;
+			toggle_start_us = host_time_us;
+			regs[PD_REG_STATUS1A] = 0;
+		} else if (!(value & PD_CONTROL2_TOGGLE)) {
+			toggling = 0;
+		}
+		regs[reg] = value;
+		return;
+
+	case PD_REG_CONTROL3:
+		regs[reg] = value & ~PD_CONTROL3_SEND_HARD_RESET;
+		if (value & PD_CONTROL3_SEND_HARD_RESET) {
+			regs[PD_REG_INTERRUPTA] |= PD_INTERRUPTA_I_HARDSENT;
+			if (partner != NULL && attached_cc != 0) {
+				partner->hard_reset();
+			}
+		}
+		return;
+
+	default:
+		regs[reg] = value;
+		return;
+	}
+}
+
+uint8_t fusb302_next_address(uint8_t reg) {
+	return reg == PD_REG_FIFOS ? reg : reg + 1;
+}
+
+int fusb302_int_n() {
+	fusb302_update_toggle();
+
+	if (regs[PD_REG_CONTROL0] & PD_CONTROL0_INT_MASK) {
+		return 1;
+	}
+
+	int asserted =
+		(regs[PD_REG_INTERRUPT] & ~regs[PD_REG_MASK1]) ||
+		(regs[PD_REG_INTERRUPTA] & ~regs[PD_REG_MASKA]) ||
+		(regs[PD_REG_INTERRUPTB] & ~regs[PD_REG_MASKB] & PD_INTERRUPTB_I_GCRCSENT);
+	return !asserted;
+}
+
+uint64_t fusb302_next_event_us() {
+	if (toggling && attached_cc != 0) {
+		return toggle_start_us + FUSB302_TOGGLE_US;
+	}
+
+	return FUSB302_NEVER;
+}
+
+void fusb302_attach(int cc, int vbus) {
+	attached_cc = cc;
+	vbus_present = vbus;
+	regs[PD_REG_INTERRUPT] |= PD_INTERRUPT_I_BC_LVL | PD_INTERRUPT_I_VBUSOK;
+}
+
+void fusb302_detach() {
+	attached_cc = 0;
+	vbus_present = 0;
+	regs[PD_REG_INTERRUPT] |= PD_INTERRUPT_I_BC_LVL | PD_INTERRUPT_I_VBUSOK;
+}
+
+int fusb302_partner_send(uint8_t token, uint16_t header, const uint8_t *payload, size_t payload_size) {
+	if (attached_cc == 0 || fusb302_pd_cc() != attached_cc) {
+		return 0;
+	}
+
+	// SOP' and SOP'' are only received when enabled in CONTROL1
+	uint8_t control1 = regs[PD_REG_CONTROL1];
+	if ((token == FUSB302_RX_TOKEN_SOP1 && (control1 & PD_CONTROL1_ENSOP1) == 0) ||
+			(token == FUSB302_RX_TOKEN_SOP2 && (control1 & PD_CONTROL1_ENSOP2) == 0)) {
+		return 0;
+	}
+
+	if (!fusb302_rx_message(token, header, payload, payload_size)) {
+		return 0;
+	}
+
+	regs[PD_REG_INTERRUPT] |= PD_INTERRUPT_I_ACTIVITY | PD_INTERRUPT_I_CRC_CHK;
+	if (regs[PD_REG_SWITCHES1] & PD_SWITCHES1_AUTO_CRC) {
+		regs[PD_REG_INTERRUPTB] |= PD_INTERRUPTB_I_GCRCSENT;
+		return 1;
+	}
+
+	return 0;
+}
+
+void fusb302_partner_hard_reset() {
+	rx_count = 0;
+	tx_count = 0;
+	regs[PD_REG_INTERRUPTA] |= PD_INTERRUPTA_I_HARDRST;
+}
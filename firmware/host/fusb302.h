@@ -0,0 +1,55 @@
+#ifndef FUSB302_H
+#define FUSB302_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Register-level model of the FUSB302 for host builds, driven from the I2C
+// side by host/pd_i2c.c and from the cable side by a port partner model.
+
+#define FUSB302_RX_FIFO_SIZE (80)
+#define FUSB302_TX_FIFO_SIZE (48)
+
+// SOP* tokens as they appear in the RX FIFO
+#define FUSB302_RX_TOKEN_SOP (0xe0)
+#define FUSB302_RX_TOKEN_SOP1 (0xc0)
+#define FUSB302_RX_TOKEN_SOP2 (0xa0)
+
+struct fusb302_stats {
+	// Messages from the partner lost because the RX FIFO was too full
+	uint32_t rx_overflows;
+};
+
+extern struct fusb302_stats fusb302_stats;
+
+struct fusb302_partner {
+	// A message transmitted by the FUSB302, decoded from the TX FIFO tokens.
+	// Return 1 if the partner answers it with GoodCRC, which then goes into
+	// the RX FIFO ahead of anything the partner sends next, as on the chip.
+	int (*receive)(uint16_t header, const uint8_t *payload, size_t payload_size);
+	// Hard reset signalled by the FUSB302
+	void (*hard_reset)();
+};
+
+void fusb302_reset();
+void fusb302_set_partner(const struct fusb302_partner *partner);
+
+// I2C side. Reads and writes of FIFOS don't auto-increment the address.
+uint8_t fusb302_read(uint8_t reg);
+void fusb302_write(uint8_t reg, uint8_t value);
+uint8_t fusb302_next_address(uint8_t reg);
+// Level of INT_N (0 = asserted)
+int fusb302_int_n();
+
+#define FUSB302_NEVER (UINT64_MAX)
+// Emulated time the chip next changes state by itself (e.g. toggling finds the
+// partner), or FUSB302_NEVER
+uint64_t fusb302_next_event_us();
+
+// Cable side
+void fusb302_attach(int cc, int vbus);
+void fusb302_detach();
+// A message from the partner. Returns 1 if the FUSB302 accepted it into the
+// RX FIFO (and answered it with GoodCRC).
+int fusb302_partner_send(uint8_t token, uint16_t header, const uint8_t *payload, size_t payload_size);
+void fusb302_partner_hard_reset();
+#endif
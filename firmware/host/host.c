@@ -0,0 +1,97 @@
+// Stand-ins for the firmware's platform services on the host
+#include "host.h"
+#include <stdio.h>
+#include <string.h>
+#include "led.h"
+#include "log.h"
+#include "source.h"
+
+uint64_t host_time_us = 0;
+int host_verbose = 0;
+
+void host_advance(uint64_t us) {
+	uint64_t end = host_time_us + us;
+
+	// Let the partner act at the right points along the way
+	uint64_t next;
+	while ((next = source_next_event_us()) <= end) {
+		if (next > host_time_us) {
+			host_time_us = next;
+		}
+		source_step(host_time_us);
+	}
+
+	host_time_us = end;
+}
+
+void log_setup() {
+}
+
+// Format a log message the way tools/log_decode.py does: every argument is a
+// 32-bit word, and length modifiers are ignored
+static void host_log_format(char *out, size_t size, const char *fmt, const uint32_t *args, size_t count) {
+	size_t length = 0;
+	size_t arg = 0;
+
+	while (*fmt != '\0' && length + 1 < size) {
+		if (*fmt != '%') {
+			out[length++] = *fmt++;
+			continue;
+		}
+
+		// Copy the flags, width and precision, and drop any length modifier
+		char spec[16] = "%";
+		size_t spec_length = 1;
+		fmt++;
+		while (strchr("-+ #0123456789.", *fmt) != NULL && *fmt != '\0' && spec_length < sizeof(spec) - 3) {
+			spec[spec_length++] = *fmt++;
+		}
+		while (strchr("hlzjt", *fmt) != NULL && *fmt != '\0') {
+			fmt++;
+		}
+
+		char conversion = *fmt++;
+		if (conversion == '%') {
+			out[length++] = '%';
+			continue;
+		}
+
+		uint32_t value = arg < count ? args[arg++] : 0;
+		spec[spec_length++] = conversion;
+		spec[spec_length] = '\0';
+
+		if (conversion == 'd' || conversion == 'i') {
+			length += snprintf(&out[length], size - length, spec, (int) value);
+		} else {
+			length += snprintf(&out[length], size - length, spec, (unsigned int) value);
+		}
+		if (length >= size) {
+			length = size - 1;
+		}
+	}
+
+	out[length] = '\0';
+}
+
+void log_event(const char *fmt, const uint32_t *args, size_t count) {
+	if (host_verbose) {
+		char s[256];
+		host_log_format(s, sizeof(s), fmt, args, count);
+		printf("[%10.3f ms] %s\n", host_time_us / 1000.0, s);
+	}
+}
+
+int log_raw(uint8_t kind, uint32_t time, const uint8_t *data, size_t size) {
+	if (host_verbose) {
+		printf("[%10.3f ms] raw %u at %u us:", host_time_us / 1000.0, kind, time);
+		for (size_t i = 0; i < size; ++i) {
+			printf(" %02x", data[i]);
+		}
+		printf("\n");
+	}
+	return 1;
+}
+
+void led_set_rgb(uint8_t rgb) {
+	(void) rgb;
+}
@@ -0,0 +1,27 @@
+#ifndef HOST_H
+#define HOST_H
+#include <stdint.h>
+
+// Emulated time since start-up, in microseconds. Advanced by I2C bus time, and
+// by the benchmark while the firmware is idle.
+extern uint64_t host_time_us;
+void host_advance(uint64_t us);
+
+extern int host_verbose;
+
+struct host_bus_stats {
+	uint32_t transactions;
+	uint32_t bytes;
+	// SCL clock periods, including start/stop conditions
+	uint64_t clocks;
+};
+
+extern struct host_bus_stats host_bus_stats;
+extern uint32_t host_i2c_hz;
+// While non-zero, each transfer is NAKed before anything reaches the FUSB302
+// model, and this counts down
+extern uint32_t host_i2c_nak_transfers;
+
+// Bus time in microseconds at host_i2c_hz
+uint64_t host_bus_time_us(const struct host_bus_stats *stats);
+#endif
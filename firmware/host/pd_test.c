@@ -0,0 +1,286 @@
+// Round-trip checks of the message header, extended header and RDO accessors
+// (pd_msg.h, pdo.h) and of the TX FIFO frames pd_tx_encode_*() build, on the
+// host. Each field is set to every value it can take with every other field
+// at its most awkward, so a shift or mask that spills into a neighbour shows
+// up - the high header byte especially, where message ID, data object count
+// and the extended bit sit side by side.
+//
+// Also checks that a full TX queue refuses a message without encoding over
+// it, and that the register shadow recovers from NAKed writes (pd_reg.c).
+//
+// Usage: pd_test (exits non-zero if anything fails)
+#include <stdio.h>
+#include <string.h>
+#include "fusb302.h"
+#include "host.h"
+#include "pd.h"
+#include "pd_i2c.h"
+#include "pdo.h"
+
+static int failures = 0;
+
+#define TEST_CHECK(condition, ...) do { \
+	if (!(condition)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+static void test_header() {
+	const uint16_t flag_sets[] = {
+		0,
+		PD_HEADER_DATA_ROLE_DFP,
+		PD_HEADER_POWER_ROLE_SOURCE,
+		PD_HEADER_EXTENDED,
+		PD_HEADER_DATA_ROLE_DFP | PD_HEADER_POWER_ROLE_SOURCE | PD_HEADER_EXTENDED,
+	};
+
+	for (size_t f = 0; f < sizeof(flag_sets) / sizeof(flag_sets[0]); ++f) {
+		uint16_t flags = flag_sets[f];
+		for (int type = 0; type <= PD_HEADER_MESSAGE_TYPE_MASK; ++type) {
+			for (int id = 0; id < 8; ++id) {
+				for (int count = 0; count < 8; ++count) {
+					uint16_t header = pd_header(type, id, count, flags);
+					TEST_CHECK(
+						pd_header_message_type(header) == type && pd_header_message_id(header) == id &&
+						pd_header_count(header) == count &&
+						pd_header_revision(header) == PD_HEADER_REVISION_3_0 &&
+						pd_header_extended(header) == ((flags & PD_HEADER_EXTENDED) != 0) &&
+						(header & (PD_HEADER_DATA_ROLE_DFP | PD_HEADER_POWER_ROLE_SOURCE)) ==
+							(flags & (PD_HEADER_DATA_ROLE_DFP | PD_HEADER_POWER_ROLE_SOURCE)),
+						"pd_header(%d, %d, %d, %04x) = %04x", type, id, count, flags, header
+					);
+				}
+			}
+		}
+	}
+
+	// Out of range IDs and counts wrap, rather than spilling into the fields
+	// above them
+	uint16_t header = pd_header(PD_DATA_REQUEST, 8 + 5, 8 + 3, 0);
+	TEST_CHECK(
+		pd_header_message_id(header) == 5 && pd_header_count(header) == 3 && !pd_header_extended(header),
+		"pd_header() with id 13, count 11 = %04x", header
+	);
+
+	// A header as it comes off the wire: Source_Capabilities, 7 data objects,
+	// message ID 7, from a PD 3.0 source that's the DFP
+	header = 0x7000 | (7 << 9) | PD_HEADER_POWER_ROLE_SOURCE | (0b10 << 6) | PD_HEADER_DATA_ROLE_DFP |
+		PD_DATA_SOURCE_CAPABILITIES;
+	TEST_CHECK(
+		pd_header_message_type(header) == PD_DATA_SOURCE_CAPABILITIES && pd_header_message_id(header) == 7 &&
+		pd_header_count(header) == 7 && pd_header_revision(header) == PD_HEADER_REVISION_3_0 &&
+		!pd_header_extended(header),
+		"decoding %04x", header
+	);
+}
+
+static void test_extended_header() {
+	const uint16_t sizes[] = { 0, 1, 26, 255, 256, 260, PD_EXTENDED_HEADER_DATA_SIZE_MASK };
+
+	for (int chunk = 0; chunk < 16; ++chunk) {
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+			for (int request = 0; request < 2; ++request) {
+				uint16_t flags = request ? PD_EXTENDED_HEADER_REQUEST_CHUNK : 0;
+				uint16_t extended_header = pd_extended_header(chunk, sizes[s], flags);
+				TEST_CHECK(
+					pd_extended_header_chunk_number(extended_header) == chunk &&
+					pd_extended_header_data_size(extended_header) == sizes[s] &&
+					pd_extended_header_chunked(extended_header) &&
+					pd_extended_header_request_chunk(extended_header) == request,
+					"pd_extended_header(%d, %u, %04x) = %04x", chunk, sizes[s], flags, extended_header
+				);
+			}
+		}
+	}
+
+	// Bit 9 is reserved, and the data size mustn't reach it
+	uint16_t extended_header = pd_extended_header(0, 0x3FF, 0);
+	TEST_CHECK((extended_header & (1 << 9)) == 0, "data size 0x3ff spilled into bit 9: %04x", extended_header);
+}
+
+static void test_rdo() {
+	for (int position = 1; position < 8; ++position) {
+		for (uint32_t mv = 3300; mv <= 21000; mv += PDO_PPS_STEP_MV) {
+			struct pdo_choice choice = { .position = position, .type = PDO_PPS, .mv = mv, .ma = 5000 };
+			uint32_t rdo = pdo_rdo(&choice);
+			TEST_CHECK(
+				pdo_rdo_position(rdo) == position && pdo_rdo_pps_mv(rdo) == mv && (rdo & 0x7F) == 100,
+				"PPS RDO for position %d, %u mV = %08x", position, mv, rdo
+			);
+		}
+
+		struct pdo_choice choice = {
+			.position = position, .type = PDO_FIXED, .mv = 20000, .ma = 3000, .max_ma = 5000, .mismatch = 1,
+		};
+		uint32_t rdo = pdo_rdo(&choice);
+		TEST_CHECK(
+			pdo_rdo_position(rdo) == position && ((rdo >> 10) & 0x3FF) == 300 && (rdo & 0x3FF) == 500 &&
+			(rdo & (1 << 26)) != 0,
+			"fixed RDO for position %d = %08x", position, rdo
+		);
+	}
+}
+
+static void test_pdo() {
+	struct pdo pdo;
+
+	// 20 V 5 A fixed
+	pdo_parse((400 << 10) | 500, &pdo);
+	TEST_CHECK(
+		pdo.type == PDO_FIXED && pdo.min_mv == 20000 && pdo.max_mv == 20000 && pdo.max_ma == 5000,
+		"fixed PDO parsed as type %d, %u-%u mV, %u mA", pdo.type, pdo.min_mv, pdo.max_mv, pdo.max_ma
+	);
+
+	// 3.3-21 V 5 A PPS
+	pdo_parse((0b11u << 30) | (210 << 17) | (33 << 8) | 100, &pdo);
+	TEST_CHECK(
+		pdo.type == PDO_PPS && pdo.min_mv == 3300 && pdo.max_mv == 21000 && pdo.max_ma == 5000,
+		"PPS APDO parsed as type %d, %u-%u mV, %u mA", pdo.type, pdo.min_mv, pdo.max_mv, pdo.max_ma
+	);
+
+	// 5-20 V 100 W battery
+	pdo_parse((0b01u << 30) | (400 << 20) | (100 << 10) | 400, &pdo);
+	TEST_CHECK(
+		pdo.type == PDO_BATTERY && pdo.min_mv == 5000 && pdo.max_mv == 20000 && pdo.max_mw == 100000,
+		"battery PDO parsed as type %d, %u-%u mV, %u mW", pdo.type, pdo.min_mv, pdo.max_mv, pdo.max_mw
+	);
+}
+
+// Checks the frame's SOP, PACKSYM, message header and trailer, and returns
+// where the payload starts
+static size_t test_frame(const struct pd_tx *tx, uint16_t header, size_t message_length) {
+	const uint8_t start[] = {
+		PD_TXFIFO_TOK_SOP1, PD_TXFIFO_TOK_SOP1, PD_TXFIFO_TOK_SOP1, PD_TXFIFO_TOK_SOP2,
+		PD_TXFIFO_TOK_PACKSYM(message_length), header & 0xFF, header >> 8,
+	};
+	const uint8_t end[] = { PD_TXFIFO_TOK_JAM_CRC, PD_TXFIFO_TOK_EOP, PD_TXFIFO_TOK_TXOFF, 0xA1 };
+
+	TEST_CHECK(
+		tx->frame_size == sizeof(start) + message_length - 2 + sizeof(end),
+		"header %04x: frame is %u bytes for a %zu byte message", header, tx->frame_size, message_length
+	);
+	TEST_CHECK(memcmp(tx->frame, start, sizeof(start)) == 0, "header %04x: frame starts wrong", header);
+	TEST_CHECK(
+		memcmp(&tx->frame[tx->frame_size - sizeof(end)], end, sizeof(end)) == 0,
+		"header %04x: frame ends wrong", header
+	);
+	return sizeof(start);
+}
+
+static void test_encode() {
+	static struct pd_tx tx;
+
+	struct pd_message_standard standard;
+	for (int i = 0; i < 7; ++i) {
+		standard.data_objects[i] = 0x11223344 * (i + 1);
+	}
+	for (int count = 0; count < 8; ++count) {
+		uint16_t header = pd_header(PD_DATA_REQUEST, 7, count, PD_HEADER_POWER_ROLE_SOURCE);
+		pd_tx_encode_standard(&tx, header, &standard);
+		size_t offset = test_frame(&tx, header, 2 + count * 4);
+
+		// Data objects go out least significant byte first
+		for (int i = 0; i < count * 4; ++i) {
+			uint8_t expected = standard.data_objects[i / 4] >> (8 * (i % 4));
+			TEST_CHECK(tx.frame[offset + i] == expected, "data object byte %d is %02x", i, tx.frame[offset + i]);
+		}
+	}
+
+	struct pd_message_extended extended;
+	for (size_t i = 0; i < sizeof(extended.data); ++i) {
+		extended.data[i] = 0xC0 + i;
+	}
+
+	// Unchunked: exactly Data Size bytes follow the extended header, up to what
+	// 7 data objects hold
+	for (size_t size = 0; size <= 7 * 4 - 2; ++size) {
+		extended.extended_header = size;
+		uint16_t header = pd_header(PD_EXTENDED_STATUS, 2, (2 + size + 3) / 4, PD_HEADER_EXTENDED);
+		pd_tx_encode_extended(&tx, header, &extended);
+		size_t offset = test_frame(&tx, header, 4 + size);
+		TEST_CHECK(
+			tx.frame[offset] == (size & 0xFF) && tx.frame[offset + 1] == size >> 8 &&
+			memcmp(&tx.frame[offset + 2], extended.data, size) == 0,
+			"unchunked extended message of %zu bytes", size
+		);
+	}
+
+	// Chunked: Data Size is the whole message's, and the chunk fills the data
+	// objects in the header
+	for (int count = 1; count < 8; ++count) {
+		extended.extended_header = pd_extended_header(3, 260, 0);
+		uint16_t header = pd_header(PD_EXTENDED_COUNTRY_CODES, 0, count, PD_HEADER_EXTENDED);
+		pd_tx_encode_extended(&tx, header, &extended);
+		size_t offset = test_frame(&tx, header, 2 + count * 4);
+		TEST_CHECK(
+			tx.frame[offset] == (extended.extended_header & 0xFF) &&
+			tx.frame[offset + 1] == extended.extended_header >> 8 &&
+			memcmp(&tx.frame[offset + 2], extended.data, count * 4 - 2) == 0,
+			"chunk with %d data objects", count
+		);
+	}
+}
+
+static void test_tx_queue() {
+	static struct pd_tx tx[PD_TX_QUEUE_LENGTH];
+	struct pd_message_standard payload = { .data_objects = { 0x12345678 } };
+
+	pd_i2c_setup();
+	pd_tx_reset();
+	for (int i = 0; i < PD_TX_QUEUE_LENGTH; ++i) {
+		TEST_CHECK(pd_tx_standard(&tx[i], pd_header(PD_DATA_REQUEST, i, 1, 0), &payload), "message %d not queued", i);
+	}
+
+	// With the queue full, a message still in it is refused without its frame
+	// being encoded over
+	uint8_t frame[PD_TX_FRAME_SIZE];
+	memcpy(frame, tx[0].frame, sizeof(frame));
+	TEST_CHECK(!pd_tx_standard(&tx[0], pd_header(PD_DATA_REQUEST, 5, 0, 0), &payload), "full queue took a message");
+	TEST_CHECK(memcmp(frame, tx[0].frame, sizeof(frame)) == 0, "queued frame was encoded over");
+
+	pd_tx_reset();
+	TEST_CHECK(
+		pd_tx_standard(&tx[0], pd_header(PD_DATA_REQUEST, 5, 0, 0), &payload), "emptied queue refused a message"
+	);
+	pd_tx_reset();
+}
+
+static void test_reg_nak() {
+	pd_i2c_setup();
+	pd_reg_update(PD_REG_MASK1, 0, 0);
+
+	// A NAKed flush leaves the write staged, and the next flush sends it
+	pd_reg_set(PD_REG_MASK1, 0x5A);
+	host_i2c_nak_transfers = 1;
+	pd_reg_flush();
+	TEST_CHECK(fusb302_read(PD_REG_MASK1) != 0x5A, "NAKed flush reached the FUSB302");
+	pd_reg_flush();
+	TEST_CHECK(fusb302_read(PD_REG_MASK1) == 0x5A, "MASK1 is %02x after flushing again", fusb302_read(PD_REG_MASK1));
+
+	// A NAKed single write isn't taken as written
+	host_i2c_nak_transfers = 1;
+	pd_write_reg(PD_REG_MASK1, 0x3C);
+	TEST_CHECK(
+		pd_reg_get(PD_REG_MASK1) == 0x5A, "shadow says MASK1 is %02x after a NAKed write", pd_reg_get(PD_REG_MASK1)
+	);
+}
+
+int main() {
+	test_header();
+	test_extended_header();
+	test_rdo();
+	test_pdo();
+	test_encode();
+	test_tx_queue();
+	test_reg_nak();
+
+	if (failures != 0) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
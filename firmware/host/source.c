@@ -0,0 +1,385 @@
+#include "source.h"
+#include <stddef.h>
+#include "host.h"
+
+// USB PD R3.0 section 6.6 timers
+#define T_SENDER_RESPONSE_US (24000)
+#define T_TYPEC_SEND_SOURCE_CAP_US (150000)
+#define T_FIRST_SOURCE_CAP_US (250000)
+#define T_SRC_TRANSITION_US (30000)
+#define T_INTER_FRAME_GAP_US (25)
+#define T_PPS_REQUEST_US (10000000)
+#define T_CHUNK_SENDER_REQUEST_US (27000)
+
+// BMC bit rate (fBitRate, nominal)
+#define BIT_RATE (300000)
+
+#define MSG_CONTROL_ACCEPT (0b00011)
+#define MSG_CONTROL_PS_RDY (0b00110)
+#define MSG_CONTROL_GET_SOURCE_CAP (0b00111)
+#define MSG_CONTROL_GET_SOURCE_CAP_EXTENDED (0b10001)
+#define MSG_CONTROL_GET_STATUS (0b10010)
+#define MSG_CONTROL_GET_COUNTRY_CODES (0b10101)
+#define MSG_DATA_SOURCE_CAPABILITIES (0b00001)
+#define MSG_DATA_REQUEST (0b00010)
+#define MSG_DATA_BATTERY_STATUS (0b00101)
+#define MSG_EXTENDED_SOURCE_CAPABILITIES_EXTENDED (0b00001)
+#define MSG_EXTENDED_STATUS (0b00010)
+#define MSG_EXTENDED_GET_BATTERY_STATUS (0b00100)
+#define MSG_EXTENDED_GET_MANUFACTURER_INFO (0b00110)
+#define MSG_EXTENDED_MANUFACTURER_INFO (0b00111)
+#define MSG_EXTENDED_COUNTRY_CODES (0b01110)
+
+// Extended header fields, and how much data goes in each chunk
+#define EXT_CHUNKED (1 << 15)
+#define EXT_CHUNK_NUMBER_POS (11)
+#define EXT_REQUEST_CHUNK (1 << 10)
+#define EXT_DATA_SIZE_MASK (0x1FF)
+#define EXT_CHUNK_SIZE (26)
+
+enum source_state {
+	STATE_IDLE,
+	STATE_SEND_CAPS,
+	STATE_WAIT_REQUEST,
+	STATE_SEND_ACCEPT,
+	STATE_SEND_PS_RDY,
+	STATE_READY,
+	// Answering the sink with an extended message, a chunk at a time, or a
+	// Battery_Status
+	STATE_SEND_EXTENDED,
+	STATE_WAIT_CHUNK_REQUEST,
+	STATE_SEND_BATTERY_STATUS,
+	// Sending messages back to back, without waiting for GoodCRC
+	STATE_BURST,
+};
+
+struct source_stats source_stats;
+
+static const uint32_t pdos[] = {
+	// Fixed 5 V 3 A, 9 V 3 A, 15 V 3 A, 20 V 2.25 A
+	(100 << 10) | 300,
+	(180 << 10) | 300,
+	(300 << 10) | 300,
+	(400 << 10) | 225,
+	// PPS 3.3-11 V 3 A
+	(0b11u << 30) | (110 << 17) | (33 << 8) | 60,
+};
+
+// Longest Source_Capabilities there can be, for bursts
+static const uint32_t burst_pdos[] = {
+	(100 << 10) | 300,
+	(180 << 10) | 300,
+	(300 << 10) | 300,
+	(400 << 10) | 225,
+	(0b11u << 30) | (110 << 17) | (33 << 8) | 60,
+	(0b11u << 30) | (160 << 17) | (33 << 8) | 60,
+	(0b11u << 30) | (210 << 17) | (33 << 8) | 60,
+};
+
+// Source_Capabilities_Extended: VID, PID, XID, FW and HW version, then
+// nothing of note up to Source Inputs (external supply) and the PDP (45 W)
+static const uint8_t source_cap_extended[24] = {
+	0x09, 0x12, 0x01, 0x00, 0, 0, 0, 0, 1, 1,
+	[21] = 0x01, [23] = 45,
+};
+
+// Status: no internal temperature, external power, temperature normal
+static const uint8_t status[6] = { 0, 0x02, 0, 0, 0x02, 0 };
+
+static const uint8_t manufacturer_info[] = {
+	0x09, 0x12, 0x01, 0x00, 'p', 'd', '-', 'b', 'e', 'n', 'c', 'h',
+};
+
+// Country_Codes: more than fits in a chunk
+static const uint8_t country_codes[2 + 20 * 2] = {
+	20, 0,
+	'U', 'S', 'C', 'A', 'M', 'X', 'B', 'R', 'G', 'B',
+	'D', 'E', 'F', 'R', 'I', 'T', 'E', 'S', 'N', 'L',
+	'S', 'E', 'N', 'O', 'F', 'I', 'P', 'L', 'J', 'P',
+	'K', 'R', 'C', 'N', 'T', 'W', 'I', 'N', 'A', 'U',
+};
+
+// Battery_Status: capacity unknown, and no such battery
+static const uint32_t battery_status = (0xFFFFu << 16) | (1 << 8);
+
+static enum source_state state = STATE_IDLE;
+static uint64_t next_event_us = SOURCE_NEVER;
+static uint8_t message_id = 0;
+static uint32_t burst_left = 0;
+
+// When STATE_READY next has something to do, kept while the sink is answered
+static uint64_t ready_event_us = SOURCE_NEVER;
+
+// Extended message being sent, and the chunk going out next
+static uint8_t ext_type;
+static const uint8_t *ext_data;
+static size_t ext_size;
+static int ext_chunk;
+static uint64_t ext_chunk_sent_us;
+
+// Returns 1 if rdo asks for one of the PPS APDOs
+static int source_rdo_pps(uint32_t rdo) {
+	int position = rdo >> 28;
+	int count = sizeof(pdos) / sizeof(pdos[0]);
+	return position >= 1 && position <= count && (pdos[position - 1] >> 30) == 0b11;
+}
+
+static void source_schedule(enum source_state new_state, uint64_t delay_us) {
+	state = new_state;
+	next_event_us = delay_us == SOURCE_NEVER ? SOURCE_NEVER : host_time_us + delay_us;
+}
+
+static void source_ready() {
+	state = STATE_READY;
+	next_event_us = ready_event_us;
+}
+
+static int source_send(uint8_t type, const uint32_t *data_objects, int count) {
+	// Spec revision 3.0, source, DFP
+	uint16_t header = type | (0b10 << 6) | (1 << 5) | (1 << 8);
+	header |= (message_id & 0b111) << 9;
+	header |= (count & 0b111) << 12;
+
+	uint8_t payload[7 * 4] = { 0 };
+	for (int i = 0; i < count; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			payload[i * 4 + j] = data_objects[i] >> (j * 8);
+		}
+	}
+
+	int acked = fusb302_partner_send(FUSB302_RX_TOKEN_SOP, header, payload, count * 4);
+	if (acked) {
+		message_id++;
+	}
+
+	return acked;
+}
+
+// Send chunk ext_chunk of the extended message being answered with
+static int source_send_chunk() {
+	size_t offset = ext_chunk * EXT_CHUNK_SIZE;
+	size_t size = ext_size - offset < EXT_CHUNK_SIZE ? ext_size - offset : EXT_CHUNK_SIZE;
+	int count = (2 + size + 3) / 4;
+
+	uint16_t header = ext_type | (0b10 << 6) | (1 << 5) | (1 << 8) | (1 << 15);
+	header |= (message_id & 0b111) << 9;
+	header |= (count & 0b111) << 12;
+
+	uint16_t extended_header = EXT_CHUNKED | (ext_chunk << EXT_CHUNK_NUMBER_POS) | ext_size;
+	uint8_t payload[7 * 4] = { extended_header, extended_header >> 8 };
+	for (size_t i = 0; i < size; ++i) {
+		payload[2 + i] = ext_data[offset + i];
+	}
+
+	int acked = fusb302_partner_send(FUSB302_RX_TOKEN_SOP, header, payload, count * 4);
+	if (acked) {
+		message_id++;
+	}
+
+	return acked;
+}
+
+static void source_answer(uint8_t type, const uint8_t *data, size_t size) {
+	source_stats.info_requests++;
+	ext_type = type;
+	ext_data = data;
+	ext_size = size;
+	ext_chunk = 0;
+	source_schedule(STATE_SEND_EXTENDED, 0);
+}
+
+// Time a message with count data objects takes on the wire: preamble, SOP*,
+// 4b5b-coded header, data objects and CRC, and EOP. Plus the gap before the
+// next one can start.
+static uint64_t source_wire_time_us(int count) {
+	uint32_t bits = 64 + 4 * 5 + (2 + count * 4) * 10 + 4 * 10 + 5;
+	return ((uint64_t) bits * 1000000 + BIT_RATE - 1) / BIT_RATE + T_INTER_FRAME_GAP_US;
+}
+
+void source_setup(uint64_t delay_us) {
+	message_id = 0;
+	source_schedule(STATE_SEND_CAPS, delay_us);
+}
+
+void source_burst(uint32_t count, uint64_t delay_us) {
+	burst_left = count;
+	source_schedule(count != 0 ? STATE_BURST : STATE_IDLE, delay_us);
+}
+
+uint64_t source_next_event_us() {
+	return next_event_us;
+}
+
+void source_step(uint64_t now_us) {
+	if (now_us < next_event_us) {
+		return;
+	}
+
+	switch (state) {
+	case STATE_SEND_CAPS:
+		if (source_send(MSG_DATA_SOURCE_CAPABILITIES, pdos, sizeof(pdos) / sizeof(pdos[0]))) {
+			source_stats.caps_sent++;
+			source_stats.caps_time_us = now_us;
+			source_schedule(STATE_WAIT_REQUEST, T_SENDER_RESPONSE_US);
+		} else {
+			source_schedule(STATE_SEND_CAPS, T_TYPEC_SEND_SOURCE_CAP_US);
+		}
+		break;
+
+	case STATE_WAIT_REQUEST:
+		// SenderResponseTimer expired
+		source_stats.missed_responses++;
+		fusb302_partner_hard_reset();
+		message_id = 0;
+		source_schedule(STATE_SEND_CAPS, T_FIRST_SOURCE_CAP_US);
+		break;
+
+	case STATE_SEND_ACCEPT:
+		source_send(MSG_CONTROL_ACCEPT, NULL, 0);
+		source_schedule(STATE_SEND_PS_RDY, T_SRC_TRANSITION_US);
+		break;
+
+	case STATE_SEND_PS_RDY:
+		source_send(MSG_CONTROL_PS_RDY, NULL, 0);
+		source_stats.contracts++;
+		source_stats.contract_time_us = now_us;
+		// A PPS falls back to vSafe5V if the sink stops asking
+		ready_event_us = source_rdo_pps(source_stats.last_rdo) ? now_us + T_PPS_REQUEST_US : SOURCE_NEVER;
+		source_ready();
+		break;
+
+	case STATE_READY:
+		// tPPSRequest ran out
+		source_stats.pps_timeouts++;
+		fusb302_partner_hard_reset();
+		message_id = 0;
+		source_schedule(STATE_SEND_CAPS, T_FIRST_SOURCE_CAP_US);
+		break;
+
+	case STATE_SEND_EXTENDED:
+		if (!source_send_chunk() || (size_t) (ext_chunk + 1) * EXT_CHUNK_SIZE >= ext_size) {
+			source_ready();
+		} else {
+			// ChunkSenderRequestTimer
+			ext_chunk_sent_us = now_us;
+			source_schedule(STATE_WAIT_CHUNK_REQUEST, T_CHUNK_SENDER_REQUEST_US);
+		}
+		break;
+
+	case STATE_WAIT_CHUNK_REQUEST:
+		source_stats.chunk_request_timeouts++;
+		source_ready();
+		break;
+
+	case STATE_SEND_BATTERY_STATUS:
+		source_send(MSG_DATA_BATTERY_STATUS, &battery_status, 1);
+		source_ready();
+		break;
+
+	case STATE_BURST: {
+		int count = sizeof(burst_pdos) / sizeof(burst_pdos[0]);
+		source_send(MSG_DATA_SOURCE_CAPABILITIES, burst_pdos, count);
+		source_stats.burst_sent++;
+
+		burst_left--;
+		if (burst_left != 0) {
+			source_schedule(STATE_BURST, source_wire_time_us(count));
+		} else {
+			source_schedule(STATE_IDLE, SOURCE_NEVER);
+		}
+		break;
+	}
+
+	case STATE_IDLE:
+		next_event_us = SOURCE_NEVER;
+		break;
+	}
+}
+
+// Chunk Requests for what's being sent, and requests that come as extended
+// messages
+static void source_receive_extended(uint8_t type, uint16_t extended_header) {
+	int chunk = (extended_header >> EXT_CHUNK_NUMBER_POS) & 0xF;
+
+	if (extended_header & EXT_REQUEST_CHUNK) {
+		if (state == STATE_WAIT_CHUNK_REQUEST && type == ext_type && chunk == ext_chunk + 1) {
+			uint64_t latency = host_time_us - ext_chunk_sent_us;
+			source_stats.chunk_requests++;
+			if (latency > source_stats.chunk_request_latency_max_us) {
+				source_stats.chunk_request_latency_max_us = latency;
+			}
+
+			ext_chunk = chunk;
+			source_schedule(STATE_SEND_EXTENDED, 0);
+		}
+		return;
+	}
+
+	if (state != STATE_READY || chunk != 0) {
+		return;
+	}
+
+	if (type == MSG_EXTENDED_GET_MANUFACTURER_INFO) {
+		source_answer(MSG_EXTENDED_MANUFACTURER_INFO, manufacturer_info, sizeof(manufacturer_info));
+	} else if (type == MSG_EXTENDED_GET_BATTERY_STATUS) {
+		source_stats.info_requests++;
+		source_schedule(STATE_SEND_BATTERY_STATUS, 0);
+	}
+}
+
+static int source_receive(uint16_t header, const uint8_t *payload, size_t payload_size) {
+	uint8_t type = header & 0b11111;
+	uint8_t number_of_data_objects = (header >> 12) & 0b111;
+	uint8_t extended = (header >> 15) & 0b1;
+
+	if (payload_size != number_of_data_objects * 4u || (extended && payload_size < 2)) {
+		// Malformed - no GoodCRC
+		return 0;
+	}
+
+	if (extended) {
+		source_receive_extended(type, payload[0] | (payload[1] << 8));
+		return 1;
+	}
+
+	if (number_of_data_objects == 1 && type == MSG_DATA_REQUEST) {
+		source_stats.requests++;
+		source_stats.last_rdo = payload[0] | (payload[1] << 8) | (payload[2] << 16) | ((uint32_t) payload[3] << 24);
+
+		if (state == STATE_WAIT_REQUEST || state == STATE_READY) {
+			uint64_t latency = host_time_us - source_stats.caps_time_us;
+			if (state == STATE_WAIT_REQUEST) {
+				source_stats.request_latency_us = latency;
+				if (latency > source_stats.request_latency_max_us) {
+					source_stats.request_latency_max_us = latency;
+				}
+			}
+
+			// Answered as soon as the GoodCRC goes out
+			source_schedule(STATE_SEND_ACCEPT, 0);
+		}
+	} else if (number_of_data_objects == 0 && type == MSG_CONTROL_GET_SOURCE_CAP) {
+		source_schedule(STATE_SEND_CAPS, 0);
+	} else if (number_of_data_objects == 0 && state == STATE_READY) {
+		if (type == MSG_CONTROL_GET_SOURCE_CAP_EXTENDED) {
+			source_answer(MSG_EXTENDED_SOURCE_CAPABILITIES_EXTENDED, source_cap_extended, sizeof(source_cap_extended));
+		} else if (type == MSG_CONTROL_GET_STATUS) {
+			source_answer(MSG_EXTENDED_STATUS, status, sizeof(status));
+		} else if (type == MSG_CONTROL_GET_COUNTRY_CODES) {
+			source_answer(MSG_EXTENDED_COUNTRY_CODES, country_codes, sizeof(country_codes));
+		}
+	}
+
+	return 1;
+}
+
+static void source_hard_reset() {
+	source_stats.hard_resets_received++;
+	message_id = 0;
+	source_schedule(STATE_SEND_CAPS, T_FIRST_SOURCE_CAP_US);
+}
+
+const struct fusb302_partner source_partner = {
+	.receive = source_receive,
+	.hard_reset = source_hard_reset,
+};
@@ -0,0 +1,52 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+#include <stdint.h>
+#include "fusb302.h"
+
+// Source port partner for host builds: advertises a fixed set of PDOs, and
+// accepts any Request that arrives within tSenderResponse. A late or missing
+// Request gets a hard reset, as real sources do, and so does a PPS contract
+// that goes tPPSRequest without one. Once there's a contract it answers
+// requests for PD 3.0 information, chunking what doesn't fit in one extended
+// message. It can also send a burst of messages as fast as the line allows,
+// for the sniffer.
+
+#define SOURCE_NEVER (UINT64_MAX)
+
+struct source_stats {
+	uint32_t caps_sent;
+	uint32_t requests;
+	uint32_t contracts;
+	uint32_t missed_responses;
+	uint32_t hard_resets_received;
+	uint32_t burst_sent;
+	uint32_t pps_timeouts;
+	// Information asked for and answered, and Chunk Requests for the rest of
+	// an answer, served or not in time
+	uint32_t info_requests;
+	uint32_t chunk_requests;
+	uint32_t chunk_request_timeouts;
+
+	// Time the last Source_Capabilities was answered with GoodCRC
+	uint64_t caps_time_us;
+	// Source_Capabilities GoodCRC to Request received
+	uint64_t request_latency_us;
+	uint64_t request_latency_max_us;
+	uint64_t contract_time_us;
+	// Chunk GoodCRC to the Chunk Request for the next one
+	uint64_t chunk_request_latency_max_us;
+
+	uint32_t last_rdo;
+};
+
+extern struct source_stats source_stats;
+extern const struct fusb302_partner source_partner;
+
+// Start advertising delay_us from now
+void source_setup(uint64_t delay_us);
+// Send count of the longest Source_Capabilities back to back, starting
+// delay_us from now, instead of negotiating
+void source_burst(uint32_t count, uint64_t delay_us);
+uint64_t source_next_event_us();
+void source_step(uint64_t now_us);
+#endif
@@ -0,0 +1,17 @@
+// Host timebase: the emulated clock, which only the bench moves forward
+#include "swtimer_hw.h"
+#include "host.h"
+
+void swtimer_hw_setup() {
+}
+
+uint32_t swtimer_hw_now() {
+	return (uint32_t) host_time_us;
+}
+
+void swtimer_hw_arm(uint32_t deadline) {
+	(void) deadline;
+}
+
+void swtimer_hw_disarm() {
+}
@@ -1,40 +1,448 @@
+// Log to the free flash pages between the end of the image and the signature
+// page, where the bootloader can read it out.
+//
+// The store is a ring of 1 KB pages, used in turn so they wear evenly. Each
+// page starts with a header:
+//   - the page's sequence number, a little-endian word that goes up by one
+//     each time a page is started, so the newest page is the highest
+//   - LOG_PAGE_MAGIC, programmed last so a torn header isn't mistaken for one
+// followed by records, which never straddle pages:
+//   - a byte with the body size in bits 0-5, LOG_RECORD_BOOT if it's the first
+//     record since reset, and LOG_RECORD_ABSOLUTE if its time is since reset
+//     rather than since the record before it
+//   - a CRC-8 (poly 0x07, init 0xff) over the rest of the record
+//   - the record's sequence number, a little-endian halfword. Records dropped
+//     in RAM still use up a number, so a gap shows where messages went missing.
+//   - the body, halfword-padded:
+//     - a little-endian halfword with the format string's offset in the
+//       .log_fmt section in bits 0-12 and the argument count in bits 13-15
+//     - the time in ms (see LOG_RECORD_ABSOLUTE), as a varint
+//     - each argument, as a varint
+//   or, for a raw record (format offset LOG_FMT_RAW, with the kind in place
+//   of the argument count), after the time:
+//     - the us past the ms, as a varint
+//     - a byte with the size of the data, then the data
+// where a varint is 7 bits per byte, least significant first, with the top bit
+// set on all but the last byte. Erased flash (0xffff where a record would
+// start) ends the page. The first record on a page always has an absolute
+// time, so any page can be decoded without the ones before it.
+// tools/log_decode.py turns this back into text.
+//
+// At start-up the newest page is checked, and if every record on it is intact
+// the log carries on from the end of it. Otherwise it carries on from a fresh
+// page, so a record torn by a reset is never built on. Pages are only erased
+// when the log moves onto them, so a boot that logs little costs no erase.
+//
+// Programming flash stalls the CPU, so log_event() only copies the body into a
+// RAM ring, and log_flush() moves it to flash later from the main loop while
+// nothing time-critical is happening. The ring has a single producer (the
+// writer, advancing head) and a single consumer (the flusher, advancing tail),
+// so neither side needs to lock out the other.
 #include "log.h"
 #include <stdint.h>
+#include "prof.h"
+#include "swtimer.h"
 #include <gd32f1x0.h>
 #include <core_cm3.h>
 #include "gd32f1x0_libopt.h"
 
-static uint32_t log_address = 0x0800f400;
+// Page-aligned bounds of the store, from the linker script
+extern const uint8_t _log_store_start[];
+extern const uint8_t _log_store_end[];
+
+#define LOG_STORE_START ((uint32_t) _log_store_start)
+#define LOG_STORE_END ((uint32_t) _log_store_end)
+#define LOG_PAGE_SIZE (1024)
+#define LOG_PAGE_COUNT ((LOG_STORE_END - LOG_STORE_START) / LOG_PAGE_SIZE)
+
+#define LOG_PAGE_MAGIC (0x4C47)
+#define LOG_PAGE_HEADER_SIZE (6)
+
+#define LOG_RECORD_SIZE_MASK (0x3F)
+#define LOG_RECORD_ABSOLUTE (1 << 6)
+#define LOG_RECORD_BOOT (1 << 7)
+#define LOG_RECORD_HEADER_SIZE (4)
+
+// Must be a power of 2. The sniffer's trace needs room for bursts of messages
+// arriving faster than flash can take them.
+#ifdef SNIFFER
+#define LOG_RING_SIZE (2048)
+#else
+#define LOG_RING_SIZE (512)
+#endif
+// Halfwords programmed per log_flush() call, to keep each call short
+#define LOG_FLUSH_BUDGET (8)
+
+#define LOG_FMT_OFFSET_MASK (0x1FFF)
+#define LOG_ARGS_POS (13)
+// Header, time and arguments, with a byte of padding. Raw records are kept
+// within this too.
+#define LOG_BODY_MAX (2 + 5 + LOG_MAX_ARGS * 5 + 1)
+// A raw record's header, ms (up to 5 bytes), us (under 1000, so 2 bytes), size
+// and data, padded to a halfword, has to fit in record[] the same way
+#define LOG_RAW_BODY_MAX ((2 + 5 + 2 + 1 + LOG_RAW_MAX + 1) & ~1)
+_Static_assert(LOG_RAW_BODY_MAX <= LOG_BODY_MAX, "LOG_RAW_MAX is too big for LOG_BODY_MAX");
+// Ahead of each body on the ring: its size, and the low halfword of
+// log_stats.dropped when it was queued
+#define LOG_ENTRY_HEADER_SIZE (3)
+
+struct log_stats log_stats;
+
+// Bodies, each behind an entry header
+static uint8_t ring[LOG_RING_SIZE];
+// Free-running indices, wrapped into the ring when used
+static volatile uint16_t ring_head = 0;
+static volatile uint16_t ring_tail = 0;
+
+// swtimer_now() of the last record, less anything under a ms
+static uint32_t last_time = 0;
+// The store isn't touched before log_setup() is called, so the bootloader can
+// read out the previous run's log undisturbed until then
+static int log_enabled = 0;
+
+// Body taken off the ring, and where its arguments start
+static uint8_t body[LOG_BODY_MAX];
+static uint8_t body_size = 0;
+static uint8_t body_args = 0;
+// Its time since the record before it, and since reset
+static uint32_t body_delta = 0;
+static uint32_t body_time = 0;
+
+// Record being programmed, and how much of it is done
+static uint8_t record[LOG_RECORD_HEADER_SIZE + LOG_BODY_MAX];
+static uint8_t record_size = 0;
+static uint8_t record_done = 0;
+
+// Page being filled (0 if there isn't one), the next halfword on it, and the
+// page to move onto when it's full
+static uint32_t page_start = 0;
+static uint32_t log_address = 0;
+static uint32_t next_page = 0;
+static uint32_t page_seq = 0;
+
+static uint16_t record_seq = 0;
+// log_stats.dropped as of the last body taken, to see how many records were
+// dropped in between
+static uint16_t dropped_seen = 0;
+static int boot_record = 1;
+
+static uint16_t log_read_halfword(uint32_t address) {
+	return *(const volatile uint16_t *) address;
+}
+
+static uint8_t log_crc8(uint8_t crc, const uint8_t *data, size_t size) {
+	for (size_t i = 0; i < size; ++i) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static uint8_t log_record_crc(const uint8_t *data, size_t size) {
+	uint8_t crc = log_crc8(0xFF, &data[0], 1);
+	return log_crc8(crc, &data[2], size - 2);
+}
+
+static size_t log_put_varint(uint8_t *data, uint32_t value) {
+	size_t count = 0;
+	while (value >= 0x80) {
+		data[count++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	data[count++] = value;
+	return count;
+}
+
+static size_t log_get_varint(const uint8_t *data, uint32_t *value) {
+	size_t count = 0;
+	*value = 0;
+	do {
+		*value |= (uint32_t) (data[count] & 0x7F) << (7 * count);
+	} while (data[count++] & 0x80);
+	return count;
+}
+
+// Returns 1 if the newest page's records are all intact up to the erased
+// flash after them, leaving log_address there and record_seq after the last
+static int log_resume(uint32_t page) {
+	uint32_t address = page + LOG_PAGE_HEADER_SIZE;
+	uint32_t end = page + LOG_PAGE_SIZE;
+
+	while (address + LOG_RECORD_HEADER_SIZE <= end) {
+		uint16_t header = log_read_halfword(address);
+		if (header == 0xFFFF) {
+			break;
+		}
+
+		size_t size = LOG_RECORD_HEADER_SIZE + (header & LOG_RECORD_SIZE_MASK);
+		if ((size & 1) || address + size > end) {
+			return 0;
+		}
+
+		uint8_t data[LOG_RECORD_HEADER_SIZE + LOG_RECORD_SIZE_MASK];
+		for (size_t i = 0; i < size; i += 2) {
+			uint16_t halfword = log_read_halfword(address + i);
+			data[i] = halfword & 0xFF;
+			data[i + 1] = halfword >> 8;
+		}
+		if (log_record_crc(data, size) != data[1]) {
+			return 0;
+		}
+
+		record_seq = (data[2] | (data[3] << 8)) + 1;
+		address += size;
+	}
+
+	log_address = address;
+	return 1;
+}
 
 void log_setup() {
+	// Find the newest page
+	int newest = -1;
+	for (uint32_t i = 0; i < LOG_PAGE_COUNT; ++i) {
+		uint32_t page = LOG_STORE_START + i * LOG_PAGE_SIZE;
+		if (log_read_halfword(page + 4) != LOG_PAGE_MAGIC) {
+			continue;
+		}
+
+		uint32_t seq = log_read_halfword(page) | (log_read_halfword(page + 2) << 16);
+		if (newest < 0 || (int32_t) (seq - page_seq) > 0) {
+			newest = i;
+			page_seq = seq;
+		}
+	}
+
+	if (newest >= 0) {
+		uint32_t page = LOG_STORE_START + newest * LOG_PAGE_SIZE;
+		next_page = (newest + 1) % LOG_PAGE_COUNT;
+		if (log_resume(page)) {
+			page_start = page;
+		}
+	}
+
 	fmc_unlock();
-	fmc_page_erase(log_address);
+	log_enabled = 1;
 }
 
-void log_try_program(uint32_t address, uint16_t word) {
-	if (address >= 0x0800f400 && address < 0x0800f800) {
-		fmc_halfword_program(address, word);
+// Start a ring entry: the entry header (filled in by log_push), the body
+// header and the ms since the last record up to time. A time from before the
+// last record counts as no time at all. Any us left over go in *us.
+static size_t log_begin(uint8_t *entry, uint16_t header, uint32_t time, uint32_t *us) {
+	entry[LOG_ENTRY_HEADER_SIZE] = header & 0xFF;
+	entry[LOG_ENTRY_HEADER_SIZE + 1] = header >> 8;
+	size_t size = LOG_ENTRY_HEADER_SIZE + 2;
+
+	int32_t since = time - last_time;
+	if (since < 0) {
+		since = 0;
 	}
+	uint32_t elapsed = since / 1000;
+	last_time += elapsed * 1000;
+	*us = since - elapsed * 1000;
+	size += log_put_varint(&entry[size], elapsed);
+
+	return size;
 }
 
-void log_write(char *s) {
-	int i = 0;
-	char prev = '\0';
-	do {
-		if ((i & 1) == 0) {
-			prev = *s;
-		} else {
-			uint16_t word = (((uint16_t) *s) << 8) | prev;
-			log_try_program(log_address, word);
-			log_address += 2;
+static int log_push(uint8_t *entry, size_t size) {
+	uint16_t head = ring_head;
+	uint16_t used = head - ring_tail;
+	if (used + size > LOG_RING_SIZE) {
+		log_stats.dropped++;
+		log_stats.dropped_bytes += size;
+		return 0;
+	}
+
+	// Any drops since the entry before this one are charged to this one, so
+	// the gap in the numbering falls where they happened
+	entry[0] = size - LOG_ENTRY_HEADER_SIZE;
+	entry[1] = log_stats.dropped & 0xFF;
+	entry[2] = (log_stats.dropped >> 8) & 0xFF;
+
+	for (size_t i = 0; i < size; ++i) {
+		ring[(head + i) & (LOG_RING_SIZE - 1)] = entry[i];
+	}
+
+	used += size;
+	if (used > log_stats.high_water) {
+		log_stats.high_water = used;
+	}
+	log_stats.written++;
+
+	// Publish the record only once it's all there
+	ring_head = head + size;
+	return 1;
+}
+
+void log_event(const char *fmt, const uint32_t *args, size_t count) {
+	PROF_ENTER(PROF_LOG_EVENT);
+	if (count > LOG_MAX_ARGS) {
+		count = LOG_MAX_ARGS;
+	}
+
+	uint8_t entry[LOG_ENTRY_HEADER_SIZE + LOG_BODY_MAX];
+	uint16_t header = ((uintptr_t) fmt & LOG_FMT_OFFSET_MASK) | (count << LOG_ARGS_POS);
+	uint32_t us;
+	size_t size = log_begin(entry, header, swtimer_now(), &us);
+
+	for (size_t i = 0; i < count; ++i) {
+		size += log_put_varint(&entry[size], args[i]);
+	}
+
+	log_push(entry, size);
+	PROF_EXIT(PROF_LOG_EVENT);
+}
+
+int log_raw(uint8_t kind, uint32_t time, const uint8_t *data, size_t size) {
+	if (size > LOG_RAW_MAX) {
+		size = LOG_RAW_MAX;
+	}
+
+	uint8_t entry[LOG_ENTRY_HEADER_SIZE + LOG_BODY_MAX];
+	uint16_t header = LOG_FMT_RAW | (kind << LOG_ARGS_POS);
+	uint32_t us;
+	size_t count = log_begin(entry, header, time, &us);
+
+	count += log_put_varint(&entry[count], us);
+	entry[count++] = size;
+	for (size_t i = 0; i < size; ++i) {
+		entry[count++] = data[i];
+	}
+
+	return log_push(entry, count);
+}
+
+int log_pending() {
+	return ring_head != ring_tail || record_done != record_size;
+}
+
+int log_flushable() {
+	return log_enabled && log_pending();
+}
+
+// Take the oldest body off the ring. Returns 0 if there isn't one.
+static int log_take() {
+	uint16_t tail = ring_tail;
+	if (tail == ring_head) {
+		return 0;
+	}
+
+	body_size = ring[tail & (LOG_RING_SIZE - 1)];
+	uint16_t dropped = ring[(tail + 1) & (LOG_RING_SIZE - 1)] | (ring[(tail + 2) & (LOG_RING_SIZE - 1)] << 8);
+	for (size_t i = 0; i < body_size; ++i) {
+		body[i] = ring[(tail + LOG_ENTRY_HEADER_SIZE + i) & (LOG_RING_SIZE - 1)];
+	}
+	ring_tail = tail + LOG_ENTRY_HEADER_SIZE + body_size;
+
+	body_args = 2 + log_get_varint(&body[2], &body_delta);
+	body_time += body_delta;
+
+	// Records dropped just before this one still use up their numbers. The
+	// numbers are halfwords too, so the count wrapping doesn't matter.
+	record_seq += (uint16_t) (dropped - dropped_seen);
+	dropped_seen = dropped;
+
+	return 1;
+}
+
+static void log_build_record(int first_on_page) {
+	uint8_t flags = 0;
+	uint32_t time = body_delta;
+	if (boot_record || first_on_page) {
+		flags |= LOG_RECORD_ABSOLUTE;
+		time = body_time;
+	}
+	if (boot_record) {
+		flags |= LOG_RECORD_BOOT;
+	}
+
+	size_t size = LOG_RECORD_HEADER_SIZE;
+	record[size++] = body[0];
+	record[size++] = body[1];
+	size += log_put_varint(&record[size], time);
+	for (size_t i = body_args; i < body_size; ++i) {
+		record[size++] = body[i];
+	}
+	if (size & 1) {
+		record[size++] = 0;
+	}
+
+	record[0] = (size - LOG_RECORD_HEADER_SIZE) | flags;
+	record[2] = record_seq & 0xFF;
+	record[3] = record_seq >> 8;
+	record[1] = log_record_crc(record, size);
+
+	record_size = size;
+	record_done = 0;
+}
+
+static int log_page_blank(uint32_t page) {
+	for (uint32_t address = page; address < page + LOG_PAGE_SIZE; address += 4) {
+		if (*(const volatile uint32_t *) address != 0xFFFFFFFF) {
+			return 0;
 		}
+	}
+	return 1;
+}
 
-		i++;
-	} while (*s++ != '\0');
+// Move onto the next page round the store. An erase takes all of a call's
+// flash time, so returns 0 if the page had to be erased first.
+static int log_open_page() {
+	uint32_t page = LOG_STORE_START + next_page * LOG_PAGE_SIZE;
+	if (!log_page_blank(page)) {
+		fmc_page_erase(page);
+		log_stats.pages_erased++;
+		return 0;
+	}
+
+	page_seq++;
+	fmc_halfword_program(page, page_seq & 0xFFFF);
+	fmc_halfword_program(page + 2, page_seq >> 16);
+	fmc_halfword_program(page + 4, LOG_PAGE_MAGIC);
 
-	if ((i & 1) == 1) {
-		uint16_t word = prev;
-		log_try_program(log_address, word);
+	page_start = page;
+	log_address = page + LOG_PAGE_HEADER_SIZE;
+	next_page = (next_page + 1) % LOG_PAGE_COUNT;
+	return 1;
+}
+
+static void log_flush_step() {
+	if (!log_enabled) {
+		return;
+	}
+
+	if (record_done == record_size) {
+		if (!log_take()) {
+			return;
+		}
+		log_build_record(0);
+	}
+
+	if (record_done == 0 && (page_start == 0 || log_address + record_size > page_start + LOG_PAGE_SIZE)) {
+		if (!log_open_page()) {
+			return;
+		}
+		log_build_record(1);
+	}
+
+	for (int i = 0; i < LOG_FLUSH_BUDGET && record_done != record_size; ++i) {
+		uint16_t halfword = record[record_done] | (record[record_done + 1] << 8);
+		fmc_halfword_program(log_address, halfword);
 		log_address += 2;
+		record_done += 2;
+	}
+
+	if (record_done == record_size) {
+		record_seq++;
+		boot_record = 0;
 	}
 }
+
+void log_flush() {
+	PROF_ENTER(PROF_LOG_FLUSH);
+	log_flush_step();
+	PROF_EXIT(PROF_LOG_FLUSH);
+}
@@ -1,13 +1,71 @@
 #ifndef LOG_H
 #define LOG_H
-#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
+// Section the format strings are interned into. The linker script keeps it in
+// the ELF without loading it, so it costs no flash - tools/log_decode.py reads
+// it back out to format the log on the host.
+#define LOG_FMT_SECTION ".log_fmt"
+
+// Log a printf-style message. Only the format string's offset in the format
+// section, a timestamp and the arguments are stored, and the text is put back
+// together on the host. Arguments are stored as 32-bit words, so only integer
+// conversions (%d, %u, %x, %c, ...) are supported, and length modifiers are
+// ignored. Up to LOG_MAX_ARGS arguments.
 #define log_printf(fmt, ...) do { \
-	char s[256]; \
-	snprintf(s, 256, fmt, __VA_ARGS__); \
-	log_write(s); \
+	static const char log_fmt[] __attribute__((section(LOG_FMT_SECTION), used)) = fmt; \
+	const uint32_t log_args[] = { 0, ##__VA_ARGS__ }; \
+	log_event(log_fmt, &log_args[1], sizeof(log_args) / sizeof(log_args[0]) - 1); \
 } while (0)
 
+// Log a constant message
+#define log_write(s) log_printf(s)
+
+#define LOG_MAX_ARGS (7)
+
+// Format offset marking a raw record rather than a message. The linker script
+// makes sure no format string can be there.
+#define LOG_FMT_RAW (0x1FFF)
+// Kinds of raw record (0-7)
+#define LOG_RAW_PD (0)
+#define LOG_RAW_PROF (1)
+// Most data a raw record can carry: what's left of the biggest message body
+// after the header, the ms and us varints, the size and the padding. A whole
+// PD message with its SOP* token (31 bytes) still fits.
+#define LOG_RAW_MAX (32)
+
+struct log_stats {
+	// Messages queued, and messages (and bytes) dropped because the RAM ring
+	// was full
+	uint32_t written;
+	uint32_t dropped;
+	uint32_t dropped_bytes;
+	// Most bytes the ring has held at once
+	uint32_t high_water;
+	// Pages erased to make room, oldest first
+	uint32_t pages_erased;
+};
+
+extern struct log_stats log_stats;
+
+// Start flushing to flash, carrying on from where the previous run's log ended
 void log_setup();
-void log_write(char *s);
+// Queue a message (use log_printf/log_write). Never touches flash, so it's
+// safe on time-critical paths.
+void log_event(const char *fmt, const uint32_t *args, size_t count);
+// Queue a raw record - data that isn't a message, for tools to pick out of the
+// log - stamped with time (a swtimer_now() value) to the us. Data over
+// LOG_RAW_MAX bytes is cut short. Returns 0 if the ring was full. Like
+// log_event(), safe on time-critical paths.
+int log_raw(uint8_t kind, uint32_t time, const uint8_t *data, size_t size);
+// Returns 1 if there are queued messages still to go to flash
+int log_pending();
+// Returns 1 if log_flush() has work to do now: messages are pending and
+// log_setup() has been called. Until then they wait in RAM however long the
+// bootloader's window is, so there's nothing to stay awake for.
+int log_flushable();
+// Program some of the queued messages into flash. Stalls the CPU while it does,
+// so only call while nothing time-critical is going on.
+void log_flush();
 #endif
@@ -7,6 +7,10 @@
 #include "led.h"
 #include "log.h"
 #include "pd.h"
+#include "prof.h"
+#include "sink.h"
+#include "sniffer.h"
+#include "swtimer.h"
 
 void gpio_setup() {
 	rcu_periph_clock_enable(RCU_GPIOA);
@@ -26,45 +30,51 @@ void gpio_setup() {
 	gpio_af_set(GPIOA, GPIO_AF_4, i2c_pins);
 	gpio_mode_set(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, i2c_pins);
 	gpio_output_options_set(GPIOA, GPIO_OTYPE_OD, GPIO_OSPEED_50MHZ, i2c_pins);
-}
 
-uint8_t get_signal() {
-	return gpio_input_bit_get(GPIOA, GPIO_PIN_5) == SET ? 1 : 0;
+	// FUSB302 interrupt line (open drain, active low)
+	gpio_mode_set(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, GPIO_PIN_2);
 }
 
-static volatile uint32_t time = 0;
-static volatile int no_bootloader = 0;
-
-void sys_tick_handler() {
-	time++;
+// The adapter asks for the bootloader with a 10 kHz square wave on PA5, so
+// its edges are 50 us apart. Every edge is timed, and a run of
+// BOOTLOADER_EDGES in a row at about that spacing resets into the bootloader.
+// Anything else on the pin (a single glitch, or a slow toggle) starts the
+// count again.
+#define BOOTLOADER_EDGE_MIN_US (35)
+#define BOOTLOADER_EDGE_MAX_US (65)
+#define BOOTLOADER_EDGES (20)
+
+void bootloader_signal_setup() {
+	rcu_periph_clock_enable(RCU_CFGCMP);
+	syscfg_exti_line_config(EXTI_SOURCE_GPIOA, EXTI_SOURCE_PIN5);
+	exti_init(EXTI_5, EXTI_INTERRUPT, EXTI_TRIG_BOTH);
+	exti_interrupt_flag_clear(EXTI_5);
+	nvic_irq_enable(EXTI4_15_IRQn, 3, 0);
+}
 
-	if (no_bootloader) {
+void exti4_15_isr() {
+	if (!exti_interrupt_flag_get(EXTI_5)) {
 		return;
 	}
+	exti_interrupt_flag_clear(EXTI_5);
 
-	static int transitions = 0;
-	static uint8_t prev_signal = 0xFF;
+	static uint32_t prev_edge = 0;
+	static int edges = 0;
 
-	if (prev_signal == 0xFF) {
-		prev_signal = get_signal();
-	}
+	uint32_t now = swtimer_now();
+	uint32_t interval = now - prev_edge;
+	prev_edge = now;
 
-	uint8_t curr_signal = get_signal();
-	if (curr_signal != prev_signal) {
-		transitions++;
-
-		if (transitions == 5) {
-			SCB->AIRCR = (0x05FA << SCB_AIRCR_VECTKEY_Pos) | (1 << SCB_AIRCR_SYSRESETREQ_Pos);
-			while (1);
-		}
+	if (interval < BOOTLOADER_EDGE_MIN_US || interval > BOOTLOADER_EDGE_MAX_US) {
+		edges = 0;
+		return;
 	}
 
-	prev_signal = curr_signal;
-}
-
-void delay(uint32_t duration) {
-	uint32_t start = time;
-	while (time - start <= duration);
+	edges++;
+	if (edges == BOOTLOADER_EDGES) {
+		SCB->AIRCR = (0x05FA << SCB_AIRCR_VECTKEY_Pos) | (1 << SCB_AIRCR_SYSRESETREQ_Pos);
+		while (1);
+	}
 }
 
 void interrupts_setup() {
@@ -101,106 +111,172 @@ void clock_setup() {
 	while ((RCU_CFG0 & RCU_SCSS_PLL) == 0);
 }
 
-void systick_setup() {
-	systick_clksource_set(SYSTICK_CLKSOURCE_HCLK_DIV8);
-	SysTick->LOAD = 8999;
-	SysTick->CTRL |= (1 << SysTick_CTRL_TICKINT_Pos) | (1 << SysTick_CTRL_ENABLE_Pos);
-}
+// How long the adapter has to signal for the bootloader after power-up
+#define BOOTLOADER_WINDOW_US (1000000)
 
-void die() {
-	led_set_rgb(0b100);
-	while (1);
-}
+static struct swtimer bootloader_window;
 
-int main() {
-	interrupts_setup();
-	clock_setup();
-	gpio_setup();
-	pd_setup();
-	systick_setup();
+// How often the share of time spent awake is logged
+#define POWER_REPORT_INTERVAL_US (60000000)
 
-	led_set_rgb(0b001);
+// Time spent asleep in main_sleep(), since the last report
+static struct {
+	uint32_t sleeps;
+	uint32_t asleep_us;
+	uint32_t since;
+} power_stats;
 
-	delay(1000);
-	log_setup();
-	no_bootloader = 1;
+static struct swtimer power_report_timer;
 
-	if (!pd_try_attach()) {
-		die();
-	}
+void power_report(struct swtimer *timer) {
+	(void) timer;
 
-	log_write("Init complete");
+	uint32_t now = swtimer_now();
+	uint32_t elapsed = now - power_stats.since;
+	uint32_t awake = 1000 - (uint32_t) ((uint64_t) power_stats.asleep_us * 1000 / elapsed);
+	log_printf(
+		"power: awake=%u.%u%%,wakeups=%u",
+		awake / 10, awake % 10, power_stats.sleeps
+	);
 
-	led_set_rgb(0b010);
+	power_stats.sleeps = 0;
+	power_stats.asleep_us = 0;
+	power_stats.since = now;
+}
 
-	struct pd_message message;
-	int requested_pdo_idx = -1;
-	int msg_id = 1;
+#ifdef PROFILE
+// How often the profiling statistics are written to the log
+#define PROF_SAVE_INTERVAL_US (60000000)
 
-	int led = 0b010;
-	while (1) {
-		if (requested_pdo_idx >= 0) {
-			log_printf("pdo=%d,mi=%d", requested_pdo_idx, msg_id);
+static struct swtimer prof_save_timer;
+
+void prof_save_due(struct swtimer *timer) {
+	(void) timer;
+	prof_save();
+}
+#endif
 
-			uint16_t header = 0b0001000010000010;
-			header |= msg_id++ << 9;
-			msg_id &= 0b111;
+void bootloader_window_closed(struct swtimer *timer) {
+	(void) timer;
 
-			uint32_t pdo = 0;
-			pdo |= (requested_pdo_idx + 1) << 28;
-			pdo |= (200 / 10) << 10;
-			pdo |= 500 / 10;
+	exti_interrupt_disable(EXTI_5);
+	exti_interrupt_flag_clear(EXTI_5);
 
-			struct pd_message_standard payload;
-			payload.data_objects[0] = pdo;
+	// Only now that the bootloader can no longer be asked to read it out is
+	// the log in flash touched. Until then messages wait in RAM.
+	log_setup();
 
-			pd_tx_standard(header, &payload);
+	log_write("Init complete");
+	log_printf(
+		"regs: tx=%u,saved=%u,failed=%u",
+		pd_reg_stats.transactions, pd_reg_stats.avoided_transactions, pd_reg_stats.failed_writes
+	);
+	log_printf(
+		"boot: request=%uus,contract=%uus",
+		sink_stats.first_request_time, sink_stats.first_contract_time
+	);
+	log_printf("log: dropped=%u,max=%u", log_stats.dropped, log_stats.high_water);
+
+	power_report(NULL);
+	swtimer_init(&power_report_timer, power_report, NULL);
+	swtimer_start(&power_report_timer, POWER_REPORT_INTERVAL_US, POWER_REPORT_INTERVAL_US);
+
+#ifdef PROFILE
+	// Covers the negotiation, and then keeps a recent copy in flash
+	prof_save();
+	swtimer_init(&prof_save_timer, prof_save_due, NULL);
+	swtimer_start(&prof_save_timer, PROF_SAVE_INTERVAL_US, PROF_SAVE_INTERVAL_US);
+#endif
+}
 
-			requested_pdo_idx = -1;
-		}
+void attached();
 
-		if (pd_poll_rxfifo(&message)) {
-			do {
-				led_set_rgb(led);
-				led ^= 0b010;
+void detached() {
+	// Back to unattached, and wait for the next source
+	led_set_rgb(0b001);
+	pd_attach_start(attached);
+}
 
-				log_printf("hdr=%04x", message.header);
+void attached() {
+	led_set_rgb(0b010);
+#ifdef SNIFFER
+	sniffer_start(detached);
+#else
+	sink_start(detached);
+#endif
+}
 
-				uint8_t message_type = message.header & 0b1111;
-				uint8_t message_id = (message.header >> 9) & 0b111;
-				uint8_t number_of_data_objects = (message.header >> 12) & 0b111;
-				uint8_t extended = (message.header >> 15) & 0b1;
-				uint8_t spec_revision = (message.header >> 6) & 0b11;
+// Returns 1 if the sink (or sniffer) isn't in the middle of anything that
+// programming flash could hold up
+static int app_idle() {
+#ifdef SNIFFER
+	return sniffer_idle();
+#else
+	return sink_idle();
+#endif
+}
 
-				log_printf(
-					"mt=%x,mid=%x,dos=%x,ext=%d,sr=%d",
-					message_type, message_id, number_of_data_objects, extended, spec_revision
-				);
+// Returns 1 if the main loop has something to do straight away
+static int main_busy() {
+	uint32_t deadline;
+	if (swtimer_next_deadline(&deadline) && (int32_t) (deadline - swtimer_now()) <= 0) {
+		return 1;
+	}
 
-				if (extended == 0) {
-					struct pd_message_standard *payload = &message.payload.standard;
+	return pd_interrupt_asserted() || (log_flushable() && app_idle());
+}
 
-					if (number_of_data_objects != 0 && message_type == 0b00001) {
-						for (int i = 0; i < number_of_data_objects; ++i) {
-							uint32_t pdo = payload->data_objects[i];
+// Sleep until the next interrupt: INT_N (EXTI2), a swtimer deadline (TIMER1),
+// or I2C. Interrupts are masked while checking, so one that comes in between
+// the check and WFI still ends the sleep straight away.
+//
+// Deep-sleep would stop TIMER1, which times everything in the PD protocol, so
+// this is plain sleep mode.
+static void main_sleep() {
+	__disable_irq();
+	if (!main_busy()) {
+		uint32_t start = swtimer_now();
+		__WFI();
+		power_stats.asleep_us += swtimer_now() - start;
+		power_stats.sleeps++;
+	}
+	__enable_irq();
+}
+
+int main() {
+	interrupts_setup();
+	clock_setup();
+	gpio_setup();
+	swtimer_setup();
+	pd_setup();
+	bootloader_signal_setup();
+#ifdef PROFILE
+	prof_setup();
+#endif
 
-							log_printf("pdo=%08lx", pdo);
+	led_set_rgb(0b001);
 
-							if (((pdo >> 30) & 0b11) == 0) {
-								requested_pdo_idx = i;
-							}
-						}
-					}
-				} else {
-					struct pd_message_extended *payload = &message.payload.extended;
+	// Attach and negotiate while the bootloader signal is still being watched
+	swtimer_init(&bootloader_window, bootloader_window_closed, NULL);
+	swtimer_start(&bootloader_window, BOOTLOADER_WINDOW_US, 0);
 
-					log_printf("Extended header = %04x", payload->extended_header);
+	pd_attach_start(attached);
 
-					for (int i = 0; i < (payload->extended_header & 0x1FF); ++i) {
-						log_printf("%02x", payload->data[i]);
-					}
-				}
-			} while (pd_poll_rxfifo(&message));
+	while (1) {
+		PROF_ENTER(PROF_MAIN_LOOP);
+		swtimer_poll();
+		pd_attach_poll();
+#ifdef SNIFFER
+		sniffer_poll();
+#else
+		sink_poll();
+#endif
+
+		if (app_idle()) {
+			log_flush();
 		}
+		PROF_EXIT(PROF_MAIN_LOOP);
+
+		main_sleep();
 	}
 }
@@ -11,388 +11,357 @@
 //     USB PD V3.0 R2.0/USB_PD_R3_0 V2.0 20190829 + ECNs 2020-02-07.pdf
 //   SHA256: 2e52ba62bc2a7d723d17cdea15d56c23c039ac9c8a744f004da18a7114b44f85
 #include "pd.h"
-#include <gd32f1x0.h>
-#include <core_cm3.h>
-#include "gd32f1x0_libopt.h"
+#include <string.h>
 #include "log.h"
-
-#define FUSB302_ADDRESS (0x44)
-
-extern void delay(uint32_t duration);
+#include "pd_i2c.h"
+#include "prof.h"
+#include "swtimer.h"
 
 void pd_setup() {
-	rcu_periph_clock_enable(RCU_I2C1);
+	pd_i2c_setup();
+}
 
-	i2c_clock_config(I2C1, 100000, I2C_DTCY_2);
-	i2c_mode_addr_config(I2C1, I2C_I2CMODE_ENABLE, I2C_ADDFORMAT_7BITS, 0);
-	i2c_ack_config(I2C1, I2C_ACK_ENABLE);
-	i2c_ackpos_config(I2C1, I2C_ACKPOS_CURRENT);
-	i2c_enable(I2C1);
+// Rather than measuring each CC pin in turn from the MCU, attach leaves the
+// FUSB302's toggle state machine (in sink-only mode) to watch both pins for Rp.
+// It raises I_TOGDONE with the orientation in STATUS1A once one is seen, which
+// takes a single toggle period rather than a series of fixed waits.
+//
+// See FUSB302-D datasheet Rev 2 (July 2017), "Toggle Functionality"
+enum pd_attach_step {
+	PD_ATTACH_IDLE,
+	// Waiting for I_TOGDONE
+	PD_ATTACH_TOGGLE,
+};
+
+struct pd_attach_stats pd_attach_stats;
+
+static enum pd_attach_step attach_step = PD_ATTACH_IDLE;
+static pd_attach_callback attach_callback;
+static uint32_t attach_start_time;
+
+static void pd_attach_toggle() {
+	// Only I_TOGDONE may assert INT_N while toggling
+	pd_reg_set(PD_REG_MASK1, 0xFF);
+	pd_reg_set(PD_REG_MASKA, (uint8_t) ~PD_INTERRUPTA_I_TOGDONE);
+	pd_reg_set(PD_REG_MASKB, PD_INTERRUPTB_I_GCRCSENT);
+	pd_reg_set(PD_REG_CONTROL0, PD_CONTROL0_HOST_CUR_USB);
+
+	// The toggle logic drives the CC switches itself, and needs the bandgap,
+	// receiver and measure block powered
+	pd_reg_set(PD_REG_SWITCHES0, 0);
+	pd_reg_set(PD_REG_POWER, 0x07);
+	pd_reg_set(PD_REG_CONTROL2, PD_CONTROL2_MODE_SNK | PD_CONTROL2_TOGGLE);
+	pd_reg_flush();
+
+	attach_step = PD_ATTACH_TOGGLE;
 }
 
-int pd_try_attach() {
-	// Perform a complete reset
+static void pd_attach_configure(int cc) {
+	// Stop toggling, leaving the switches as configured below. This only resets
+	// the PD logic - a SW_RES here would put every register written below back
+	// to its default.
+	pd_reg_set(PD_REG_CONTROL2, PD_CONTROL2_MODE_SNK);
 	pd_write_reg(PD_REG_RESET, PD_RESET_PD_RESET);
-	pd_write_reg(PD_REG_RESET, PD_RESET_PD_RESET | PD_RESET_SW_RES);
-
-	delay(5);
-
-	// Turn on all internal enables
-	pd_write_reg(PD_REG_POWER, 0xF);
-
-	// Present Rd pull-downs on CC1 and CC2, measure CC1
-	pd_write_reg(PD_REG_SWITCHES0, PD_SWITCHES0_MEAS_CC1 | PD_SWITCHES0_PDWN2 | PD_SWITCHES0_PDWN1);
-	delay(2);
-	uint8_t meas_cc1_status0 = pd_read_reg(PD_REG_STATUS0);
-	// Disable measurement
-	pd_write_reg(PD_REG_SWITCHES0, PD_SWITCHES0_PDWN2 | PD_SWITCHES0_PDWN1);
-
-	// Present Rd pull-downs on CC1 and CC2, measure CC2
-	pd_write_reg(PD_REG_SWITCHES0, PD_SWITCHES0_MEAS_CC2 | PD_SWITCHES0_PDWN2 | PD_SWITCHES0_PDWN1);
-	delay(2);
-	uint8_t meas_cc2_status0 = pd_read_reg(PD_REG_STATUS0);
-	// Disable measurement
-	pd_write_reg(PD_REG_SWITCHES0, PD_SWITCHES0_PDWN2 | PD_SWITCHES0_PDWN1);
-
-	// Determine orientation (from type-C spec):
-	//   Once the Sink is powered, the Sink monitors CC1 and CC2 for a voltage
-	//   greater than its local ground.  The CC pin that is at a higher voltage
-	//   (i.e. pulled up by Rp in the Source) indicates the orientation of the
-	//   plug. 
-	uint8_t cc1_bc_lvl = meas_cc1_status0 & PD_STATUS0_BC_LVL_MASK;
-	uint8_t cc2_bc_lvl = meas_cc2_status0 & PD_STATUS0_BC_LVL_MASK;
-
-	if (cc1_bc_lvl != 0 && cc2_bc_lvl != 0) {
-		// Both pins were high, so we weren't able to tell which pin we should
-		// use to do PD communication on
-		return 0;
-	}
-
-	// Send a hard reset to restart the process now that we know which CC pin to
-	// communicate on
-	pd_write_reg(PD_REG_CONTROL3, PD_CONTROL3_SEND_HARD_RESET);
-	// Perform another full reset of the FUSB302
-	pd_write_reg(PD_REG_RESET, PD_RESET_PD_RESET | PD_RESET_SW_RES);
-
-	delay(5);
 
 	// Enable 3 retries and automatic retry for missing GoodCRC
-	pd_write_reg(PD_REG_CONTROL3, (3 << PD_CONTROL3_N_RETRIES_POS) | PD_CONTROL3_AUTO_RETRY);
+	pd_reg_set(PD_REG_CONTROL3, (3 << PD_CONTROL3_N_RETRIES_POS) | PD_CONTROL3_AUTO_RETRY);
 
-	// One last PD reset for good luck
-	pd_write_reg(PD_REG_RESET, PD_RESET_PD_RESET | PD_RESET_SW_RES);
-
-	if (cc1_bc_lvl != 0) {
-		// CC1 was highest - use CC1 for PD communication
-		pd_write_reg(
+	if (cc == 1) {
+		// Source is on CC1 - use CC1 for PD communication
+		pd_reg_set(
 			PD_REG_SWITCHES0,
 			PD_SWITCHES0_MEAS_CC1 | PD_SWITCHES0_PDWN2 | PD_SWITCHES0_PDWN1
 		);
-		pd_write_reg(
+		pd_reg_set(
 			PD_REG_SWITCHES1,
 			(0b10 << PD_SWITCHES1_SPECREV_POS) | PD_SWITCHES1_AUTO_CRC | PD_SWITCHES1_TXCC1
 		);
 	} else {
-		// CC2 was highest - use CC2 for PD communication
-		pd_write_reg(
+		// Source is on CC2 - use CC2 for PD communication
+		pd_reg_set(
 			PD_REG_SWITCHES0,
 			PD_SWITCHES0_MEAS_CC2 | PD_SWITCHES0_PDWN2 | PD_SWITCHES0_PDWN1
 		);
-		pd_write_reg(
+		pd_reg_set(
 			PD_REG_SWITCHES1,
 			(0b10 << PD_SWITCHES1_SPECREV_POS) | PD_SWITCHES1_AUTO_CRC | PD_SWITCHES1_TXCC2
 		);
 	}
 
+	// Only interrupt on the events pd_take_events reports
+	pd_reg_set(
+		PD_REG_MASK1,
+		PD_INTERRUPT_I_ACTIVITY | PD_INTERRUPT_I_CRC_CHK | PD_INTERRUPT_I_ALERT | PD_INTERRUPT_I_WAKE
+	);
+	pd_reg_set(PD_REG_MASKA, PD_INTERRUPTA_I_OCP_TEMP | PD_INTERRUPTA_I_TOGDONE);
+	pd_reg_set(PD_REG_MASKB, 0);
+
 	// Turn on all internal enables
-	pd_write_reg(PD_REG_POWER, 0xF);
+	pd_reg_set(PD_REG_POWER, 0xF);
 
-	return 1;
+	// SWITCHES0 through MASKB go out as a single burst
+	pd_reg_flush();
 }
 
-int pd_poll_rxfifo(struct pd_message *message) {
-	uint8_t status1 = pd_read_reg(PD_REG_STATUS1);
-	if ((status1 & PD_STATUS1_RX_EMPTY) == PD_STATUS1_RX_EMPTY) {
-		return 0;
-	}
+void pd_attach_start(pd_attach_callback callback) {
+	attach_callback = callback;
+	attach_start_time = swtimer_now();
+	pd_tx_reset();
 
-	uint8_t sop_token;
-	pd_read_fifo(&sop_token, sizeof(sop_token));
+	// Perform a complete reset
+	pd_write_reg(PD_REG_RESET, PD_RESET_PD_RESET | PD_RESET_SW_RES);
+	pd_attach_toggle();
+}
 
-	if ((sop_token & PD_RXFIFO_TOK_SOP_MASK) != PD_RXFIFO_TOK_SOP) {
-		// TODO: We probably need to flush the RX FIFO here, since we don't
-		// know how to deal with the packet that's in there.
-		pd_write_reg(PD_REG_CONTROL1, pd_read_reg(PD_REG_CONTROL1) | (1 << 2));
-		return 0;
+void pd_attach_poll() {
+	if (attach_step != PD_ATTACH_TOGGLE || !pd_i2c_int_pending()) {
+		return;
 	}
 
-	uint16_t header;
-	pd_read_fifo((uint8_t *) &header, sizeof(header));
-	message->header = header;
-
-	uint8_t extended = (header >> 15) & 0b1;
-	if (extended == 0) {
-		struct pd_message_standard *payload = &message->payload.standard;
-
-		uint8_t number_of_data_objects = (header >> 12) & 0b111;
-		if (number_of_data_objects != 0) {
-			pd_read_fifo(
-				(uint8_t *) &payload->data_objects,
-				number_of_data_objects * sizeof(payload->data_objects[0])
-			);
-		}
-	} else {
-		struct pd_message_extended *payload = &message->payload.extended;
-
-		uint16_t extended_header;
-		pd_read_fifo((uint8_t *) &extended_header, sizeof(extended_header));
-		payload->extended_header = extended_header;
-
-		uint8_t data_size = extended_header & 0x1FF;
-		if (data_size != 0) {
-			pd_read_fifo(payload->data, data_size);
-		}
+	uint8_t interrupta = pd_read_reg(PD_REG_INTERRUPTA);
+	if ((interrupta & PD_INTERRUPTA_I_TOGDONE) == 0) {
+		return;
 	}
 
-	pd_read_fifo((uint8_t *) &message->crc, sizeof(message->crc));
-
-	return 1;
-}
-
-void pd_tx_standard(uint16_t header, struct pd_message_standard *payload) {
-	uint8_t data[48];
-	size_t count = 0;
-
-	uint8_t number_of_data_objects = (header >> 12) & 0b111;
-	// Total message length is 16-bit header (2 bytes) + 4 bytes per data object
-	uint8_t message_length = 2 + number_of_data_objects * 4;
-
-	// SOP header
-	data[count++] = PD_TXFIFO_TOK_SOP1;
-	data[count++] = PD_TXFIFO_TOK_SOP1;
-	data[count++] = PD_TXFIFO_TOK_SOP1;
-	data[count++] = PD_TXFIFO_TOK_SOP2;
-
-	// PACKSYM for message bytes
-	data[count++] = PD_TXFIFO_TOK_PACKSYM(message_length);
-
-	// Message header
-	data[count++] = header & 0xFF;
-	data[count++] = (header >> 4) & 0xFF;
-
-	// Data objects
-	for (int i = 0; i < number_of_data_objects; ++i) {
-		uint32_t data_object = payload->data_objects[i];
-		data[count++] = data_object & 0xFF;
-		data[count++] = (data_object >> 8) & 0xFF;
-		data[count++] = (data_object >> 16) & 0xFF;
-		data[count++] = (data_object >> 24) & 0xFF;
+	uint8_t togss = pd_read_reg(PD_REG_STATUS1A) & PD_STATUS1A_TOGSS_MASK;
+	int cc = 0;
+	if (togss == PD_STATUS1A_TOGSS_SNK_CC1) {
+		cc = 1;
+	} else if (togss == PD_STATUS1A_TOGSS_SNK_CC2) {
+		cc = 2;
 	}
 
-	// Message trailer
-	data[count++] = PD_TXFIFO_TOK_JAM_CRC;
-	data[count++] = PD_TXFIFO_TOK_EOP;
-	data[count++] = PD_TXFIFO_TOK_TXOFF;
-
-	// Write to FIFO and start TX
-	pd_write_fifo(data, count);
-	pd_write_reg(PD_REG_CONTROL0, PD_CONTROL0_TX_START);
-}
+	if (cc == 0) {
+		// Something other than a source (e.g. Ra only) - go back to toggling
+		pd_attach_stats.toggle_restarts++;
+		pd_reg_set(PD_REG_CONTROL2, PD_CONTROL2_MODE_SNK);
+		pd_reg_flush();
+		pd_attach_toggle();
+		return;
+	}
 
-void pd_tx_extended(uint16_t header, struct pd_message_extended *payload) {
-	uint8_t data[48];
-	size_t count = 0;
+	pd_attach_configure(cc);
 
-	uint8_t data_size = payload->extended_header & 0x1FF;
-	// Total message length is 16-bit header (2 bytes) + 16-bit extended header
-	// (2 bytes) + data size
-	uint8_t message_length = 4 + data_size;
+	pd_attach_stats.attaches++;
+	pd_attach_stats.attach_time = swtimer_now() - attach_start_time;
 
-	// SOP header
-	data[count++] = PD_TXFIFO_TOK_SOP1;
-	data[count++] = PD_TXFIFO_TOK_SOP1;
-	data[count++] = PD_TXFIFO_TOK_SOP1;
-	data[count++] = PD_TXFIFO_TOK_SOP2;
+	attach_step = PD_ATTACH_IDLE;
+	attach_callback();
+}
 
-	// PACKSYM for message bytes
-	data[count++] = PD_TXFIFO_TOK_PACKSYM(message_length);
+int pd_attach_busy() {
+	return attach_step != PD_ATTACH_IDLE;
+}
 
-	// Message header
-	data[count++] = header & 0xFF;
-	data[count++] = (header >> 4) & 0xFF;
+// Each read of the FUSB302's state is a single transaction. The read starts at
+// INTERRUPTA and auto-increments through INTERRUPTB, STATUS0, STATUS1 and
+// INTERRUPT into FIFOS, which doesn't auto-increment, so if STATUS1 shows the
+// RX FIFO isn't empty the same read carries on to drain a message from it: SOP
+// token, header, data objects and CRC. The read is grown from pd_rx_extend as
+// the status and header come in.
+#define PD_RX_OFFSET_INTERRUPTA (0)
+#define PD_RX_OFFSET_INTERRUPTB (1)
+#define PD_RX_OFFSET_STATUS0 (2)
+#define PD_RX_OFFSET_STATUS1 (3)
+#define PD_RX_OFFSET_INTERRUPT (4)
+#define PD_RX_OFFSET_TOKEN (5)
+#define PD_RX_OFFSET_HEADER (6)
+#define PD_RX_OFFSET_PAYLOAD (8)
+#define PD_RX_CRC_SIZE (4)
+
+struct pd_rx_stats pd_rx_stats;
+
+static uint8_t rx_buffer[PD_RX_OFFSET_PAYLOAD + 7 * 4 + PD_RX_CRC_SIZE];
+static uint16_t pending_events = 0;
+static uint8_t last_status0 = 0;
+static int rx_more = 0;
+static pd_rx_monitor rx_monitor = NULL;
+
+static int pd_rx_token_valid(uint8_t token) {
+	// SOP, SOP', SOP'', SOP'_Debug and SOP''_Debug are 111, 110, 101, 100 and
+	// 011 in the top 3 bits - anything below that isn't a message
+	return (token >> 5) >= 0b011;
+}
 
-	// Extended header
-	data[count++] = payload->extended_header & 0xFF;
-	data[count++] = (payload->extended_header >> 4) & 0xFF;
+static void pd_rx_extend(struct pd_i2c_transfer *transfer, size_t received) {
+	uint8_t *data = transfer->rx_data;
 
-	// Data
-	for (int i = 0; i < data_size; ++i) {
-		data[count++] = payload->data[i];
+	if (received == PD_RX_OFFSET_STATUS1 + 1) {
+		if ((data[PD_RX_OFFSET_STATUS1] & PD_STATUS1_RX_EMPTY) == 0) {
+			// At least a token, header and CRC are waiting
+			transfer->rx_count = PD_RX_OFFSET_PAYLOAD + PD_RX_CRC_SIZE;
+		}
+	} else if (received == PD_RX_OFFSET_TOKEN + 1) {
+		if (!pd_rx_token_valid(data[PD_RX_OFFSET_TOKEN])) {
+			// Don't know how long this is - stop after the byte already in
+			// flight and let the caller flush the FIFO
+			transfer->rx_count = received + 1;
+		}
+	} else if (received == PD_RX_OFFSET_PAYLOAD) {
+		uint16_t header = data[PD_RX_OFFSET_HEADER] | (data[PD_RX_OFFSET_HEADER + 1] << 8);
+		// Extended messages are padded out to whole data objects too, so the
+		// data object count is the length on the wire either way
+		transfer->rx_count = PD_RX_OFFSET_PAYLOAD + pd_header_count(header) * 4 + PD_RX_CRC_SIZE;
 	}
-
-	// Message trailer
-	data[count++] = PD_TXFIFO_TOK_JAM_CRC;
-	data[count++] = PD_TXFIFO_TOK_EOP;
-	data[count++] = PD_TXFIFO_TOK_TXOFF;
-
-	// Write to FIFO and start TX
-	pd_write_fifo(data, count);
-	pd_write_reg(PD_REG_CONTROL0, PD_CONTROL0_TX_START);
 }
 
-void pd_write_reg(uint8_t reg, uint8_t value) {
-	// See FUSB302 datasheet, Figure 13 "I2C Write Example"
-
-	// Wait for bus idle
-	while (i2c_flag_get(I2C1, I2C_FLAG_I2CBSY));
-
-	// Send start condition
-	i2c_start_on_bus(I2C1);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_SBSEND));
+static void pd_rx_decode(uint8_t *data, struct pd_message *message) {
+	uint16_t header = data[PD_RX_OFFSET_HEADER] | (data[PD_RX_OFFSET_HEADER + 1] << 8);
+	message->header = header;
 
-	// Send slave address
-	i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_TRANSMITTER);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_ADDSEND));
-	i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+	uint8_t *payload_data = &data[PD_RX_OFFSET_PAYLOAD];
+	size_t payload_size = pd_header_count(header) * 4;
 
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+	if (!pd_header_extended(header)) {
+		struct pd_message_standard *payload = &message->payload.standard;
+		memcpy(payload->data_objects, payload_data, payload_size);
+	} else if (payload_size >= 2) {
+		struct pd_message_extended *payload = &message->payload.extended;
 
-	// Send register address
-	i2c_data_transmit(I2C1, reg);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+		uint16_t extended_header = payload_data[0] | (payload_data[1] << 8);
+		payload->extended_header = extended_header;
 
-	// Send register value
-	i2c_data_transmit(I2C1, value);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+		size_t data_size = pd_extended_header_data_size(extended_header);
+		if (data_size > payload_size - 2) {
+			data_size = payload_size - 2;
+		}
+		if (data_size > sizeof(payload->data)) {
+			data_size = sizeof(payload->data);
+		}
+		memcpy(payload->data, &payload_data[2], data_size);
+	} else {
+		message->payload.extended.extended_header = 0;
+	}
 
-	// Send stop condition
-	i2c_stop_on_bus(I2C1);
-	while (I2C_CTL0(I2C1) & 0x0200);
+	memcpy(&message->crc, &payload_data[payload_size], sizeof(message->crc));
 }
 
-void pd_write_fifo(uint8_t *data, size_t count) {
-	// See FUSB302 datasheet, Figure 13 "I2C Write Example"
-
-	// Wait for bus idle
-	while (i2c_flag_get(I2C1, I2C_FLAG_I2CBSY));
-
-	// Send start condition
-	i2c_start_on_bus(I2C1);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_SBSEND));
-
-	// Send slave address
-	i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_TRANSMITTER);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_ADDSEND));
-	i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
-
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+static void pd_rx_collect_events(uint8_t *data) {
+	uint8_t interrupta = data[PD_RX_OFFSET_INTERRUPTA];
+	uint8_t interruptb = data[PD_RX_OFFSET_INTERRUPTB];
+	uint8_t interrupt = data[PD_RX_OFFSET_INTERRUPT];
+	last_status0 = data[PD_RX_OFFSET_STATUS0];
 
-	i2c_data_transmit(I2C1, PD_REG_FIFOS);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
-
-	// Send FIFO data
-	for (size_t i = 0; i < count; ++i) {
-		i2c_data_transmit(I2C1, data[i]);
-		while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+	uint16_t events = 0;
+	if (interruptb & PD_INTERRUPTB_I_GCRCSENT) {
+		events |= PD_EVENT_RX;
+	}
+	if (interrupta & PD_INTERRUPTA_I_TXSENT) {
+		events |= PD_EVENT_TX_SENT;
+	}
+	if (interrupta & (PD_INTERRUPTA_I_RETRYFAIL | PD_INTERRUPTA_I_SOFTFAIL)) {
+		events |= PD_EVENT_RETRY_FAIL;
+	}
+	if (interrupta & PD_INTERRUPTA_I_HARDRST) {
+		events |= PD_EVENT_HARD_RESET;
+	}
+	if (interrupta & PD_INTERRUPTA_I_SOFTRST) {
+		events |= PD_EVENT_SOFT_RESET;
+	}
+	if (interrupta & PD_INTERRUPTA_I_HARDSENT) {
+		events |= PD_EVENT_HARD_SENT;
+	}
+	if (interrupt & (PD_INTERRUPT_I_BC_LVL | PD_INTERRUPT_I_COMP_CHNG)) {
+		events |= PD_EVENT_CC_CHANGE;
+	}
+	if (interrupt & PD_INTERRUPT_I_VBUSOK) {
+		events |= PD_EVENT_VBUS_CHANGE;
+	}
+	if (interrupt & PD_INTERRUPT_I_COLLISION) {
+		events |= PD_EVENT_COLLISION;
 	}
 
-	// Send stop condition
-	i2c_stop_on_bus(I2C1);
-	while (I2C_CTL0(I2C1) & 0x0200);
+	pending_events |= events;
 }
 
-uint8_t pd_read_reg(uint8_t reg) {
-	// See FUSB302 datasheet, Figure 14 "I2C Read Example"
-
-	// Wait for bus idle
-	while (i2c_flag_get(I2C1, I2C_FLAG_I2CBSY));
-
-	// Send start condition
-	i2c_start_on_bus(I2C1);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_SBSEND));
-
-	// Send slave address
-	i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_TRANSMITTER);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_ADDSEND));
-	i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
-
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
-
-	// Send register address
-	i2c_data_transmit(I2C1, reg);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
-
-	// Send start condition
-	i2c_start_on_bus(I2C1);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_SBSEND));
-
-	// Send slave address
-	i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_RECEIVER);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_ADDSEND));
-	i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
-
-	// Send NACK immediately, since we're only reading one byte
-	i2c_ack_config(I2C1, I2C_ACK_DISABLE);
-
-	// Read register value
-	while (!i2c_flag_get(I2C1, I2C_FLAG_RBNE));
-	uint8_t value = i2c_data_receive(I2C1);
-
-	// Re-enable sending ACKs
-	i2c_ack_config(I2C1, I2C_ACK_ENABLE);
+int pd_interrupt_pending() {
+	return pd_i2c_int_pending() || rx_more;
+}
 
-	// Send stop condition
-	i2c_stop_on_bus(I2C1);
-	while (I2C_CTL0(I2C1) & 0x0200);
+int pd_interrupt_asserted() {
+	return pd_i2c_int_asserted() || rx_more;
+}
 
-	return value;
+uint8_t pd_status0() {
+	return last_status0;
 }
 
-void pd_read_fifo(uint8_t *data, size_t count) {
-	// See FUSB302 datasheet, Figure 14 "I2C Read Example"
+uint16_t pd_take_events() {
+	uint16_t events = pending_events;
+	pending_events = 0;
+	return events;
+}
 
-	// Wait for bus idle
-	while (i2c_flag_get(I2C1, I2C_FLAG_I2CBSY));
+void pd_set_rx_monitor(pd_rx_monitor monitor) {
+	rx_monitor = monitor;
+}
 
-	// Send start condition
-	i2c_start_on_bus(I2C1);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_SBSEND));
+static int pd_rx_poll(struct pd_message *message) {
+	while (1) {
+		uint32_t time = swtimer_now();
+		struct pd_i2c_transfer transfer = {
+			.reg = PD_REG_INTERRUPTA,
+			.rx_data = rx_buffer,
+			// Interrupt and status registers, ending with INTERRUPT which is
+			// already clocking in by the time STATUS1 can be looked at
+			.rx_count = PD_RX_OFFSET_TOKEN,
+			.extend = pd_rx_extend,
+		};
+		if (pd_i2c_transfer(&transfer) != PD_I2C_DONE) {
+			return 0;
+		}
 
-	// Send slave address
-	i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_TRANSMITTER);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_ADDSEND));
-	i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+		pd_rx_collect_events(rx_buffer);
+		pd_tx_interrupt(rx_buffer[PD_RX_OFFSET_INTERRUPTA], rx_buffer[PD_RX_OFFSET_INTERRUPT]);
 
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+		if (rx_buffer[PD_RX_OFFSET_STATUS1] & PD_STATUS1_RX_FULL) {
+			pd_rx_stats.full++;
+		}
 
-	i2c_data_transmit(I2C1, PD_REG_FIFOS);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_TBE));
+		if (transfer.rx_count == PD_RX_OFFSET_TOKEN) {
+			return 0;
+		}
 
-	// Send start condition
-	i2c_start_on_bus(I2C1);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_SBSEND));
+		uint8_t token = rx_buffer[PD_RX_OFFSET_TOKEN];
+		if (!pd_rx_token_valid(token)) {
+			pd_rx_stats.flushed++;
+			pd_reg_strobe(PD_REG_CONTROL1, PD_CONTROL1_RX_FLUSH);
+			return 0;
+		}
 
-	// Send slave address
-	i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_RECEIVER);
-	while (!i2c_flag_get(I2C1, I2C_FLAG_ADDSEND));
-	i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+		pd_rx_stats.messages++;
+		if (rx_monitor != NULL) {
+			size_t size = transfer.rx_count - PD_RX_OFFSET_TOKEN - PD_RX_CRC_SIZE;
+			rx_monitor(time, &rx_buffer[PD_RX_OFFSET_TOKEN], size);
+		}
 
-	for (size_t i = 0; i < count; ++i) {
-		// Is this the last byte?
-		if (i == count - 1) {
-			// Send NACK to stop read
-			i2c_ack_config(I2C1, I2C_ACK_DISABLE);
+		// SOP'/SOP'' messages have been read out of the FIFO in full, so they
+		// can just be dropped without flushing
+		if ((token & PD_RXFIFO_TOK_SOP_MASK) == PD_RXFIFO_TOK_SOP) {
+			PROF_ENTER(PROF_RX_DECODE);
+			pd_rx_decode(rx_buffer, message);
+			PROF_EXIT(PROF_RX_DECODE);
+			return 1;
 		}
+	}
+}
+
+int pd_poll_rxfifo(struct pd_message *message) {
+	PROF_ENTER(PROF_RX_POLL);
+	int received = pd_rx_poll(message);
+	PROF_EXIT(PROF_RX_POLL);
+	return received;
+}
 
-		// Read register value
-		while (!i2c_flag_get(I2C1, I2C_FLAG_RBNE));
-		data[i] = i2c_data_receive(I2C1);
+int pd_drain_rxfifo(struct pd_message *messages, int max) {
+	int count = 0;
+	while (count < max && pd_poll_rxfifo(&messages[count])) {
+		count++;
 	}
 
-	// Re-enable sending ACKs
-	i2c_ack_config(I2C1, I2C_ACK_ENABLE);
+	// Reading the interrupt registers releases INT_N, so if the batch filled
+	// up there may be messages left in the FIFO with nothing to signal them
+	rx_more = count == max;
 
-	// Send stop condition
-	i2c_stop_on_bus(I2C1);
-	while (I2C_CTL0(I2C1) & 0x0200);
+	return count;
 }
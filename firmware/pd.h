@@ -2,6 +2,7 @@
 #define PD_H
 #include <stddef.h>
 #include <stdint.h>
+#include "pd_msg.h"
 
 #define PD_REG_DEVICE_ID (0x01)
 #define PD_REG_SWITCHES0 (0x02)
@@ -17,7 +18,8 @@
 #define PD_REG_RESET (0x0c)
 #define PD_REG_OCPREG (0x0d)
 #define PD_REG_MASKA (0x0e)
-#define PD_REG_CONTROL4 (0x0f)
+#define PD_REG_MASKB (0x0f)
+#define PD_REG_CONTROL4 (0x10)
 #define PD_REG_STATUS0A (0x3c)
 #define PD_REG_STATUS1A (0x3d)
 #define PD_REG_INTERRUPTA (0x3e)
@@ -35,14 +37,50 @@
 #define PD_SWITCHES1_AUTO_CRC (1 << 2)
 #define PD_SWITCHES1_TXCC2 (1 << 1)
 #define PD_SWITCHES1_TXCC1 (1 << 0)
+#define PD_CONTROL0_TX_FLUSH (1 << 6)
+#define PD_CONTROL0_INT_MASK (1 << 5)
+#define PD_CONTROL0_HOST_CUR_USB (0b01 << 2)
 #define PD_CONTROL0_TX_START (1 << 0)
+#define PD_CONTROL1_RX_FLUSH (1 << 2)
+#define PD_CONTROL1_ENSOP2 (1 << 1)
+#define PD_CONTROL1_ENSOP1 (1 << 0)
+#define PD_CONTROL2_MODE_SNK (0b10 << 1)
+#define PD_CONTROL2_TOGGLE (1 << 0)
 #define PD_CONTROL3_SEND_HARD_RESET (1 << 6)
 #define PD_CONTROL3_N_RETRIES_POS (1)
 #define PD_CONTROL3_AUTO_RETRY (1 << 0)
 #define PD_RESET_PD_RESET (1 << 1)
 #define PD_RESET_SW_RES (1 << 0)
+#define PD_STATUS0_VBUSOK (1 << 7)
 #define PD_STATUS0_BC_LVL_MASK (0b11 << 0)
 #define PD_STATUS1_RX_EMPTY (1 << 5)
+#define PD_STATUS1_RX_FULL (1 << 4)
+#define PD_STATUS1_TX_EMPTY (1 << 3)
+#define PD_STATUS1_TX_FULL (1 << 2)
+#define PD_STATUS1A_TOGSS_POS (3)
+#define PD_STATUS1A_TOGSS_MASK (0b111 << 3)
+#define PD_STATUS1A_TOGSS_SNK_CC1 (0b101 << 3)
+#define PD_STATUS1A_TOGSS_SNK_CC2 (0b110 << 3)
+
+// MASK1 and INTERRUPT share a layout, as do MASKA and INTERRUPTA, and MASKB
+// and INTERRUPTB. A set mask bit stops that interrupt asserting INT_N.
+#define PD_INTERRUPT_I_VBUSOK (1 << 7)
+#define PD_INTERRUPT_I_ACTIVITY (1 << 6)
+#define PD_INTERRUPT_I_COMP_CHNG (1 << 5)
+#define PD_INTERRUPT_I_CRC_CHK (1 << 4)
+#define PD_INTERRUPT_I_ALERT (1 << 3)
+#define PD_INTERRUPT_I_WAKE (1 << 2)
+#define PD_INTERRUPT_I_COLLISION (1 << 1)
+#define PD_INTERRUPT_I_BC_LVL (1 << 0)
+#define PD_INTERRUPTA_I_OCP_TEMP (1 << 7)
+#define PD_INTERRUPTA_I_TOGDONE (1 << 6)
+#define PD_INTERRUPTA_I_SOFTFAIL (1 << 5)
+#define PD_INTERRUPTA_I_RETRYFAIL (1 << 4)
+#define PD_INTERRUPTA_I_HARDSENT (1 << 3)
+#define PD_INTERRUPTA_I_TXSENT (1 << 2)
+#define PD_INTERRUPTA_I_SOFTRST (1 << 1)
+#define PD_INTERRUPTA_I_HARDRST (1 << 0)
+#define PD_INTERRUPTB_I_GCRCSENT (1 << 0)
 
 #define PD_TXFIFO_TOK_SOP1 (0x12)
 #define PD_TXFIFO_TOK_SOP2 (0x13)
@@ -53,6 +91,43 @@
 #define PD_RXFIFO_TOK_SOP_MASK (0b11100000)
 #define PD_RXFIFO_TOK_SOP (0b11100000)
 
+// Message types (USB PD R3.0 tables 6-5, 6-6 and 6-48)
+#define PD_CONTROL_GOODCRC (0x01)
+#define PD_CONTROL_ACCEPT (0x03)
+#define PD_CONTROL_REJECT (0x04)
+#define PD_CONTROL_PING (0x05)
+#define PD_CONTROL_PS_RDY (0x06)
+#define PD_CONTROL_GET_SOURCE_CAP (0x07)
+#define PD_CONTROL_GET_SINK_CAP (0x08)
+#define PD_CONTROL_WAIT (0x0c)
+#define PD_CONTROL_SOFT_RESET (0x0d)
+#define PD_CONTROL_NOT_SUPPORTED (0x10)
+#define PD_CONTROL_GET_SOURCE_CAP_EXTENDED (0x11)
+#define PD_CONTROL_GET_STATUS (0x12)
+#define PD_CONTROL_GET_COUNTRY_CODES (0x15)
+#define PD_DATA_SOURCE_CAPABILITIES (0x01)
+#define PD_DATA_REQUEST (0x02)
+#define PD_DATA_SINK_CAPABILITIES (0x04)
+#define PD_DATA_BATTERY_STATUS (0x05)
+#define PD_DATA_VENDOR_DEFINED (0x0f)
+#define PD_EXTENDED_SOURCE_CAPABILITIES_EXTENDED (0x01)
+#define PD_EXTENDED_STATUS (0x02)
+#define PD_EXTENDED_GET_BATTERY_STATUS (0x04)
+#define PD_EXTENDED_GET_MANUFACTURER_INFO (0x06)
+#define PD_EXTENDED_MANUFACTURER_INFO (0x07)
+#define PD_EXTENDED_COUNTRY_CODES (0x0e)
+
+// Events decoded from the FUSB302's interrupt registers
+#define PD_EVENT_RX (1 << 0)
+#define PD_EVENT_TX_SENT (1 << 1)
+#define PD_EVENT_RETRY_FAIL (1 << 2)
+#define PD_EVENT_HARD_RESET (1 << 3)
+#define PD_EVENT_SOFT_RESET (1 << 4)
+#define PD_EVENT_HARD_SENT (1 << 5)
+#define PD_EVENT_CC_CHANGE (1 << 6)
+#define PD_EVENT_VBUS_CHANGE (1 << 7)
+#define PD_EVENT_COLLISION (1 << 8)
+
 struct pd_message_standard {
 	uint32_t data_objects[7];
 };
@@ -61,10 +136,70 @@ struct pd_message_extended {
 	uint16_t extended_header;
 	// Though the spec allows 260 bytes of data, the FUSB302 only has 48 bytes
 	// of space in the TxFIFO. Subtracting the header and extended header
-	// leaves us with 44 bytes of data.
+	// leaves us with 44 bytes of data. Longer messages are sent in chunks of
+	// 26 bytes (see pd_ext.h).
 	uint8_t data[44];
 };
 
+struct pd_reg_stats {
+	// Bus transactions made by the register access functions
+	uint32_t transactions;
+	// Transactions saved by the register shadow, compared to writing and
+	// reading every register individually over the bus
+	uint32_t avoided_transactions;
+	// Register writes the FUSB302 didn't take (NAK or bus error)
+	uint32_t failed_writes;
+};
+
+extern struct pd_reg_stats pd_reg_stats;
+
+#define PD_TX_QUEUE_LENGTH (2)
+// SOP, PACKSYM, header, extended header, data, CRC/EOP/TXOFF and TXON tokens
+#define PD_TX_FRAME_SIZE (4 + 1 + 2 + 2 + 44 + 3 + 1)
+
+enum pd_tx_status {
+	PD_TX_IDLE,
+	// Waiting behind another message
+	PD_TX_QUEUED,
+	// Written to the TX FIFO, waiting for GoodCRC
+	PD_TX_SENDING,
+	// GoodCRC received
+	PD_TX_SENT,
+	// Retries ran out without a GoodCRC, or the line was busy
+	PD_TX_FAILED,
+	// Dropped without being sent, by a reset or by the failure of the message
+	// ahead of it
+	PD_TX_DISCARDED,
+};
+
+struct pd_tx;
+typedef void (*pd_tx_callback)(struct pd_tx *tx);
+
+// A message to transmit. Owned by the caller, and must stay valid until the
+// status leaves PD_TX_QUEUED/PD_TX_SENDING.
+struct pd_tx {
+	// Optional. Called once the status is final, from whatever is servicing
+	// the FUSB302 (so not from interrupt context). May queue more messages.
+	pd_tx_callback callback;
+	void *context;
+
+	volatile enum pd_tx_status status;
+
+	// Encoded TX FIFO contents
+	uint8_t frame[PD_TX_FRAME_SIZE];
+	uint8_t frame_size;
+};
+
+struct pd_tx_stats {
+	uint32_t sent;
+	uint32_t failed;
+	uint32_t discarded;
+	// Messages launched straight from the previous one's I_TXSENT
+	uint32_t back_to_back;
+};
+
+extern struct pd_tx_stats pd_tx_stats;
+
 struct pd_message {
 	uint16_t header;
 	union {
@@ -75,11 +210,88 @@ struct pd_message {
 };
 
 void pd_setup();
-int pd_try_attach();
 
+struct pd_attach_stats {
+	uint32_t attaches;
+	// Toggling found something that wasn't a source, and had to start over
+	uint32_t toggle_restarts;
+	// us from pd_attach_start to the FUSB302 being configured, for the last
+	// attach
+	uint32_t attach_time;
+};
+
+extern struct pd_attach_stats pd_attach_stats;
+
+// Called once the FUSB302 is configured for the CC pin the source is on
+typedef void (*pd_attach_callback)();
+
+// Reset the FUSB302 and leave its toggle state machine looking for a source's
+// Rp on either CC pin. Runs in the background, driven by pd_attach_poll().
+// Also used to go back to the unattached state after a detach.
+void pd_attach_start(pd_attach_callback callback);
+// Finish attaching once the FUSB302 reports that toggling found a source. Call
+// from the main loop.
+void pd_attach_poll();
+int pd_attach_busy();
+
+struct pd_rx_stats {
+	// Messages read out of the RX FIFO, of any SOP*
+	uint32_t messages;
+	// Times the RX FIFO was flushed because what came out of it wasn't a
+	// message
+	uint32_t flushed;
+	// Reads that found the RX FIFO full, so the FUSB302 may have had to drop
+	// messages
+	uint32_t full;
+};
+
+extern struct pd_rx_stats pd_rx_stats;
+
+// Called for every message read out of the RX FIFO, whether or not
+// pd_poll_rxfifo() returns it: data is the SOP* token, header and data objects
+// (without the CRC), and time is swtimer_now() as the read started
+typedef void (*pd_rx_monitor)(uint32_t time, const uint8_t *data, size_t size);
+void pd_set_rx_monitor(pd_rx_monitor monitor);
+
+int pd_interrupt_pending();
+// Like pd_interrupt_pending(), but without taking the interrupt, for deciding
+// whether it's safe to sleep
+int pd_interrupt_asserted();
+uint16_t pd_take_events();
+// STATUS0 as of the last time the interrupt registers were read
+uint8_t pd_status0();
 int pd_poll_rxfifo(struct pd_message *message);
-void pd_tx_standard(uint16_t header, struct pd_message_standard *payload);
-void pd_tx_extended(uint16_t header, struct pd_message_extended *payload);
+int pd_drain_rxfifo(struct pd_message *messages, int max);
+
+// Encode a message and queue it for transmission, sending it straight away if
+// nothing else is queued. Returns 0, leaving tx untouched, if the queue is
+// full or tx is still queued from before.
+int pd_tx_standard(struct pd_tx *tx, uint16_t header, const struct pd_message_standard *payload);
+int pd_tx_extended(struct pd_tx *tx, uint16_t header, const struct pd_message_extended *payload);
+// Just the encoding, straight into tx->frame
+void pd_tx_encode_standard(struct pd_tx *tx, uint16_t header, const struct pd_message_standard *payload);
+void pd_tx_encode_extended(struct pd_tx *tx, uint16_t header, const struct pd_message_extended *payload);
+// Discard everything queued and signal Hard Reset
+void pd_tx_hard_reset();
+// Discard everything queued
+void pd_tx_reset();
+// Update the queue from the interrupt registers (INTERRUPTA and INTERRUPT)
+// once they've been read
+void pd_tx_interrupt(uint8_t interrupta, uint8_t interrupt);
+
+// Stage a write to a control register (0x01-0x0f) in the register shadow, to
+// go out with the next pd_reg_flush
+void pd_reg_set(uint8_t reg, uint8_t value);
+// Shadowed value of a control register
+uint8_t pd_reg_get(uint8_t reg);
+// Read-modify-write of a control register's shadowed value, staged like
+// pd_reg_set
+void pd_reg_update(uint8_t reg, uint8_t clear, uint8_t set);
+// Write a control register's shadowed value plus self-clearing command bits
+// (e.g. TX_START, RX_FLUSH), immediately
+void pd_reg_strobe(uint8_t reg, uint8_t bits);
+// Write all staged control registers, in as few bursts as possible
+void pd_reg_flush();
 
 void pd_write_reg(uint8_t reg, uint8_t value);
 void pd_write_fifo(uint8_t *data, size_t count);
@@ -0,0 +1,108 @@
+#include "pd_ext.h"
+#include <string.h>
+
+void pd_ext_rx_reset(struct pd_ext_rx *rx) {
+	rx->received = 0;
+	rx->next_chunk = -1;
+}
+
+int pd_ext_rx_active(const struct pd_ext_rx *rx) {
+	return rx->next_chunk >= 0;
+}
+
+enum pd_ext_rx_result pd_ext_receive(
+	struct pd_ext_rx *rx, uint8_t message_type, const struct pd_message_extended *payload, int count, int *chunk
+) {
+	// Data bytes that actually came in, after the extended header. Anything
+	// past them in payload is left over from an earlier message.
+	if (count == 0) {
+		pd_ext_rx_reset(rx);
+		return PD_EXT_RX_ERROR;
+	}
+	size_t carried = count * 4 - 2;
+
+	uint16_t extended_header = payload->extended_header;
+	size_t size = pd_extended_header_data_size(extended_header);
+	int number = pd_extended_header_chunk_number(extended_header);
+
+	if (!pd_extended_header_chunked(extended_header)) {
+		pd_ext_rx_reset(rx);
+		if (size > sizeof(payload->data) || size > carried) {
+			return PD_EXT_RX_ERROR;
+		}
+
+		rx->message.message_type = message_type;
+		rx->message.size = size;
+		memcpy(rx->message.data, payload->data, size);
+		return PD_EXT_RX_DONE;
+	}
+
+	if (pd_extended_header_request_chunk(extended_header)) {
+		*chunk = number;
+		return PD_EXT_RX_CHUNK_REQUEST;
+	}
+
+	if (size > PD_EXT_DATA_MAX) {
+		pd_ext_rx_reset(rx);
+		return PD_EXT_RX_ERROR;
+	}
+
+	if (number == 0) {
+		// Starts a new message, dropping any that wasn't finished
+		rx->message.message_type = message_type;
+		rx->message.size = size;
+		rx->received = 0;
+	} else if (number != rx->next_chunk || message_type != rx->message.message_type || size != rx->message.size) {
+		pd_ext_rx_reset(rx);
+		return PD_EXT_RX_ERROR;
+	}
+
+	// Every chunk but the last is full
+	size_t chunk_size = rx->message.size - rx->received;
+	if (chunk_size > PD_EXT_CHUNK_SIZE) {
+		chunk_size = PD_EXT_CHUNK_SIZE;
+	}
+	if (chunk_size > carried) {
+		pd_ext_rx_reset(rx);
+		return PD_EXT_RX_ERROR;
+	}
+	memcpy(&rx->message.data[rx->received], payload->data, chunk_size);
+	rx->received += chunk_size;
+
+	if (rx->received == rx->message.size) {
+		rx->next_chunk = -1;
+		return PD_EXT_RX_DONE;
+	}
+
+	rx->next_chunk = number + 1;
+	*chunk = rx->next_chunk;
+	return PD_EXT_RX_MORE;
+}
+
+int pd_ext_chunks(size_t size) {
+	// An empty message still takes a chunk
+	return size == 0 ? 1 : (size + PD_EXT_CHUNK_SIZE - 1) / PD_EXT_CHUNK_SIZE;
+}
+
+int pd_ext_chunk(const uint8_t *data, size_t size, int chunk, struct pd_message_extended *payload) {
+	size_t offset = chunk * PD_EXT_CHUNK_SIZE;
+	size_t count = offset < size ? size - offset : 0;
+	if (count > PD_EXT_CHUNK_SIZE) {
+		count = PD_EXT_CHUNK_SIZE;
+	}
+
+	payload->extended_header = pd_extended_header(chunk, size, 0);
+	memcpy(payload->data, &data[offset], count);
+
+	// Extended header and data, padded out to whole data objects
+	size_t padded = (2 + count + 3) / 4 * 4;
+	memset(&payload->data[count], 0, padded - 2 - count);
+	return padded / 4;
+}
+
+int pd_ext_chunk_request(int chunk, struct pd_message_extended *payload) {
+	payload->extended_header = pd_extended_header(chunk, 0, PD_EXTENDED_HEADER_REQUEST_CHUNK);
+	// Just the extended header, padded to a data object
+	memset(payload->data, 0, 2);
+	return 1;
+}
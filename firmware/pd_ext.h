@@ -0,0 +1,67 @@
+#ifndef PD_EXT_H
+#define PD_EXT_H
+#include <stddef.h>
+#include <stdint.h>
+#include "pd.h"
+
+// Chunked extended messages, after USB PD R3.0 section 6.12.2.1 "Chunking".
+// The FUSB302's FIFOs are too small for the 260 bytes an extended message can
+// carry, so they're sent 26 bytes at a time: the sender sends chunk 0, and
+// the receiver asks for each chunk after it with a Chunk Request (an extended
+// message of the same type, with Request Chunk set and no data).
+
+#define PD_EXT_DATA_MAX (260)
+#define PD_EXT_CHUNK_SIZE (26)
+
+struct pd_ext_message {
+	uint8_t message_type;
+	uint16_t size;
+	uint8_t data[PD_EXT_DATA_MAX];
+};
+
+// Reassembles chunks into a message
+struct pd_ext_rx {
+	struct pd_ext_message message;
+	// Bytes received so far
+	uint16_t received;
+	// Chunk expected next, or -1 if no message is being put together
+	int8_t next_chunk;
+};
+
+enum pd_ext_rx_result {
+	// The message is complete in rx->message
+	PD_EXT_RX_DONE,
+	// Another chunk is needed: send a Chunk Request for *chunk
+	PD_EXT_RX_MORE,
+	// The other side wants chunk *chunk of a message being sent to it
+	PD_EXT_RX_CHUNK_REQUEST,
+	// A chunk that doesn't follow on from the last one, or is too big. Anything
+	// put together so far is dropped.
+	PD_EXT_RX_ERROR,
+};
+
+void pd_ext_rx_reset(struct pd_ext_rx *rx);
+
+// Returns 1 while a message is part way through being received
+int pd_ext_rx_active(const struct pd_ext_rx *rx);
+
+// Take in an extended message, which carries either a chunk or a Chunk
+// Request. count is the number of data objects in its message header, and a
+// chunk whose data size says it should carry more than they hold is an error.
+// Messages that aren't chunked are taken whole, as far as they fit in a struct
+// pd_message_extended.
+enum pd_ext_rx_result pd_ext_receive(
+	struct pd_ext_rx *rx, uint8_t message_type, const struct pd_message_extended *payload, int count, int *chunk
+);
+
+// Number of chunks a message of size bytes is sent in
+int pd_ext_chunks(size_t size);
+
+// Fill payload with chunk number chunk of data (size bytes), zero padded.
+// Returns the number of data objects to put in the message header.
+int pd_ext_chunk(const uint8_t *data, size_t size, int chunk, struct pd_message_extended *payload);
+
+// Fill payload with a Chunk Request for chunk number chunk. Returns the number
+// of data objects to put in the message header.
+int pd_ext_chunk_request(int chunk, struct pd_message_extended *payload);
+#endif
@@ -0,0 +1,354 @@
+// Interrupt-driven I2C engine for the FUSB302 link on I2C1.
+//
+// Transfers are queued and run back-to-back from the I2C event/error
+// interrupts. Long writes and reads are moved by DMA (channel 3 is I2C1 TX,
+// channel 4 is I2C1 RX), short ones byte-by-byte from the buffer interrupts.
+//
+// The FUSB302's open-drain INT_N output is on PA2, which is routed to EXTI line
+// 2 so a falling edge can be noticed without touching the bus.
+//
+// See GD32F1x0 User Manual, section 22 "Inter-integrated circuit interface"
+// and FUSB302 datasheet, Figures 13 and 14.
+#include "pd_i2c.h"
+#include <gd32f1x0.h>
+#include <core_cm3.h>
+#include "gd32f1x0_libopt.h"
+#include "prof.h"
+
+#define FUSB302_ADDRESS (0x44)
+
+// The sniffer has to read messages out of the RX FIFO as fast as they can
+// arrive on the line, which standard mode can't do for long ones
+#ifdef SNIFFER
+#define PD_I2C_HZ (400000)
+#else
+#define PD_I2C_HZ (100000)
+#endif
+
+// Transfers shorter than this aren't worth setting up a DMA channel for
+#define PD_I2C_DMA_THRESHOLD (4)
+
+#define PD_I2C_DMA_TX (DMA_CH3)
+#define PD_I2C_DMA_RX (DMA_CH4)
+
+enum pd_i2c_state {
+	STATE_IDLE,
+	// Waiting for the start condition before addressing for write
+	STATE_START,
+	// Waiting for the slave to acknowledge its write address
+	STATE_ADDRESS,
+	// Register address/data being written byte-by-byte
+	STATE_WRITE,
+	// Data being written by DMA
+	STATE_WRITE_DMA,
+	// Waiting for the repeated start before addressing for read
+	STATE_RESTART,
+	// Waiting for the slave to acknowledge its read address
+	STATE_READ_ADDRESS,
+	// Data being read byte-by-byte
+	STATE_READ,
+	// Data being read by DMA
+	STATE_READ_DMA,
+};
+
+static struct pd_i2c_transfer *queue[PD_I2C_QUEUE_LENGTH];
+static volatile uint8_t queue_head = 0;
+static volatile uint8_t queue_count = 0;
+
+static volatile enum pd_i2c_state state = STATE_IDLE;
+static volatile int int_pending = 0;
+static size_t tx_index;
+static size_t rx_index;
+
+static void pd_i2c_start();
+
+void pd_i2c_setup() {
+	rcu_periph_clock_enable(RCU_I2C1);
+	rcu_periph_clock_enable(RCU_DMA);
+
+	i2c_clock_config(I2C1, PD_I2C_HZ, I2C_DTCY_2);
+	i2c_mode_addr_config(I2C1, I2C_I2CMODE_ENABLE, I2C_ADDFORMAT_7BITS, 0);
+	i2c_ack_config(I2C1, I2C_ACK_ENABLE);
+	i2c_ackpos_config(I2C1, I2C_ACKPOS_CURRENT);
+
+	// Both channels move bytes between memory and I2C_DATA. Only the RX
+	// channel interrupts - the end of a DMA write is picked up from BTC.
+	DMA_CHCTL(PD_I2C_DMA_TX) = DMA_CHXCTL_PRIO | DMA_CHXCTL_MNAGA | DMA_CHXCTL_DIR;
+	dma_periph_address_config(PD_I2C_DMA_TX, (uint32_t) &I2C_DATA(I2C1));
+	DMA_CHCTL(PD_I2C_DMA_RX) = DMA_CHXCTL_PRIO | DMA_CHXCTL_MNAGA | DMA_CHXCTL_FTFIE;
+	dma_periph_address_config(PD_I2C_DMA_RX, (uint32_t) &I2C_DATA(I2C1));
+
+	i2c_interrupt_enable(I2C1, I2C_INT_EV);
+	i2c_interrupt_enable(I2C1, I2C_INT_ERR);
+	nvic_irq_enable(I2C1_EV_IRQn, 1, 0);
+	nvic_irq_enable(I2C1_ER_IRQn, 1, 0);
+	nvic_irq_enable(DMA_Channel3_4_IRQn, 1, 0);
+
+	i2c_enable(I2C1);
+
+	// INT_N
+	rcu_periph_clock_enable(RCU_CFGCMP);
+	syscfg_exti_line_config(EXTI_SOURCE_GPIOA, EXTI_SOURCE_PIN2);
+	exti_init(EXTI_2, EXTI_INTERRUPT, EXTI_TRIG_FALLING);
+	exti_interrupt_flag_clear(EXTI_2);
+	nvic_irq_enable(EXTI2_3_IRQn, 2, 0);
+}
+
+int pd_i2c_submit(struct pd_i2c_transfer *transfer) {
+	PROF_ENTER(PROF_I2C_SUBMIT);
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (queue_count == PD_I2C_QUEUE_LENGTH) {
+		__set_PRIMASK(primask);
+		PROF_EXIT(PROF_I2C_SUBMIT);
+		return 0;
+	}
+
+	transfer->status = PD_I2C_QUEUED;
+	queue[(queue_head + queue_count) % PD_I2C_QUEUE_LENGTH] = transfer;
+	queue_count++;
+
+	if (state == STATE_IDLE) {
+		pd_i2c_start();
+	}
+
+	__set_PRIMASK(primask);
+	PROF_EXIT(PROF_I2C_SUBMIT);
+	return 1;
+}
+
+int pd_i2c_busy() {
+	return queue_count != 0;
+}
+
+enum pd_i2c_status pd_i2c_transfer(struct pd_i2c_transfer *transfer) {
+	PROF_ENTER(PROF_I2C_TRANSFER);
+	transfer->callback = NULL;
+
+	while (!pd_i2c_submit(transfer));
+	while (transfer->status == PD_I2C_QUEUED || transfer->status == PD_I2C_BUSY);
+
+	PROF_EXIT(PROF_I2C_TRANSFER);
+	return transfer->status;
+}
+
+int pd_i2c_int_pending() {
+	int pending = int_pending;
+	int_pending = 0;
+
+	// INT_N stays low until every unmasked interrupt has been read, so an
+	// interrupt raised mid-read doesn't produce another edge
+	return pending || gpio_input_bit_get(GPIOA, GPIO_PIN_2) == RESET;
+}
+
+int pd_i2c_int_asserted() {
+	return int_pending || gpio_input_bit_get(GPIOA, GPIO_PIN_2) == RESET;
+}
+
+static void pd_i2c_start() {
+	struct pd_i2c_transfer *transfer = queue[queue_head];
+	transfer->status = PD_I2C_BUSY;
+	tx_index = 0;
+	rx_index = 0;
+
+	// The previous transfer's stop condition may still be going out
+	while (I2C_CTL0(I2C1) & I2C_CTL0_STOP);
+
+	state = STATE_START;
+	i2c_ack_config(I2C1, I2C_ACK_ENABLE);
+	i2c_start_on_bus(I2C1);
+}
+
+static void pd_i2c_finish(enum pd_i2c_status status) {
+	struct pd_i2c_transfer *transfer = queue[queue_head];
+
+	i2c_interrupt_disable(I2C1, I2C_INT_BUF);
+	i2c_dma_enable(I2C1, I2C_DMA_OFF);
+	i2c_dma_last_transfer_config(I2C1, I2C_DMALST_OFF);
+	dma_channel_disable(PD_I2C_DMA_TX);
+	dma_channel_disable(PD_I2C_DMA_RX);
+
+	queue_head = (queue_head + 1) % PD_I2C_QUEUE_LENGTH;
+	queue_count--;
+	state = STATE_IDLE;
+
+	transfer->status = status;
+	if (transfer->callback != NULL) {
+		transfer->callback(transfer);
+	}
+
+	// The callback may have already kicked off a newly submitted transfer
+	if (state == STATE_IDLE && queue_count != 0) {
+		pd_i2c_start();
+	}
+}
+
+static void pd_i2c_write_done(struct pd_i2c_transfer *transfer) {
+	if (transfer->rx_count != 0) {
+		state = STATE_RESTART;
+		i2c_start_on_bus(I2C1);
+	} else {
+		i2c_stop_on_bus(I2C1);
+		pd_i2c_finish(PD_I2C_DONE);
+	}
+}
+
+static void pd_i2c_dma_start(dma_channel_enum channel, uint8_t *data, size_t count) {
+	dma_channel_disable(channel);
+	dma_flag_clear(channel, DMA_FLAG_G);
+	dma_memory_address_config(channel, (uint32_t) data);
+	dma_transfer_number_config(channel, count);
+	dma_channel_enable(channel);
+	i2c_dma_enable(I2C1, I2C_DMA_ON);
+}
+
+void i2c1_ev_isr() {
+	struct pd_i2c_transfer *transfer = queue[queue_head];
+
+	switch (state) {
+	case STATE_IDLE:
+		break;
+
+	case STATE_START:
+		if (i2c_flag_get(I2C1, I2C_FLAG_SBSEND)) {
+			i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_TRANSMITTER);
+			state = STATE_ADDRESS;
+		}
+		break;
+
+	case STATE_ADDRESS:
+		if (i2c_flag_get(I2C1, I2C_FLAG_ADDSEND)) {
+			i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+
+			// Register address always goes out by hand; the DMA channel
+			// (if any) picks up from TBE right after it
+			i2c_data_transmit(I2C1, transfer->reg);
+
+			if (transfer->tx_count >= PD_I2C_DMA_THRESHOLD) {
+				pd_i2c_dma_start(PD_I2C_DMA_TX, (uint8_t *) transfer->tx_data, transfer->tx_count);
+				state = STATE_WRITE_DMA;
+			} else {
+				if (transfer->tx_count != 0) {
+					i2c_interrupt_enable(I2C1, I2C_INT_BUF);
+				}
+				state = STATE_WRITE;
+			}
+		}
+		break;
+
+	case STATE_WRITE:
+		if (tx_index < transfer->tx_count) {
+			if (i2c_flag_get(I2C1, I2C_FLAG_TBE)) {
+				i2c_data_transmit(I2C1, transfer->tx_data[tx_index++]);
+			}
+
+			if (tx_index == transfer->tx_count) {
+				// Nothing left to load - just wait for BTC
+				i2c_interrupt_disable(I2C1, I2C_INT_BUF);
+			}
+		} else if (i2c_flag_get(I2C1, I2C_FLAG_BTC)) {
+			pd_i2c_write_done(transfer);
+		}
+		break;
+
+	case STATE_WRITE_DMA:
+		if (i2c_flag_get(I2C1, I2C_FLAG_BTC) && dma_flag_get(PD_I2C_DMA_TX, DMA_FLAG_FTF)) {
+			dma_channel_disable(PD_I2C_DMA_TX);
+			i2c_dma_enable(I2C1, I2C_DMA_OFF);
+			pd_i2c_write_done(transfer);
+		}
+		break;
+
+	case STATE_RESTART:
+		if (i2c_flag_get(I2C1, I2C_FLAG_SBSEND)) {
+			i2c_master_addressing(I2C1, FUSB302_ADDRESS, I2C_RECEIVER);
+			state = STATE_READ_ADDRESS;
+		}
+		break;
+
+	case STATE_READ_ADDRESS:
+		if (i2c_flag_get(I2C1, I2C_FLAG_ADDSEND)) {
+			if (transfer->extend != NULL) {
+				// Length isn't known up front, so this has to be read
+				// byte-by-byte
+				i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+				i2c_interrupt_enable(I2C1, I2C_INT_BUF);
+				state = STATE_READ;
+			} else if (transfer->rx_count == 1) {
+				// NACK the only byte, which must be set up before ADDSEND is
+				// cleared and the byte starts clocking in
+				i2c_ack_config(I2C1, I2C_ACK_DISABLE);
+				i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+				i2c_stop_on_bus(I2C1);
+				i2c_interrupt_enable(I2C1, I2C_INT_BUF);
+				state = STATE_READ;
+			} else if (transfer->rx_count >= PD_I2C_DMA_THRESHOLD) {
+				// DMALST has the hardware NACK the final byte for us
+				i2c_dma_last_transfer_config(I2C1, I2C_DMALST_ON);
+				pd_i2c_dma_start(PD_I2C_DMA_RX, transfer->rx_data, transfer->rx_count);
+				i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+				state = STATE_READ_DMA;
+			} else {
+				i2c_flag_clear(I2C1, I2C_STAT0_ADDSEND);
+				i2c_interrupt_enable(I2C1, I2C_INT_BUF);
+				state = STATE_READ;
+			}
+		}
+		break;
+
+	case STATE_READ:
+		if (i2c_flag_get(I2C1, I2C_FLAG_RBNE)) {
+			transfer->rx_data[rx_index++] = i2c_data_receive(I2C1);
+
+			if (transfer->extend != NULL) {
+				transfer->extend(transfer, rx_index);
+			}
+
+			size_t remaining = transfer->rx_count - rx_index;
+			if (remaining == 1) {
+				// The last byte is already clocking in - make sure it's
+				// NACKed and followed by a stop
+				i2c_ack_config(I2C1, I2C_ACK_DISABLE);
+				i2c_stop_on_bus(I2C1);
+			} else if (remaining == 0) {
+				pd_i2c_finish(PD_I2C_DONE);
+			}
+		}
+		break;
+
+	case STATE_READ_DMA:
+		// Completion comes from the DMA interrupt
+		break;
+	}
+}
+
+void i2c1_er_isr() {
+	i2c_flag_clear(I2C1, I2C_STAT0_BERR);
+	i2c_flag_clear(I2C1, I2C_STAT0_LOSTARB);
+	i2c_flag_clear(I2C1, I2C_STAT0_AERR);
+	i2c_flag_clear(I2C1, I2C_STAT0_OUERR);
+
+	if (state != STATE_IDLE) {
+		i2c_stop_on_bus(I2C1);
+		pd_i2c_finish(PD_I2C_ERROR);
+	}
+}
+
+void dma_channel3_4_isr() {
+	if (dma_interrupt_flag_get(PD_I2C_DMA_RX, DMA_INT_FLAG_FTF)) {
+		dma_interrupt_flag_clear(PD_I2C_DMA_RX, DMA_INT_FLAG_G);
+
+		if (state == STATE_READ_DMA) {
+			i2c_stop_on_bus(I2C1);
+			pd_i2c_finish(PD_I2C_DONE);
+		}
+	}
+}
+
+void exti2_3_isr() {
+	if (exti_interrupt_flag_get(EXTI_2)) {
+		exti_interrupt_flag_clear(EXTI_2);
+		int_pending = 1;
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef PD_I2C_H
+#define PD_I2C_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of transfers that can be waiting for the bus (including the
+// one currently in progress)
+#define PD_I2C_QUEUE_LENGTH (4)
+
+enum pd_i2c_status {
+	PD_I2C_IDLE,
+	PD_I2C_QUEUED,
+	PD_I2C_BUSY,
+	PD_I2C_DONE,
+	PD_I2C_ERROR,
+};
+
+struct pd_i2c_transfer;
+typedef void (*pd_i2c_callback)(struct pd_i2c_transfer *transfer);
+typedef void (*pd_i2c_extend_callback)(struct pd_i2c_transfer *transfer, size_t received);
+
+// A single FUSB302 bus transaction: a write of the register address followed
+// by tx_count bytes, then (if rx_count is non-zero) a repeated start and a read
+// of rx_count bytes. The transfer and its buffers are owned by the caller and
+// must stay valid until the status leaves PD_I2C_QUEUED/PD_I2C_BUSY.
+struct pd_i2c_transfer {
+	uint8_t reg;
+
+	const uint8_t *tx_data;
+	size_t tx_count;
+
+	uint8_t *rx_data;
+	size_t rx_count;
+
+	// Optional. Called from interrupt context after each byte of the read
+	// arrives, and may grow rx_count to keep reading in the same transaction
+	// (e.g. once a length field has been seen). The read must start with
+	// rx_count >= 2, and rx_count can no longer change once only one byte is
+	// left to read, since that byte is already being NACKed.
+	pd_i2c_extend_callback extend;
+
+	// Called from interrupt context once the transfer finishes, successfully
+	// or not. May submit further transfers.
+	pd_i2c_callback callback;
+	void *context;
+
+	volatile enum pd_i2c_status status;
+};
+
+void pd_i2c_setup();
+
+// Queue a transfer, starting it immediately if the bus is idle. Returns 0 if
+// the queue is full.
+int pd_i2c_submit(struct pd_i2c_transfer *transfer);
+int pd_i2c_busy();
+
+// Submit a transfer and wait for it to finish
+enum pd_i2c_status pd_i2c_transfer(struct pd_i2c_transfer *transfer);
+
+// Returns 1 if the FUSB302 has pulled INT_N low since the last call, or is
+// still holding it low
+int pd_i2c_int_pending();
+
+// Like pd_i2c_int_pending(), but leaves the flag for the next call to that
+int pd_i2c_int_asserted();
+#endif
@@ -0,0 +1,75 @@
+#ifndef PD_MSG_H
+#define PD_MSG_H
+#include <stdint.h>
+
+// Message header (USB PD R3.0 section 6.2.1.1) and extended message header
+// (section 6.2.1.2) fields. Each accessor is a shift and a mask, so they're
+// inline rather than in a .c file.
+
+#define PD_HEADER_MESSAGE_TYPE_MASK (0x1F)
+#define PD_HEADER_DATA_ROLE_DFP (1 << 5)
+#define PD_HEADER_REVISION_POS (6)
+#define PD_HEADER_REVISION_2_0 (0b01)
+#define PD_HEADER_REVISION_3_0 (0b10)
+#define PD_HEADER_POWER_ROLE_SOURCE (1 << 8)
+#define PD_HEADER_MESSAGE_ID_POS (9)
+#define PD_HEADER_COUNT_POS (12)
+#define PD_HEADER_EXTENDED (1 << 15)
+
+#define PD_EXTENDED_HEADER_CHUNKED (1 << 15)
+#define PD_EXTENDED_HEADER_CHUNK_NUMBER_POS (11)
+#define PD_EXTENDED_HEADER_CHUNK_NUMBER_MASK (0xF << 11)
+#define PD_EXTENDED_HEADER_REQUEST_CHUNK (1 << 10)
+#define PD_EXTENDED_HEADER_DATA_SIZE_MASK (0x1FF)
+
+static inline uint8_t pd_header_message_type(uint16_t header) {
+	return header & PD_HEADER_MESSAGE_TYPE_MASK;
+}
+
+static inline uint8_t pd_header_revision(uint16_t header) {
+	return (header >> PD_HEADER_REVISION_POS) & 0b11;
+}
+
+static inline uint8_t pd_header_message_id(uint16_t header) {
+	return (header >> PD_HEADER_MESSAGE_ID_POS) & 0b111;
+}
+
+// Number of data objects, which is also the length of an extended message
+// on the wire, in 4-byte units
+static inline uint8_t pd_header_count(uint16_t header) {
+	return (header >> PD_HEADER_COUNT_POS) & 0b111;
+}
+
+static inline int pd_header_extended(uint16_t header) {
+	return (header & PD_HEADER_EXTENDED) != 0;
+}
+
+// flags are PD_HEADER_DATA_ROLE_DFP, PD_HEADER_POWER_ROLE_SOURCE and
+// PD_HEADER_EXTENDED as needed
+static inline uint16_t pd_header(uint8_t message_type, uint8_t message_id, uint8_t count, uint16_t flags) {
+	return message_type | (PD_HEADER_REVISION_3_0 << PD_HEADER_REVISION_POS) |
+		((message_id & 0b111) << PD_HEADER_MESSAGE_ID_POS) | ((count & 0b111) << PD_HEADER_COUNT_POS) | flags;
+}
+
+static inline uint16_t pd_extended_header_data_size(uint16_t extended_header) {
+	return extended_header & PD_EXTENDED_HEADER_DATA_SIZE_MASK;
+}
+
+static inline uint8_t pd_extended_header_chunk_number(uint16_t extended_header) {
+	return (extended_header & PD_EXTENDED_HEADER_CHUNK_NUMBER_MASK) >> PD_EXTENDED_HEADER_CHUNK_NUMBER_POS;
+}
+
+static inline int pd_extended_header_chunked(uint16_t extended_header) {
+	return (extended_header & PD_EXTENDED_HEADER_CHUNKED) != 0;
+}
+
+static inline int pd_extended_header_request_chunk(uint16_t extended_header) {
+	return (extended_header & PD_EXTENDED_HEADER_REQUEST_CHUNK) != 0;
+}
+
+// A chunked extended header. flags is PD_EXTENDED_HEADER_REQUEST_CHUNK or 0.
+static inline uint16_t pd_extended_header(uint8_t chunk_number, uint16_t data_size, uint16_t flags) {
+	return PD_EXTENDED_HEADER_CHUNKED | (chunk_number << PD_EXTENDED_HEADER_CHUNK_NUMBER_POS) |
+		(data_size & PD_EXTENDED_HEADER_DATA_SIZE_MASK) | flags;
+}
+#endif
@@ -0,0 +1,231 @@
+// FUSB302 register access, with a RAM shadow of the writable control registers
+// (DEVICE_ID to MASKB, 0x01-0x0f).
+//
+// Nothing but this driver changes the control registers, so once the shadow
+// has been loaded, reads come straight from RAM. Writes staged with
+// pd_reg_set are held until pd_reg_flush, which sends each run of adjacent
+// dirty registers as one auto-incrementing burst. A write that fails (a NAK or
+// bus error) leaves the shadow not trusted to match the chip: a burst's
+// registers stay dirty to be sent again by the next flush, and a single
+// register write drops the shadow so it's read back before it's used.
+#include "pd.h"
+#include "pd_i2c.h"
+
+#define PD_REG_CACHE_FIRST (PD_REG_DEVICE_ID)
+#define PD_REG_CACHE_LAST (PD_REG_MASKB)
+#define PD_REG_CACHE_SIZE (PD_REG_CACHE_LAST - PD_REG_CACHE_FIRST + 1)
+
+// A burst may carry up to this many clean registers between two dirty ones
+// (rewriting their shadowed values) rather than being split in two. A new
+// transaction costs a start, address and register byte on top of its data.
+#define PD_REG_FLUSH_MAX_GAP (2)
+
+#define PD_REG_CACHED(reg) ((reg) >= PD_REG_CACHE_FIRST && (reg) <= PD_REG_CACHE_LAST)
+#define PD_REG_INDEX(reg) ((reg) - PD_REG_CACHE_FIRST)
+
+struct pd_reg_stats pd_reg_stats;
+
+static uint8_t cache[PD_REG_CACHE_SIZE];
+static uint16_t cache_dirty = 0;
+static int cache_valid = 0;
+
+// Bits which clear themselves once the FUSB302 has acted on them, and so
+// never persist in the register
+static uint8_t pd_reg_self_clearing(uint8_t reg) {
+	switch (reg) {
+	case PD_REG_CONTROL0:
+		return PD_CONTROL0_TX_FLUSH | PD_CONTROL0_TX_START;
+	case PD_REG_CONTROL1:
+		return PD_CONTROL1_RX_FLUSH;
+	case PD_REG_CONTROL3:
+		return PD_CONTROL3_SEND_HARD_RESET;
+	case PD_REG_RESET:
+		return PD_RESET_PD_RESET | PD_RESET_SW_RES;
+	default:
+		return 0;
+	}
+}
+
+static enum pd_i2c_status pd_reg_transfer(struct pd_i2c_transfer *transfer) {
+	pd_reg_stats.transactions++;
+	return pd_i2c_transfer(transfer);
+}
+
+static void pd_reg_load() {
+	uint8_t values[PD_REG_CACHE_SIZE];
+	struct pd_i2c_transfer transfer = {
+		.reg = PD_REG_CACHE_FIRST,
+		.rx_data = values,
+		.rx_count = sizeof(values),
+	};
+	if (pd_reg_transfer(&transfer) != PD_I2C_DONE) {
+		return;
+	}
+
+	// Don't clobber anything staged but not yet written
+	for (int i = 0; i < PD_REG_CACHE_SIZE; ++i) {
+		if ((cache_dirty & (1 << i)) == 0) {
+			cache[i] = values[i];
+		}
+	}
+
+	cache_valid = 1;
+}
+
+static void pd_reg_store(uint8_t reg, uint8_t value) {
+	if (!PD_REG_CACHED(reg)) {
+		return;
+	}
+
+	if (reg == PD_REG_RESET && (value & PD_RESET_SW_RES)) {
+		// Every register just went back to its reset value
+		cache_valid = 0;
+		cache_dirty = 0;
+		return;
+	}
+
+	cache[PD_REG_INDEX(reg)] = value & ~pd_reg_self_clearing(reg);
+	cache_dirty &= ~(1 << PD_REG_INDEX(reg));
+}
+
+void pd_reg_set(uint8_t reg, uint8_t value) {
+	if (!PD_REG_CACHED(reg)) {
+		pd_write_reg(reg, value);
+		return;
+	}
+
+	// Each staged write is one transaction saved, until pd_reg_flush spends
+	// some of them again
+	pd_reg_stats.avoided_transactions++;
+
+	cache[PD_REG_INDEX(reg)] = value;
+	cache_dirty |= 1 << PD_REG_INDEX(reg);
+}
+
+uint8_t pd_reg_get(uint8_t reg) {
+	if (!PD_REG_CACHED(reg)) {
+		return pd_read_reg(reg);
+	}
+
+	if (!cache_valid) {
+		pd_reg_load();
+	}
+
+	return cache[PD_REG_INDEX(reg)];
+}
+
+void pd_reg_update(uint8_t reg, uint8_t clear, uint8_t set) {
+	pd_reg_set(reg, (pd_reg_get(reg) & ~clear) | set);
+}
+
+void pd_reg_strobe(uint8_t reg, uint8_t bits) {
+	pd_write_reg(reg, pd_reg_get(reg) | bits);
+}
+
+void pd_reg_flush() {
+	if (cache_dirty == 0) {
+		return;
+	}
+
+	// Gaps can only be bridged with known values
+	if (!cache_valid) {
+		pd_reg_load();
+	}
+	int max_gap = cache_valid ? PD_REG_FLUSH_MAX_GAP : 0;
+
+	int i = 0;
+	while (i < PD_REG_CACHE_SIZE) {
+		if ((cache_dirty & (1 << i)) == 0) {
+			i++;
+			continue;
+		}
+
+		// Extend the burst over following dirty registers, and over short
+		// runs of clean ones if there's another dirty register after them
+		int first = i;
+		int last = i;
+		for (int j = i + 1; j < PD_REG_CACHE_SIZE && j - last <= max_gap + 1; ++j) {
+			if (cache_dirty & (1 << j)) {
+				last = j;
+			}
+		}
+
+		uint8_t values[PD_REG_CACHE_SIZE];
+		for (int j = first; j <= last; ++j) {
+			values[j - first] = cache[j];
+		}
+
+		struct pd_i2c_transfer transfer = {
+			.reg = PD_REG_CACHE_FIRST + first,
+			.tx_data = values,
+			.tx_count = last - first + 1,
+		};
+		enum pd_i2c_status status = pd_reg_transfer(&transfer);
+		pd_reg_stats.avoided_transactions--;
+
+		if (status != PD_I2C_DONE) {
+			// How much of the burst got through is unknown, so it's all left
+			// dirty, and the rest waits too rather than hitting the same fault
+			pd_reg_stats.failed_writes++;
+			return;
+		}
+
+		for (int j = first; j <= last; ++j) {
+			pd_reg_store(PD_REG_CACHE_FIRST + j, cache[j]);
+		}
+
+		i = last + 1;
+	}
+}
+
+void pd_write_reg(uint8_t reg, uint8_t value) {
+	struct pd_i2c_transfer transfer = {
+		.reg = reg,
+		.tx_data = &value,
+		.tx_count = 1,
+	};
+	if (pd_reg_transfer(&transfer) != PD_I2C_DONE) {
+		pd_reg_stats.failed_writes++;
+		if (PD_REG_CACHED(reg)) {
+			cache_valid = 0;
+		}
+		return;
+	}
+
+	pd_reg_store(reg, value);
+}
+
+void pd_write_fifo(uint8_t *data, size_t count) {
+	struct pd_i2c_transfer transfer = {
+		.reg = PD_REG_FIFOS,
+		.tx_data = data,
+		.tx_count = count,
+	};
+	pd_reg_transfer(&transfer);
+}
+
+uint8_t pd_read_reg(uint8_t reg) {
+	if (PD_REG_CACHED(reg) && (cache_valid || (cache_dirty & (1 << PD_REG_INDEX(reg))))) {
+		pd_reg_stats.avoided_transactions++;
+		return cache[PD_REG_INDEX(reg)];
+	}
+
+	uint8_t value = 0;
+	struct pd_i2c_transfer transfer = {
+		.reg = reg,
+		.rx_data = &value,
+		.rx_count = 1,
+	};
+	pd_reg_transfer(&transfer);
+
+	return value;
+}
+
+void pd_read_fifo(uint8_t *data, size_t count) {
+	struct pd_i2c_transfer transfer = {
+		.reg = PD_REG_FIFOS,
+		.rx_data = data,
+		.rx_count = count,
+	};
+	pd_reg_transfer(&transfer);
+}
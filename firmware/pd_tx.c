@@ -0,0 +1,230 @@
+// Transmit queue for the FUSB302.
+//
+// Messages are encoded into TX FIFO tokens when they're queued, so that once
+// the message ahead of them has gone out (I_TXSENT) or given up (I_RETRYFAIL),
+// the next one can be launched with a single FIFO write. A TXON token at the
+// end of each frame starts transmission, which saves writing TX_START to
+// CONTROL0 separately.
+//
+// Payloads are copied into the frame as they are, since both the MCU and the
+// wire are little-endian (pd_rx_decode() relies on the same).
+//
+// See FUSB302-D datasheet Rev 2 (July 2017), Table 41 "Tokens used in TxFIFO"
+#include "pd.h"
+#include <stddef.h>
+#include <string.h>
+#include "pd_i2c.h"
+#include "prof.h"
+
+#define PD_TXFIFO_TOK_TXON (0xA1)
+
+struct pd_tx_stats pd_tx_stats;
+
+static struct pd_tx *queue[PD_TX_QUEUE_LENGTH];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+
+static struct pd_i2c_transfer launch_transfer;
+
+static void pd_tx_launch() {
+	struct pd_tx *tx = queue[queue_head];
+	tx->status = PD_TX_SENDING;
+
+	// Goes out behind any bus traffic already queued, without waiting for it
+	launch_transfer = (struct pd_i2c_transfer) {
+		.reg = PD_REG_FIFOS,
+		.tx_data = tx->frame,
+		.tx_count = tx->frame_size,
+	};
+	pd_reg_stats.transactions++;
+	while (!pd_i2c_submit(&launch_transfer));
+}
+
+static struct pd_tx *pd_tx_pop() {
+	struct pd_tx *tx = queue[queue_head];
+	queue_head = (queue_head + 1) % PD_TX_QUEUE_LENGTH;
+	queue_count--;
+	return tx;
+}
+
+// Let a message's owner know how it went. The callback may queue more
+// messages, so the queue must be consistent before this is called.
+static void pd_tx_complete(struct pd_tx *tx, enum pd_tx_status status) {
+	tx->status = status;
+	if (tx->callback != NULL) {
+		tx->callback(tx);
+	}
+}
+
+// Empty the queue, returning how many messages were in it
+static int pd_tx_take_all(struct pd_tx **taken) {
+	int count = 0;
+	while (queue_count > 0) {
+		taken[count++] = pd_tx_pop();
+	}
+	return count;
+}
+
+void pd_tx_reset() {
+	struct pd_tx *taken[PD_TX_QUEUE_LENGTH];
+	int count = pd_tx_take_all(taken);
+
+	for (int i = 0; i < count; ++i) {
+		pd_tx_stats.discarded++;
+		pd_tx_complete(taken[i], PD_TX_DISCARDED);
+	}
+}
+
+// Whether tx can be encoded and queued: there's room, and it isn't queued
+// already. A queued message's frame may be on its way to the FIFO, so it
+// mustn't be encoded over until it's done.
+static int pd_tx_can_submit(const struct pd_tx *tx) {
+	return queue_count < PD_TX_QUEUE_LENGTH && tx->status != PD_TX_QUEUED && tx->status != PD_TX_SENDING;
+}
+
+static void pd_tx_submit(struct pd_tx *tx) {
+	tx->status = PD_TX_QUEUED;
+	queue[(queue_head + queue_count) % PD_TX_QUEUE_LENGTH] = tx;
+	queue_count++;
+
+	if (queue_count == 1) {
+		pd_tx_launch();
+	}
+}
+
+static size_t pd_tx_begin(uint8_t *data, uint8_t message_length, uint16_t header) {
+	size_t count = 0;
+
+	// SOP header
+	data[count++] = PD_TXFIFO_TOK_SOP1;
+	data[count++] = PD_TXFIFO_TOK_SOP1;
+	data[count++] = PD_TXFIFO_TOK_SOP1;
+	data[count++] = PD_TXFIFO_TOK_SOP2;
+
+	// PACKSYM for message bytes
+	data[count++] = PD_TXFIFO_TOK_PACKSYM(message_length);
+
+	// Message header
+	data[count++] = header & 0xFF;
+	data[count++] = (header >> 8) & 0xFF;
+
+	return count;
+}
+
+static size_t pd_tx_end(uint8_t *data, size_t count) {
+	// Message trailer
+	data[count++] = PD_TXFIFO_TOK_JAM_CRC;
+	data[count++] = PD_TXFIFO_TOK_EOP;
+	data[count++] = PD_TXFIFO_TOK_TXOFF;
+
+	// Start TX once the whole frame is in the FIFO
+	data[count++] = PD_TXFIFO_TOK_TXON;
+
+	return count;
+}
+
+void pd_tx_encode_standard(struct pd_tx *tx, uint16_t header, const struct pd_message_standard *payload) {
+	size_t payload_size = pd_header_count(header) * 4;
+	// Total message length is 16-bit header (2 bytes) + 4 bytes per data object
+	size_t count = pd_tx_begin(tx->frame, 2 + payload_size, header);
+
+	memcpy(&tx->frame[count], payload->data_objects, payload_size);
+	count += payload_size;
+
+	tx->frame_size = pd_tx_end(tx->frame, count);
+}
+
+void pd_tx_encode_extended(struct pd_tx *tx, uint16_t header, const struct pd_message_extended *payload) {
+	size_t data_size = pd_extended_header_data_size(payload->extended_header);
+	if (pd_extended_header_chunked(payload->extended_header)) {
+		// Data Size is the whole message's, and a chunk is padded out to the
+		// data objects counted in the header
+		data_size = pd_header_count(header) * 4 - 2;
+	}
+	if (data_size > sizeof(payload->data)) {
+		data_size = sizeof(payload->data);
+	}
+	// Total message length is 16-bit header (2 bytes) + 16-bit extended header
+	// (2 bytes) + data size
+	uint8_t message_length = 4 + data_size;
+
+	size_t count = pd_tx_begin(tx->frame, message_length, header);
+
+	// Extended header and data, which struct pd_message_extended lays out as
+	// they go on the wire
+	memcpy(&tx->frame[count], payload, 2 + data_size);
+	count += 2 + data_size;
+
+	tx->frame_size = pd_tx_end(tx->frame, count);
+}
+
+int pd_tx_standard(struct pd_tx *tx, uint16_t header, const struct pd_message_standard *payload) {
+	if (!pd_tx_can_submit(tx)) {
+		return 0;
+	}
+
+	PROF_ENTER(PROF_TX_BUILD);
+	pd_tx_encode_standard(tx, header, payload);
+	PROF_EXIT(PROF_TX_BUILD);
+	pd_tx_submit(tx);
+	return 1;
+}
+
+int pd_tx_extended(struct pd_tx *tx, uint16_t header, const struct pd_message_extended *payload) {
+	if (!pd_tx_can_submit(tx)) {
+		return 0;
+	}
+
+	PROF_ENTER(PROF_TX_BUILD);
+	pd_tx_encode_extended(tx, header, payload);
+	PROF_EXIT(PROF_TX_BUILD);
+	pd_tx_submit(tx);
+	return 1;
+}
+
+void pd_tx_hard_reset() {
+	// Hard Reset clears the protocol layer, so nothing queued is still wanted
+	pd_tx_reset();
+	pd_reg_strobe(PD_REG_CONTROL3, PD_CONTROL3_SEND_HARD_RESET);
+}
+
+void pd_tx_interrupt(uint8_t interrupta, uint8_t interrupt) {
+	if (interrupta & PD_INTERRUPTA_I_HARDRST) {
+		pd_tx_reset();
+		return;
+	}
+
+	if (queue_count == 0 || queue[queue_head]->status != PD_TX_SENDING) {
+		return;
+	}
+
+	if (interrupta & PD_INTERRUPTA_I_TXSENT) {
+		struct pd_tx *tx = pd_tx_pop();
+		if (queue_count > 0) {
+			pd_tx_stats.back_to_back++;
+			pd_tx_launch();
+		}
+
+		pd_tx_stats.sent++;
+		pd_tx_complete(tx, PD_TX_SENT);
+	} else if (
+		(interrupta & (PD_INTERRUPTA_I_RETRYFAIL | PD_INTERRUPTA_I_SOFTFAIL)) ||
+		(interrupt & PD_INTERRUPT_I_COLLISION)
+	) {
+		// Whatever is left of the frame mustn't go out in front of the next
+		// one. Anything queued behind it was sent on the assumption this one
+		// would arrive, so it goes too.
+		pd_reg_strobe(PD_REG_CONTROL0, PD_CONTROL0_TX_FLUSH);
+
+		struct pd_tx *tx = pd_tx_pop();
+		struct pd_tx *taken[PD_TX_QUEUE_LENGTH];
+		int count = pd_tx_take_all(taken);
+
+		pd_tx_stats.failed++;
+		pd_tx_complete(tx, PD_TX_FAILED);
+		for (int i = 0; i < count; ++i) {
+			pd_tx_stats.discarded++;
+			pd_tx_complete(taken[i], PD_TX_DISCARDED);
+		}
+	}
+}
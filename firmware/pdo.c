@@ -0,0 +1,258 @@
+// PDO fields (USB PD R3.0 tables 6-9 to 6-13) and RDO fields (tables 6-21
+// to 6-23). Voltages are in 50 mV units in PDOs (100 mV for a PPS), currents
+// in 10 mA units (50 mA for a PPS) and power in 250 mW units. Amounts asked
+// for are rounded up to the next unit.
+#include "pdo.h"
+
+#define PDO_TYPE_POS (30)
+#define PDO_TYPE_FIXED (0b00)
+#define PDO_TYPE_BATTERY (0b01)
+#define PDO_TYPE_VARIABLE (0b10)
+#define PDO_TYPE_AUGMENTED (0b11)
+#define PDO_APDO_TYPE_POS (28)
+#define PDO_APDO_TYPE_PPS (0b00)
+
+#define RDO_CAPABILITY_MISMATCH (1 << 26)
+#define RDO_OPERATING_POS (10)
+
+// The first PDO is always vSafe5V, and is what's asked for when nothing else
+// will do
+#define PDO_SAFE_POSITION (1)
+
+static uint32_t pdo_field(uint32_t raw, int pos, int bits) {
+	return (raw >> pos) & ((1u << bits) - 1);
+}
+
+static uint32_t pdo_min(uint32_t a, uint32_t b) {
+	return a < b ? a : b;
+}
+
+static uint32_t pdo_div_up(uint32_t a, uint32_t b) {
+	return (a + b - 1) / b;
+}
+
+void pdo_parse(uint32_t raw, struct pdo *pdo) {
+	*pdo = (struct pdo) { 0 };
+
+	switch (raw >> PDO_TYPE_POS) {
+	case PDO_TYPE_FIXED:
+		pdo->type = PDO_FIXED;
+		pdo->min_mv = pdo_field(raw, 10, 10) * 50;
+		pdo->max_mv = pdo->min_mv;
+		pdo->max_ma = pdo_field(raw, 0, 10) * 10;
+		break;
+
+	case PDO_TYPE_BATTERY:
+		pdo->type = PDO_BATTERY;
+		pdo->max_mv = pdo_field(raw, 20, 10) * 50;
+		pdo->min_mv = pdo_field(raw, 10, 10) * 50;
+		pdo->max_mw = pdo_field(raw, 0, 10) * 250;
+		break;
+
+	case PDO_TYPE_VARIABLE:
+		pdo->type = PDO_VARIABLE;
+		pdo->max_mv = pdo_field(raw, 20, 10) * 50;
+		pdo->min_mv = pdo_field(raw, 10, 10) * 50;
+		pdo->max_ma = pdo_field(raw, 0, 10) * 10;
+		break;
+
+	case PDO_TYPE_AUGMENTED:
+		if (pdo_field(raw, PDO_APDO_TYPE_POS, 2) != PDO_APDO_TYPE_PPS) {
+			pdo->type = PDO_UNKNOWN;
+			break;
+		}
+
+		pdo->type = PDO_PPS;
+		pdo->max_mv = pdo_field(raw, 17, 8) * 100;
+		pdo->min_mv = pdo_field(raw, 8, 8) * 100;
+		pdo->max_ma = pdo_field(raw, 0, 7) * 50;
+		break;
+	}
+}
+
+// Power the PDO is good for at its lowest voltage (or at mv for a PPS)
+static uint32_t pdo_power(const struct pdo *pdo, uint32_t mv) {
+	if (pdo->type == PDO_BATTERY) {
+		return pdo->max_mw;
+	}
+	return mv * pdo->max_ma / 1000;
+}
+
+// Ask for ma of current (or the power that takes at the PDO's highest voltage,
+// for a battery)
+static void pdo_ask(const struct pdo *pdo, uint32_t ma, struct pdo_choice *choice) {
+	if (pdo->type == PDO_BATTERY) {
+		choice->mw = pdo_div_up(pdo->max_mv * ma, 1000);
+		choice->max_mw = choice->mw;
+	} else {
+		choice->ma = ma;
+		choice->max_ma = ma;
+	}
+}
+
+// Work out what the PDO would be asked for under the policy, and how good a
+// choice it is (higher is better). Returns 0 if it doesn't meet the policy.
+static int pdo_evaluate(
+	const struct pdo *pdo, const struct pdo_policy *policy, struct pdo_choice *choice, int32_t *score
+) {
+	// Nothing can be asked of a PDO that offers nothing
+	if (pdo->max_mv == 0 || (pdo->type == PDO_BATTERY ? pdo->max_mw : pdo->max_ma) == 0) {
+		return 0;
+	}
+
+	choice->type = pdo->type;
+	choice->mv = pdo->min_mv;
+
+	switch (policy->type) {
+	case PDO_POLICY_MAX_POWER:
+		if (pdo->type == PDO_PPS) {
+			choice->mv = pdo->max_mv;
+		}
+		if (pdo->type == PDO_BATTERY) {
+			choice->mw = pdo->max_mw;
+			choice->max_mw = pdo->max_mw;
+		} else {
+			pdo_ask(pdo, pdo->max_ma, choice);
+		}
+		*score = pdo_power(pdo, choice->mv);
+		return 1;
+
+	case PDO_POLICY_VOLTAGE_WINDOW: {
+		if (pdo->type == PDO_PPS) {
+			uint32_t mv = pdo_min(pdo->max_mv, policy->max_mv);
+			choice->mv = mv - mv % PDO_PPS_STEP_MV;
+			if (choice->mv < pdo->min_mv || choice->mv < policy->min_mv) {
+				return 0;
+			}
+		} else if (pdo->min_mv < policy->min_mv || pdo->max_mv > policy->max_mv) {
+			return 0;
+		}
+
+		// A battery's current is lowest at its highest voltage
+		uint32_t ma = pdo->type == PDO_BATTERY ? pdo->max_mw * 1000 / pdo->max_mv : pdo->max_ma;
+		if (ma < policy->min_ma) {
+			return 0;
+		}
+
+		pdo_ask(pdo, policy->min_ma, choice);
+		*score = pdo_power(pdo, choice->mv);
+		return 1;
+	}
+
+	case PDO_POLICY_MIN_VOLTAGE:
+		if (pdo->type == PDO_PPS) {
+			// Just high enough for the power at full current
+			uint32_t mv = pdo_div_up(policy->min_mw * 1000, pdo->max_ma);
+			mv = pdo_div_up(mv, PDO_PPS_STEP_MV) * PDO_PPS_STEP_MV;
+			choice->mv = mv > pdo->min_mv ? mv : pdo->min_mv;
+			if (choice->mv > pdo->max_mv) {
+				return 0;
+			}
+		} else if (pdo_power(pdo, pdo->min_mv) < policy->min_mw) {
+			return 0;
+		}
+
+		if (pdo->type == PDO_BATTERY) {
+			choice->mw = policy->min_mw;
+			choice->max_mw = policy->min_mw;
+		} else {
+			pdo_ask(pdo, pdo_div_up(policy->min_mw * 1000, choice->mv), choice);
+		}
+		// A variable supply or battery could be anywhere in its range, so goes
+		// by the top of it
+		*score = -(int32_t) (pdo->type == PDO_PPS ? choice->mv : pdo->max_mv);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Fall back to vSafe5V, asking for what the policy wanted and flagging that
+// it isn't enough
+static void pdo_select_safe(const uint32_t *pdos, const struct pdo_policy *policy, struct pdo_choice *choice) {
+	struct pdo pdo;
+	pdo_parse(pdos[PDO_SAFE_POSITION - 1], &pdo);
+
+	uint32_t ma = pdo.max_ma;
+	if (policy->type == PDO_POLICY_VOLTAGE_WINDOW) {
+		ma = policy->min_ma;
+	} else if (policy->type == PDO_POLICY_MIN_VOLTAGE && pdo.min_mv != 0) {
+		ma = pdo_div_up(policy->min_mw * 1000, pdo.min_mv);
+	}
+
+	*choice = (struct pdo_choice) {
+		.position = PDO_SAFE_POSITION,
+		.type = PDO_FIXED,
+		.mv = pdo.min_mv,
+		.ma = pdo_min(ma, pdo.max_ma),
+		// Asking for more than is offered is allowed with the mismatch bit
+		.max_ma = ma,
+		.mismatch = 1,
+	};
+}
+
+void pdo_select(const uint32_t *pdos, int count, const struct pdo_policy *policy, struct pdo_choice *choice) {
+	int32_t best_score = 0;
+	choice->position = 0;
+
+	for (int i = 0; i < count; ++i) {
+		struct pdo pdo;
+		pdo_parse(pdos[i], &pdo);
+		if (pdo.type == PDO_UNKNOWN) {
+			continue;
+		}
+
+		struct pdo_choice candidate = { .position = i + 1 };
+		int32_t score;
+		if (!pdo_evaluate(&pdo, policy, &candidate, &score)) {
+			continue;
+		}
+
+		// On a tie, a PPS loses to anything that doesn't need keep-alives, and
+		// otherwise the later (higher voltage) PDO wins, unless the policy is
+		// after the lowest voltage
+		int better;
+		if (choice->position == 0 || score != best_score) {
+			better = choice->position == 0 || score > best_score;
+		} else if ((choice->type == PDO_PPS) != (candidate.type == PDO_PPS)) {
+			better = candidate.type != PDO_PPS;
+		} else {
+			better = policy->type != PDO_POLICY_MIN_VOLTAGE;
+		}
+
+		if (better) {
+			*choice = candidate;
+			best_score = score;
+		}
+	}
+
+	if (choice->position == 0) {
+		pdo_select_safe(pdos, policy, choice);
+	}
+}
+
+uint32_t pdo_rdo(const struct pdo_choice *choice) {
+	uint32_t rdo = (uint32_t) choice->position << RDO_POSITION_POS;
+	if (choice->mismatch) {
+		rdo |= RDO_CAPABILITY_MISMATCH;
+	}
+
+	switch (choice->type) {
+	case PDO_PPS:
+		rdo |= (choice->mv / PDO_PPS_STEP_MV) << RDO_PPS_VOLTAGE_POS;
+		rdo |= pdo_min(pdo_div_up(choice->ma, 50), 0x7f);
+		break;
+
+	case PDO_BATTERY:
+		rdo |= pdo_min(pdo_div_up(choice->mw, 250), 0x3ff) << RDO_OPERATING_POS;
+		rdo |= pdo_min(pdo_div_up(choice->max_mw, 250), 0x3ff);
+		break;
+
+	default:
+		rdo |= pdo_min(pdo_div_up(choice->ma, 10), 0x3ff) << RDO_OPERATING_POS;
+		rdo |= pdo_min(pdo_div_up(choice->max_ma, 10), 0x3ff);
+		break;
+	}
+
+	return rdo;
+}
@@ -0,0 +1,87 @@
+#ifndef PDO_H
+#define PDO_H
+#include <stdint.h>
+
+// Power Data Objects and Request Data Objects, after USB PD R3.0 sections
+// 6.4.1 "Capabilities Message" and 6.4.2 "Request Message", and picking which
+// PDO to ask for
+
+enum pdo_type {
+	PDO_FIXED,
+	PDO_BATTERY,
+	PDO_VARIABLE,
+	// Augmented PDO for a Programmable Power Supply
+	PDO_PPS,
+	// Augmented PDO of a type this doesn't know about
+	PDO_UNKNOWN,
+};
+
+// PPS output voltage is requested in 20 mV steps
+#define PDO_PPS_STEP_MV (20)
+
+struct pdo {
+	enum pdo_type type;
+	// Equal for fixed supplies
+	uint32_t min_mv;
+	uint32_t max_mv;
+	// Zero for batteries, which give power instead
+	uint32_t max_ma;
+	uint32_t max_mw;
+};
+
+enum pdo_policy_type {
+	// The most power any PDO offers, asking for all of its current
+	PDO_POLICY_MAX_POWER,
+	// The most power from a PDO that stays within min_mv to max_mv and gives at
+	// least min_ma. A PPS is programmed as high as the window allows.
+	PDO_POLICY_VOLTAGE_WINDOW,
+	// The lowest voltage that gives at least min_mw. A PPS is programmed just
+	// high enough.
+	PDO_POLICY_MIN_VOLTAGE,
+};
+
+struct pdo_policy {
+	enum pdo_policy_type type;
+	uint32_t min_mv;
+	uint32_t max_mv;
+	uint32_t min_ma;
+	uint32_t min_mw;
+};
+
+// What to ask for. ma and max_ma are the operating and maximum current,
+// except for a battery, which is asked for power (mw and max_mw) instead.
+struct pdo_choice {
+	// Counts from 1, as in the RDO
+	int position;
+	enum pdo_type type;
+	// Voltage asked of a PPS, or the lowest the PDO can give otherwise
+	uint32_t mv;
+	uint32_t ma;
+	uint32_t max_ma;
+	uint32_t mw;
+	uint32_t max_mw;
+	// Set if no PDO meets the policy, and vSafe5V was picked instead
+	int mismatch;
+};
+
+void pdo_parse(uint32_t raw, struct pdo *pdo);
+
+// Pick from a Source_Capabilities. Only looks at each PDO once, so it takes
+// the same time whatever the policy.
+void pdo_select(const uint32_t *pdos, int count, const struct pdo_policy *policy, struct pdo_choice *choice);
+
+uint32_t pdo_rdo(const struct pdo_choice *choice);
+
+#define RDO_POSITION_POS (28)
+#define RDO_PPS_VOLTAGE_POS (9)
+
+// Object position (counting from 1) of the PDO an RDO asks for
+static inline int pdo_rdo_position(uint32_t rdo) {
+	return rdo >> RDO_POSITION_POS;
+}
+
+// Output voltage an RDO asks of a PPS
+static inline uint32_t pdo_rdo_pps_mv(uint32_t rdo) {
+	return ((rdo >> RDO_PPS_VOLTAGE_POS) & 0x7FF) * PDO_PPS_STEP_MV;
+}
+#endif
@@ -0,0 +1,62 @@
+// Zone statistics go to the log as LOG_RAW_PROF records, each with:
+//   - the offset of the zone's name in the .log_fmt section (halfword)
+//   - count, min and max (words)
+//   - total (double word)
+// all little-endian. tools/prof.py prints the newest of each.
+#include "prof.h"
+#include "log.h"
+#include "swtimer.h"
+
+#ifdef PROFILE
+#define PROF_NAME_SIZE (16)
+
+struct prof_zone_stats prof_stats[PROF_ZONE_COUNT];
+
+// In enum prof_zone order. Kept with the log's format strings, so they cost
+// no flash and the host can look them up the same way.
+static const char prof_names[PROF_ZONE_COUNT][PROF_NAME_SIZE] __attribute__((section(LOG_FMT_SECTION), used)) = {
+	"main_loop",
+	"i2c_transfer",
+	"i2c_submit",
+	"rx_poll",
+	"rx_decode",
+	"tx_build",
+	"pdo_select",
+	"log_event",
+	"log_flush",
+};
+
+void prof_setup() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static size_t prof_put(uint8_t *data, uint32_t value) {
+	for (int i = 0; i < 4; ++i) {
+		data[i] = value >> (i * 8);
+	}
+	return 4;
+}
+
+void prof_save() {
+	uint32_t now = swtimer_now();
+
+	for (int zone = 0; zone < PROF_ZONE_COUNT; ++zone) {
+		const struct prof_zone_stats *stats = &prof_stats[zone];
+
+		uint8_t data[2 + 4 * 3 + 8];
+		uint16_t name = (uintptr_t) prof_names[zone];
+		data[0] = name & 0xFF;
+		data[1] = name >> 8;
+		size_t size = 2;
+		size += prof_put(&data[size], stats->count);
+		size += prof_put(&data[size], stats->min);
+		size += prof_put(&data[size], stats->max);
+		size += prof_put(&data[size], stats->total);
+		size += prof_put(&data[size], stats->total >> 32);
+
+		log_raw(LOG_RAW_PROF, now, data, size);
+	}
+}
+#endif
@@ -0,0 +1,66 @@
+#ifndef PROF_H
+#define PROF_H
+#include <stdint.h>
+
+// Cycle counts for hot paths, from the DWT cycle counter (72 per us). Built in
+// with `make PROFILE=1` - otherwise the zone macros compile to nothing.
+//
+// Wrap the code to measure in PROF_ENTER(zone) and PROF_EXIT(zone) in the same
+// block. Zones may nest, but each zone's enter and exit must pair up, and
+// zones are only for the main loop's context (not interrupt handlers).
+enum prof_zone {
+	PROF_MAIN_LOOP,
+	// pd_i2c_transfer(): queueing a transfer and waiting for it to finish
+	PROF_I2C_TRANSFER,
+	// pd_i2c_submit(): queueing a transfer, starting it if the bus is free
+	PROF_I2C_SUBMIT,
+	// pd_poll_rxfifo(): reading the interrupt registers and a message, and
+	// decoding it
+	PROF_RX_POLL,
+	PROF_RX_DECODE,
+	// pd_tx_standard()/pd_tx_extended(): encoding a message and queueing it
+	PROF_TX_BUILD,
+	// pdo_select(): picking a PDO from Source_Capabilities
+	PROF_PDO_SELECT,
+	PROF_LOG_EVENT,
+	PROF_LOG_FLUSH,
+	PROF_ZONE_COUNT,
+};
+
+struct prof_zone_stats {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+};
+
+#ifdef PROFILE
+#include <gd32f1x0.h>
+#include <core_cm3.h>
+
+extern struct prof_zone_stats prof_stats[PROF_ZONE_COUNT];
+
+static inline void prof_record(enum prof_zone zone, uint32_t cycles) {
+	struct prof_zone_stats *stats = &prof_stats[zone];
+	if (stats->count == 0 || cycles < stats->min) {
+		stats->min = cycles;
+	}
+	if (cycles > stats->max) {
+		stats->max = cycles;
+	}
+	stats->total += cycles;
+	stats->count++;
+}
+
+#define PROF_ENTER(zone) uint32_t prof_start_##zone = DWT->CYCCNT
+#define PROF_EXIT(zone) prof_record(zone, DWT->CYCCNT - prof_start_##zone)
+
+// Start the cycle counter
+void prof_setup();
+// Queue the statistics to be written to the log, one raw record per zone
+void prof_save();
+#else
+#define PROF_ENTER(zone) do { } while (0)
+#define PROF_EXIT(zone) do { } while (0)
+#endif
+#endif
@@ -0,0 +1,932 @@
+// Sink policy engine, after USB PD R3.0 section 8.3.3.3 "Policy Engine Sink
+// Port State Diagram"
+#include "sink.h"
+#include <stdint.h>
+#include "led.h"
+#include "log.h"
+#include "pd.h"
+#include "pd_ext.h"
+#include "pdo.h"
+#include "prof.h"
+#include "swtimer.h"
+
+// Maximum number of messages pulled out of the RX FIFO in one go
+#define RX_BATCH_SIZE (4)
+
+// Timer values in us (USB PD R3.0 table 6-68), picked from the middle of each
+// allowed range
+#define T_SENDER_RESPONSE (27000)
+#define T_SINK_WAIT_CAP (465000)
+#define T_PS_TRANSITION (500000)
+#define T_SINK_REQUEST (100000)
+#define N_HARD_RESET_COUNT (2)
+// CC has to stay open for tPDDebounce before it counts as a detach, since
+// BC_LVL also dips with the BMC signalling of every message
+#define T_PD_DEBOUNCE (15000)
+// After a Hard Reset the source takes VBUS down to vSafe0V and back up, within
+// tSafe0V + tSrcRecover + tSrcTurnOn. Losing VBUS in that time isn't a detach.
+#define T_HARD_RESET_VBUS (650000 + 1000000 + 275000)
+// A PPS contract lapses if the sink hasn't sent a Request for tPPSRequest
+// (10 s at the most), so one goes out this long after the last
+#define T_PPS_KEEP_ALIVE (8000000)
+// How long to wait for the next chunk of an extended message once it's been
+// asked for (tChunkSenderResponse, 24-30 ms)
+#define T_CHUNK_SENDER_RESPONSE (27000)
+
+// Source_Capabilities must be answered within tSenderResponse (24 ms at the
+// least) of the source seeing GoodCRC. tReceiverResponse leaves margin for
+// the GoodCRC and the Request itself on the wire.
+#define SINK_RESPONSE_BUDGET (15000)
+
+// Current given in the Sink_Capabilities
+#define SINK_MAX_CURRENT (500)
+
+enum sink_state {
+	SINK_STARTUP,
+	SINK_WAIT_FOR_CAPABILITIES,
+	SINK_EVALUATE_CAPABILITY,
+	SINK_SELECT_CAPABILITY,
+	SINK_TRANSITION_SINK,
+	SINK_READY,
+	// Asking the source for something sink_get_info() wanted
+	SINK_GET_INFO,
+	SINK_GIVE_SINK_CAP,
+	SINK_SEND_NOT_SUPPORTED,
+	SINK_SOFT_RESET,
+	SINK_SEND_SOFT_RESET,
+	SINK_HARD_RESET,
+	SINK_TRANSITION_TO_DEFAULT,
+	SINK_DISABLED,
+};
+
+// Message ID counters for each SOP* type (USB PD R3.0 section 6.7.1)
+enum sink_sop {
+	SINK_SOP,
+	SINK_SOP1,
+	SINK_SOP2,
+	SINK_SOP_COUNT,
+};
+
+struct sink_protocol {
+	uint8_t tx_message_id;
+	// Last received MessageID, or -1 if nothing has been received since the
+	// last reset
+	int8_t rx_message_id;
+};
+
+struct sink_stats sink_stats;
+
+static struct pd_message messages[RX_BATCH_SIZE];
+
+static int started = 0;
+static enum sink_state state = SINK_STARTUP;
+static struct sink_protocol protocol[SINK_SOP_COUNT];
+
+// Each state runs at most one of the policy engine's timers at a time
+static struct swtimer pe_timer;
+static struct swtimer cc_debounce_timer;
+static struct swtimer hard_reset_vbus_timer;
+// Runs alongside pe_timer while an extended message is coming in chunks
+static struct swtimer chunk_timer;
+static sink_detach_callback detach_callback;
+
+// Messages are sent from these in turn, so one can be queued while the last
+// is still going out
+static struct pd_tx tx_messages[PD_TX_QUEUE_LENGTH];
+static int tx_next = 0;
+// The message whose outcome the policy engine is waiting on, if any
+static struct pd_tx *tx_current = NULL;
+
+static int explicit_contract = 0;
+static int hard_reset_count = 0;
+
+static uint32_t source_capabilities[7];
+static int source_capabilities_count = 0;
+// What the last Request asked for
+static struct pdo_choice selected;
+// swtimer_now() when the Source_Capabilities being answered was read
+static uint32_t source_capabilities_time;
+// Set from Source_Capabilities arriving to the Request answering it going out
+static int answering_capabilities = 0;
+// swtimer_now() when the last Request went out, for the PPS keep-alive
+static uint32_t last_request_time;
+
+// How to pick from the source's PDOs, until sink_set_policy() says otherwise
+static struct pdo_policy policy = {
+	.type = PDO_POLICY_MAX_POWER,
+};
+// Set by sink_set_policy() until a Request under the new policy goes out, and
+// then until the source has switched to it
+static int policy_pending = 0;
+static int policy_requested = 0;
+static uint32_t policy_time;
+
+// Spec Revision in the source's last Source_Capabilities. Only PD 3.0 has
+// extended messages.
+static uint8_t source_revision;
+// SINK_INFO_* still to ask for, and what the request under way is for
+static uint32_t info_pending = 0;
+static uint32_t info_current = 0;
+
+// Extended message coming in chunks
+static struct pd_ext_rx ext_rx;
+// Set while the last message sent was a Chunk Request, and when it went out
+static int chunk_requesting = 0;
+static uint32_t chunk_request_time;
+
+static int led = 0b010;
+
+static void sink_enter(enum sink_state new_state);
+static void sink_handle_tx_result(int success);
+
+static void sink_timer_start(uint32_t duration) {
+	swtimer_start(&pe_timer, duration, 0);
+}
+
+static void sink_timer_stop() {
+	swtimer_stop(&pe_timer);
+}
+
+static void sink_reset_protocol() {
+	for (int i = 0; i < SINK_SOP_COUNT; ++i) {
+		protocol[i].tx_message_id = 0;
+		protocol[i].rx_message_id = -1;
+	}
+
+	// Outcomes of anything still queued no longer matter
+	tx_current = NULL;
+
+	pd_ext_rx_reset(&ext_rx);
+	swtimer_stop(&chunk_timer);
+	chunk_requesting = 0;
+}
+
+static void sink_tx_done(struct pd_tx *tx) {
+	if (tx != tx_current) {
+		return;
+	}
+
+	tx_current = NULL;
+
+	// Only a reset or an earlier failure discards a message, and the policy
+	// engine is already dealing with either
+	if (tx->status != PD_TX_DISCARDED) {
+		sink_handle_tx_result(tx->status == PD_TX_SENT);
+	}
+}
+
+static uint16_t sink_header(uint8_t message_type, int count, uint16_t flags) {
+	// Spec revision 3.0, sink, UFP
+	return pd_header(message_type, protocol[SINK_SOP].tx_message_id, count, flags);
+}
+
+static struct pd_tx *sink_tx_next() {
+	// A slot that isn't still queued, taking them in turn. If both are,
+	// pd_tx_*() refuses the one picked without touching it.
+	struct pd_tx *tx = &tx_messages[tx_next];
+	for (int i = 0; i < PD_TX_QUEUE_LENGTH; ++i) {
+		struct pd_tx *slot = &tx_messages[(tx_next + i) % PD_TX_QUEUE_LENGTH];
+		if (slot->status != PD_TX_QUEUED && slot->status != PD_TX_SENDING) {
+			tx = slot;
+			break;
+		}
+	}
+	tx_next = (tx - tx_messages + 1) % PD_TX_QUEUE_LENGTH;
+	tx->callback = sink_tx_done;
+
+	tx_current = tx;
+	return tx;
+}
+
+static void sink_send(uint8_t message_type, const uint32_t *data_objects, int count) {
+	struct pd_message_standard payload;
+	for (int i = 0; i < count; ++i) {
+		payload.data_objects[i] = data_objects[i];
+	}
+
+	if (!pd_tx_standard(sink_tx_next(), sink_header(message_type, count, 0), &payload)) {
+		tx_current = NULL;
+		sink_handle_tx_result(0);
+	}
+}
+
+// Send data (size bytes, which must fit in a chunk) as an extended message
+static void sink_send_extended(uint8_t message_type, const uint8_t *data, size_t size) {
+	struct pd_message_extended payload;
+	int count = pd_ext_chunk(data, size, 0, &payload);
+
+	uint16_t header = sink_header(message_type, count, PD_HEADER_EXTENDED);
+	if (!pd_tx_extended(sink_tx_next(), header, &payload)) {
+		tx_current = NULL;
+		sink_handle_tx_result(0);
+	}
+}
+
+static void sink_send_chunk_request(uint8_t message_type, int chunk) {
+	struct pd_message_extended payload;
+	int count = pd_ext_chunk_request(chunk, &payload);
+
+	sink_stats.chunk_requests++;
+	chunk_requesting = 1;
+	chunk_request_time = swtimer_now();
+
+	uint16_t header = sink_header(message_type, count, PD_HEADER_EXTENDED);
+	if (!pd_tx_extended(sink_tx_next(), header, &payload)) {
+		tx_current = NULL;
+		sink_handle_tx_result(0);
+	}
+}
+
+static void sink_send_request() {
+	uint32_t rdo = pdo_rdo(&selected);
+
+	if (policy_pending) {
+		policy_pending = 0;
+		policy_requested = 1;
+	} else if (selected.type == PDO_PPS && !answering_capabilities) {
+		sink_stats.pps_keep_alives++;
+	}
+	last_request_time = swtimer_now();
+
+	sink_send(PD_DATA_REQUEST, &rdo, 1);
+}
+
+static void sink_send_get_info(uint32_t info) {
+	sink_stats.info_requests++;
+
+	switch (info) {
+	case SINK_INFO_SOURCE_CAP_EXTENDED:
+		sink_send(PD_CONTROL_GET_SOURCE_CAP_EXTENDED, NULL, 0);
+		break;
+
+	case SINK_INFO_STATUS:
+		sink_send(PD_CONTROL_GET_STATUS, NULL, 0);
+		break;
+
+	case SINK_INFO_BATTERY_STATUS: {
+		// Battery Status Ref: the first fixed battery
+		uint8_t ref = 0;
+		sink_send_extended(PD_EXTENDED_GET_BATTERY_STATUS, &ref, sizeof(ref));
+		break;
+	}
+
+	case SINK_INFO_MANUFACTURER_INFO: {
+		// Manufacturer Info Target: the port, rather than a battery
+		uint8_t target[2] = { 0, 0 };
+		sink_send_extended(PD_EXTENDED_GET_MANUFACTURER_INFO, target, sizeof(target));
+		break;
+	}
+
+	case SINK_INFO_COUNTRY_CODES:
+		sink_send(PD_CONTROL_GET_COUNTRY_CODES, NULL, 0);
+		break;
+	}
+}
+
+// Little-endian field of an extended message, or 0 if it's too short to have it
+static uint32_t sink_ext_field(const struct pd_ext_message *message, size_t offset, size_t size) {
+	uint32_t value = 0;
+	for (size_t i = 0; i < size && offset + i < message->size; ++i) {
+		value |= (uint32_t) message->data[offset + i] << (i * 8);
+	}
+	return value;
+}
+
+// Field layouts are in USB PD R3.0 section 6.5
+static void sink_log_info(const struct pd_ext_message *message) {
+	switch (message->message_type) {
+	case PD_EXTENDED_SOURCE_CAPABILITIES_EXTENDED:
+		log_printf(
+			"src_cap_ext: vid=%04x,pid=%04x,xid=%08x,fw=%u,hw=%u,pdp=%uW",
+			sink_ext_field(message, 0, 2), sink_ext_field(message, 2, 2), sink_ext_field(message, 4, 4),
+			sink_ext_field(message, 8, 1), sink_ext_field(message, 9, 1), sink_ext_field(message, 23, 1)
+		);
+		break;
+
+	case PD_EXTENDED_STATUS:
+		log_printf(
+			"status: temp=%uC,input=%02x,events=%02x,temp_status=%02x,power=%02x",
+			sink_ext_field(message, 0, 1), sink_ext_field(message, 1, 1), sink_ext_field(message, 3, 1),
+			sink_ext_field(message, 4, 1), sink_ext_field(message, 5, 1)
+		);
+		break;
+
+	case PD_EXTENDED_MANUFACTURER_INFO:
+		// The rest is a string, which the log can't carry
+		log_printf(
+			"mfr_info: vid=%04x,pid=%04x,len=%u",
+			sink_ext_field(message, 0, 2), sink_ext_field(message, 2, 2), message->size > 4 ? message->size - 4 : 0
+		);
+		break;
+
+	case PD_EXTENDED_COUNTRY_CODES:
+		log_printf(
+			"country_codes: count=%u,first=%c%c",
+			sink_ext_field(message, 0, 1), sink_ext_field(message, 2, 1), sink_ext_field(message, 3, 1)
+		);
+		break;
+
+	default:
+		log_printf("ext: mt=%x,size=%u", message->message_type, message->size);
+		break;
+	}
+}
+
+static void sink_evaluate_capability() {
+	PROF_ENTER(PROF_PDO_SELECT);
+	pdo_select(source_capabilities, source_capabilities_count, &policy, &selected);
+	PROF_EXIT(PROF_PDO_SELECT);
+}
+
+static void sink_enter(enum sink_state new_state) {
+	state = new_state;
+	sink_timer_stop();
+
+	switch (state) {
+	case SINK_STARTUP:
+		sink_reset_protocol();
+		explicit_contract = 0;
+		sink_enter(SINK_WAIT_FOR_CAPABILITIES);
+		break;
+
+	case SINK_WAIT_FOR_CAPABILITIES:
+		sink_timer_start(T_SINK_WAIT_CAP);
+		break;
+
+	case SINK_EVALUATE_CAPABILITY:
+		hard_reset_count = 0;
+		sink_evaluate_capability();
+		sink_enter(SINK_SELECT_CAPABILITY);
+		break;
+
+	case SINK_SELECT_CAPABILITY: {
+		sink_send_request();
+
+		// SenderResponseTimer starts once the Request has been GoodCRC'd
+		if (!answering_capabilities) {
+			break;
+		}
+		answering_capabilities = 0;
+
+		uint32_t now = swtimer_now();
+		if (sink_stats.first_request_time == 0) {
+			sink_stats.first_request_time = now;
+		}
+
+		uint32_t response_time = now - source_capabilities_time;
+		sink_stats.response_time = response_time;
+		if (response_time > sink_stats.response_time_max) {
+			sink_stats.response_time_max = response_time;
+		}
+		if (response_time > SINK_RESPONSE_BUDGET) {
+			sink_stats.responses_late++;
+		}
+		break;
+	}
+
+	case SINK_TRANSITION_SINK:
+		sink_timer_start(T_PS_TRANSITION);
+		break;
+
+	case SINK_READY:
+		if (!explicit_contract) {
+			explicit_contract = 1;
+			uint32_t now = swtimer_now();
+			if (sink_stats.contracts++ == 0) {
+				sink_stats.first_contract_time = now;
+			}
+
+			if (sink_stats.detaches != 0 && sink_stats.recovery_time == 0) {
+				sink_stats.recovery_time = now - sink_stats.detach_time;
+				if (sink_stats.recovery_time > sink_stats.recovery_time_max) {
+					sink_stats.recovery_time_max = sink_stats.recovery_time;
+				}
+			}
+			log_printf("contract: pdo=%d", selected.position - 1);
+		}
+
+		if (policy_requested) {
+			policy_requested = 0;
+			sink_stats.steps++;
+			sink_stats.step_time = swtimer_now() - policy_time;
+			if (sink_stats.step_time > sink_stats.step_time_max) {
+				sink_stats.step_time_max = sink_stats.step_time;
+			}
+			log_printf("policy: pdo=%d,mv=%u,step=%uus", selected.position - 1, selected.mv, sink_stats.step_time);
+		}
+
+		if (source_revision < PD_HEADER_REVISION_3_0) {
+			info_pending = 0;
+		}
+
+		if (policy_pending || info_pending) {
+			// Changed mid-negotiation, or asked for since
+			sink_timer_start(0);
+		} else if (selected.type == PDO_PPS) {
+			uint32_t elapsed = swtimer_now() - last_request_time;
+			sink_timer_start(elapsed < T_PPS_KEEP_ALIVE ? T_PPS_KEEP_ALIVE - elapsed : 0);
+		}
+		break;
+
+	case SINK_GET_INFO:
+		// Lowest bit first
+		info_current = info_pending & -info_pending;
+		info_pending &= ~info_current;
+		sink_send_get_info(info_current);
+		break;
+
+	case SINK_GIVE_SINK_CAP: {
+		// vSafe5V at our maximum current
+		uint32_t pdo = (100 << 10) | (SINK_MAX_CURRENT / 10);
+		sink_send(PD_DATA_SINK_CAPABILITIES, &pdo, 1);
+		break;
+	}
+
+	case SINK_SEND_NOT_SUPPORTED:
+		sink_send(PD_CONTROL_NOT_SUPPORTED, NULL, 0);
+		break;
+
+	case SINK_SOFT_RESET:
+		sink_stats.soft_resets++;
+		sink_reset_protocol();
+		sink_send(PD_CONTROL_ACCEPT, NULL, 0);
+		break;
+
+	case SINK_SEND_SOFT_RESET:
+		sink_stats.soft_resets++;
+		sink_reset_protocol();
+		sink_send(PD_CONTROL_SOFT_RESET, NULL, 0);
+		break;
+
+	case SINK_HARD_RESET:
+		if (hard_reset_count >= N_HARD_RESET_COUNT) {
+			log_write("sink: source not responding");
+			sink_enter(SINK_DISABLED);
+			break;
+		}
+
+		hard_reset_count++;
+		sink_stats.hard_resets_sent++;
+		pd_tx_hard_reset();
+		sink_enter(SINK_TRANSITION_TO_DEFAULT);
+		break;
+
+	case SINK_TRANSITION_TO_DEFAULT:
+		swtimer_start(&hard_reset_vbus_timer, T_HARD_RESET_VBUS, 0);
+		sink_enter(SINK_STARTUP);
+		break;
+
+	case SINK_DISABLED:
+		break;
+	}
+}
+
+static void sink_handle_tx_result(int success) {
+	if (!success) {
+		sink_stats.tx_failures++;
+
+		if (state == SINK_SOFT_RESET || state == SINK_SEND_SOFT_RESET) {
+			sink_enter(SINK_HARD_RESET);
+		} else {
+			sink_enter(SINK_SEND_SOFT_RESET);
+		}
+		return;
+	}
+
+	protocol[SINK_SOP].tx_message_id = (protocol[SINK_SOP].tx_message_id + 1) & 0b111;
+
+	// Chunk Requests are sent from whatever state the chunks come in
+	if (chunk_requesting) {
+		chunk_requesting = 0;
+		swtimer_start(&chunk_timer, T_CHUNK_SENDER_RESPONSE, 0);
+		return;
+	}
+
+	switch (state) {
+	case SINK_SELECT_CAPABILITY:
+	case SINK_SEND_SOFT_RESET:
+	case SINK_GET_INFO:
+		sink_timer_start(T_SENDER_RESPONSE);
+		break;
+
+	case SINK_SOFT_RESET:
+		sink_enter(SINK_WAIT_FOR_CAPABILITIES);
+		break;
+
+	case SINK_GIVE_SINK_CAP:
+	case SINK_SEND_NOT_SUPPORTED:
+		sink_enter(SINK_READY);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void sink_detach(uint32_t *counter) {
+	(*counter)++;
+	sink_stats.detaches++;
+	sink_stats.detach_time = swtimer_now();
+	sink_stats.recovery_time = 0;
+
+	log_printf("sink: detach (vbus=%u,cc=%u)", sink_stats.detaches_vbus, sink_stats.detaches_cc);
+
+	started = 0;
+	swtimer_stop(&pe_timer);
+	swtimer_stop(&cc_debounce_timer);
+	swtimer_stop(&hard_reset_vbus_timer);
+	swtimer_stop(&chunk_timer);
+	pd_tx_reset();
+
+	detach_callback();
+}
+
+static void sink_cc_debounced(struct swtimer *timer) {
+	(void) timer;
+
+	if ((pd_read_reg(PD_REG_STATUS0) & PD_STATUS0_BC_LVL_MASK) == 0) {
+		sink_detach(&sink_stats.detaches_cc);
+	}
+}
+
+static void sink_check_attached(uint16_t events) {
+	uint8_t status0 = pd_status0();
+
+	if ((events & PD_EVENT_VBUS_CHANGE) && (status0 & PD_STATUS0_VBUSOK) == 0) {
+		if (!swtimer_running(&hard_reset_vbus_timer)) {
+			sink_detach(&sink_stats.detaches_vbus);
+			return;
+		}
+	}
+
+	if (events & PD_EVENT_CC_CHANGE) {
+		if ((status0 & PD_STATUS0_BC_LVL_MASK) == 0) {
+			if (!swtimer_running(&cc_debounce_timer)) {
+				swtimer_start(&cc_debounce_timer, T_PD_DEBOUNCE, 0);
+			}
+		} else {
+			swtimer_stop(&cc_debounce_timer);
+		}
+	}
+}
+
+static void sink_handle_events(uint16_t events) {
+	if (events & ~(PD_EVENT_RX | PD_EVENT_TX_SENT)) {
+		log_printf("ev=%04x", events);
+	}
+
+	// Handled first so that the VBUS drop a Hard Reset brings isn't taken for
+	// a detach if it's already been seen
+	if (events & PD_EVENT_HARD_RESET) {
+		sink_stats.hard_resets_received++;
+		log_write("sink: hard reset");
+		sink_enter(SINK_TRANSITION_TO_DEFAULT);
+	}
+
+	sink_check_attached(events);
+}
+
+static void sink_handle_control(uint8_t message_type) {
+	switch (state) {
+	case SINK_SELECT_CAPABILITY:
+		if (message_type == PD_CONTROL_ACCEPT) {
+			sink_enter(SINK_TRANSITION_SINK);
+		} else if (message_type == PD_CONTROL_REJECT || message_type == PD_CONTROL_WAIT) {
+			if (policy_requested) {
+				// A Wait means the same policy is asked for again
+				policy_requested = 0;
+				policy_pending = message_type == PD_CONTROL_WAIT;
+			}
+
+			if (explicit_contract) {
+				sink_enter(SINK_READY);
+				if (message_type == PD_CONTROL_WAIT) {
+					// Ask again once SinkRequestTimer runs out
+					sink_timer_start(T_SINK_REQUEST);
+				}
+			} else {
+				sink_enter(SINK_WAIT_FOR_CAPABILITIES);
+			}
+		} else {
+			sink_enter(SINK_SEND_SOFT_RESET);
+		}
+		break;
+
+	case SINK_TRANSITION_SINK:
+		if (message_type == PD_CONTROL_PS_RDY) {
+			sink_enter(SINK_READY);
+		} else {
+			sink_enter(SINK_HARD_RESET);
+		}
+		break;
+
+	case SINK_SEND_SOFT_RESET:
+		if (message_type == PD_CONTROL_ACCEPT) {
+			sink_enter(SINK_WAIT_FOR_CAPABILITIES);
+		}
+		break;
+
+	case SINK_GET_INFO:
+		if (message_type == PD_CONTROL_NOT_SUPPORTED || message_type == PD_CONTROL_REJECT) {
+			sink_stats.info_refused++;
+			sink_enter(SINK_READY);
+		} else if (message_type != PD_CONTROL_PING) {
+			sink_enter(SINK_SEND_SOFT_RESET);
+		}
+		break;
+
+	case SINK_READY:
+		if (message_type == PD_CONTROL_GET_SINK_CAP) {
+			sink_enter(SINK_GIVE_SINK_CAP);
+		} else if (
+			message_type == PD_CONTROL_ACCEPT || message_type == PD_CONTROL_REJECT ||
+			message_type == PD_CONTROL_WAIT || message_type == PD_CONTROL_PS_RDY
+		) {
+			sink_enter(SINK_SEND_SOFT_RESET);
+		} else if (message_type != PD_CONTROL_PING) {
+			sink_enter(SINK_SEND_NOT_SUPPORTED);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void sink_handle_data(uint8_t message_type, struct pd_message_standard *payload, int count) {
+	if (message_type == PD_DATA_SOURCE_CAPABILITIES && count != 0) {
+		if (state == SINK_SELECT_CAPABILITY || state == SINK_TRANSITION_SINK) {
+			// Not expected mid-negotiation
+			sink_enter(state == SINK_TRANSITION_SINK ? SINK_HARD_RESET : SINK_SEND_SOFT_RESET);
+			return;
+		}
+
+		for (int i = 0; i < count; ++i) {
+			source_capabilities[i] = payload->data_objects[i];
+		}
+		source_capabilities_count = count;
+		answering_capabilities = 1;
+
+		// Request goes out before anything else (like logging) happens
+		sink_enter(SINK_EVALUATE_CAPABILITY);
+
+		for (int i = 0; i < count; ++i) {
+			log_printf("pdo=%08x", source_capabilities[i]);
+		}
+		log_printf(
+			"pdo=%d,mv=%u,mismatch=%d,rt=%uus",
+			selected.position - 1, selected.mv, selected.mismatch, sink_stats.response_time
+		);
+	} else if (state == SINK_GET_INFO) {
+		if (message_type == PD_DATA_BATTERY_STATUS && info_current == SINK_INFO_BATTERY_STATUS) {
+			sink_stats.info_answered++;
+			sink_enter(SINK_READY);
+			log_printf("battery_status: bsdo=%08x", payload->data_objects[0]);
+		} else {
+			sink_enter(SINK_SEND_SOFT_RESET);
+		}
+	} else if (state == SINK_READY && message_type != PD_DATA_VENDOR_DEFINED) {
+		sink_enter(SINK_SEND_NOT_SUPPORTED);
+	}
+}
+
+// What each SINK_INFO_* is answered with, as an extended message
+static uint8_t sink_info_answer(uint32_t info) {
+	switch (info) {
+	case SINK_INFO_SOURCE_CAP_EXTENDED:
+		return PD_EXTENDED_SOURCE_CAPABILITIES_EXTENDED;
+	case SINK_INFO_STATUS:
+		return PD_EXTENDED_STATUS;
+	case SINK_INFO_MANUFACTURER_INFO:
+		return PD_EXTENDED_MANUFACTURER_INFO;
+	case SINK_INFO_COUNTRY_CODES:
+		return PD_EXTENDED_COUNTRY_CODES;
+	default:
+		// Battery_Status is a data message
+		return 0;
+	}
+}
+
+static void sink_handle_ext_message(const struct pd_ext_message *message) {
+	sink_stats.ext_received++;
+
+	if (state == SINK_GET_INFO) {
+		if (message->message_type != sink_info_answer(info_current)) {
+			sink_enter(SINK_SEND_SOFT_RESET);
+			return;
+		}
+
+		sink_stats.info_answered++;
+		sink_enter(SINK_READY);
+		sink_log_info(message);
+	} else if (state == SINK_READY) {
+		log_printf("ext: mt=%x,size=%u", message->message_type, message->size);
+		sink_enter(SINK_SEND_NOT_SUPPORTED);
+	}
+}
+
+// A chunk came in, which stops ChunkSenderResponseTimer if it was asked for
+static void sink_chunk_received() {
+	if (!swtimer_running(&chunk_timer)) {
+		return;
+	}
+	swtimer_stop(&chunk_timer);
+
+	uint32_t response_time = swtimer_now() - chunk_request_time;
+	if (response_time > sink_stats.chunk_response_time_max) {
+		sink_stats.chunk_response_time_max = response_time;
+	}
+}
+
+static void sink_handle_extended(uint8_t message_type, const struct pd_message_extended *payload, int count) {
+	int chunk;
+
+	switch (pd_ext_receive(&ext_rx, message_type, payload, count, &chunk)) {
+	case PD_EXT_RX_MORE:
+		sink_chunk_received();
+		// The answer has started arriving, so it's ChunkSenderResponseTimer
+		// that's waited on now
+		if (state == SINK_GET_INFO) {
+			sink_timer_stop();
+		}
+		sink_send_chunk_request(message_type, chunk);
+		break;
+
+	case PD_EXT_RX_DONE:
+		sink_chunk_received();
+		sink_handle_ext_message(&ext_rx.message);
+		break;
+
+	case PD_EXT_RX_CHUNK_REQUEST:
+	case PD_EXT_RX_ERROR:
+		// Nothing this sends takes more than one chunk, so there's nothing to
+		// ask for more of
+		swtimer_stop(&chunk_timer);
+		if (state == SINK_GET_INFO) {
+			sink_enter(SINK_SEND_SOFT_RESET);
+		} else if (state == SINK_READY) {
+			sink_enter(SINK_SEND_NOT_SUPPORTED);
+		}
+		break;
+	}
+}
+
+static void sink_handle_message(struct pd_message *message) {
+	led_set_rgb(led);
+	led ^= 0b010;
+
+	uint8_t message_type = pd_header_message_type(message->header);
+	uint8_t message_id = pd_header_message_id(message->header);
+	uint8_t number_of_data_objects = pd_header_count(message->header);
+	int extended = pd_header_extended(message->header);
+
+	// The partner's GoodCRC for what we sent comes through the RX FIFO like any
+	// other message. It carries our MessageID rather than one of the partner's,
+	// so it mustn't get as far as the repeat check, and the hardware has
+	// already acted on it.
+	if (extended == 0 && number_of_data_objects == 0 && message_type == PD_CONTROL_GOODCRC) {
+		return;
+	}
+
+	if (extended == 0 && number_of_data_objects == 0 && message_type == PD_CONTROL_SOFT_RESET) {
+		sink_enter(SINK_SOFT_RESET);
+		protocol[SINK_SOP].rx_message_id = message_id;
+		return;
+	}
+
+	// A repeat of the last message means our GoodCRC was lost - the hardware
+	// has already answered it again, and it mustn't be acted on twice
+	if (protocol[SINK_SOP].rx_message_id == message_id) {
+		return;
+	}
+	protocol[SINK_SOP].rx_message_id = message_id;
+
+	if (extended == 0) {
+		if (number_of_data_objects == 0) {
+			sink_handle_control(message_type);
+		} else {
+			if (message_type == PD_DATA_SOURCE_CAPABILITIES) {
+				source_revision = pd_header_revision(message->header);
+			}
+			sink_handle_data(message_type, &message->payload.standard, number_of_data_objects);
+		}
+	} else {
+		sink_handle_extended(message_type, &message->payload.extended, number_of_data_objects);
+	}
+}
+
+static void sink_timeout(struct swtimer *timer) {
+	(void) timer;
+
+	switch (state) {
+	case SINK_WAIT_FOR_CAPABILITIES:
+	case SINK_SELECT_CAPABILITY:
+	case SINK_TRANSITION_SINK:
+	case SINK_SEND_SOFT_RESET:
+		sink_enter(SINK_HARD_RESET);
+		break;
+
+	case SINK_READY:
+		// SinkRequestTimer after a Wait, the PPS keep-alive, or a new policy.
+		// The capabilities are looked at again in case the policy now calls
+		// for a different PDO. Asking for information waits for those.
+		if (info_pending && !policy_pending) {
+			sink_enter(SINK_GET_INFO);
+		} else {
+			sink_enter(SINK_EVALUATE_CAPABILITY);
+		}
+		break;
+
+	case SINK_GET_INFO:
+		// SenderResponseTimer - the source isn't going to answer
+		sink_enter(SINK_READY);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void sink_chunk_timeout(struct swtimer *timer) {
+	(void) timer;
+
+	// The rest of the message isn't coming
+	sink_stats.chunk_timeouts++;
+	pd_ext_rx_reset(&ext_rx);
+	if (state == SINK_GET_INFO) {
+		sink_enter(SINK_READY);
+	}
+}
+
+void sink_start(sink_detach_callback callback) {
+	detach_callback = callback;
+	swtimer_init(&pe_timer, sink_timeout, NULL);
+	swtimer_init(&cc_debounce_timer, sink_cc_debounced, NULL);
+	swtimer_init(&hard_reset_vbus_timer, NULL, NULL);
+	swtimer_init(&chunk_timer, sink_chunk_timeout, NULL);
+
+	// Nothing from before attach is of interest
+	pd_take_events();
+
+	hard_reset_count = 0;
+	source_revision = 0;
+	info_pending = SINK_INFO_DEFAULT;
+	started = 1;
+	sink_enter(SINK_STARTUP);
+}
+
+void sink_set_policy(const struct pdo_policy *new_policy) {
+	policy = *new_policy;
+	policy_pending = 1;
+	policy_time = swtimer_now();
+
+	// Otherwise it's picked up once the negotiation under way is done
+	if (started && state == SINK_READY) {
+		sink_timer_start(0);
+	}
+}
+
+int sink_idle() {
+	if (!started) {
+		return 1;
+	}
+
+	// Between negotiations, with nothing waiting to go out or coming in
+	return (state == SINK_READY || state == SINK_DISABLED) && tx_current == NULL && !pd_ext_rx_active(&ext_rx);
+}
+
+void sink_get_info(uint32_t mask) {
+	info_pending |= mask;
+
+	if (started && state == SINK_READY) {
+		sink_timer_start(0);
+	}
+}
+
+void sink_poll() {
+	if (!started) {
+		return;
+	}
+
+	if (pd_interrupt_pending()) {
+		uint32_t now = swtimer_now();
+		int count = pd_drain_rxfifo(messages, RX_BATCH_SIZE);
+
+		sink_handle_events(pd_take_events());
+
+		// A detach stops the policy engine, and anything after it in the
+		// batch is stale
+		for (int m = 0; m < count && started; ++m) {
+			struct pd_message *message = &messages[m];
+			// Data message type 1, not a GoodCRC (control message type 1)
+			if (
+				pd_header_message_type(message->header) == PD_DATA_SOURCE_CAPABILITIES &&
+				pd_header_count(message->header) != 0 && !pd_header_extended(message->header)
+			) {
+				source_capabilities_time = now;
+			}
+
+			sink_handle_message(message);
+		}
+	}
+}
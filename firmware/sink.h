@@ -0,0 +1,93 @@
+#ifndef SINK_H
+#define SINK_H
+#include <stdint.h>
+#include "pdo.h"
+
+struct sink_stats {
+	uint32_t contracts;
+	uint32_t soft_resets;
+	uint32_t hard_resets_sent;
+	uint32_t hard_resets_received;
+	uint32_t tx_failures;
+
+	// us from Source_Capabilities being read to the Request being handed to
+	// the FUSB302, and how often that went over budget
+	uint32_t response_time;
+	uint32_t response_time_max;
+	uint32_t responses_late;
+
+	// swtimer_now() (us since boot) when the first Request was handed to the
+	// FUSB302, and when the first contract was reached
+	uint32_t first_request_time;
+	uint32_t first_contract_time;
+
+	// Detaches seen by VBUS going away, and by CC going open for longer than
+	// tPDDebounce
+	uint32_t detaches;
+	uint32_t detaches_vbus;
+	uint32_t detaches_cc;
+	// swtimer_now() at the last detach, and us from then to the next contract
+	uint32_t detach_time;
+	uint32_t recovery_time;
+	uint32_t recovery_time_max;
+
+	// Requests sent only to keep a PPS contract alive
+	uint32_t pps_keep_alives;
+	// New policies put into effect, and us from sink_set_policy() to the
+	// source's PS_RDY for the last one
+	uint32_t steps;
+	uint32_t step_time;
+	uint32_t step_time_max;
+
+	// Extended messages received whole, Chunk Requests sent for them, and
+	// chunks that didn't come within tChunkSenderResponse
+	uint32_t ext_received;
+	uint32_t chunk_requests;
+	uint32_t chunk_timeouts;
+	// Most us from a Chunk Request being handed to the FUSB302 to its chunk
+	// being read
+	uint32_t chunk_response_time_max;
+
+	// Asked of the source with sink_get_info(), and answered or refused
+	uint32_t info_requests;
+	uint32_t info_answered;
+	uint32_t info_refused;
+};
+
+extern struct sink_stats sink_stats;
+
+// Called once the source has gone away and the policy engine has stopped
+typedef void (*sink_detach_callback)();
+
+// Start the policy engine once the FUSB302 is attached. It runs until it
+// sees a detach.
+void sink_start(sink_detach_callback callback);
+
+// Returns 1 if the policy engine isn't in the middle of a negotiation or
+// other message exchange, so something slow (like programming flash) can run
+// without holding it up
+int sink_idle();
+
+// Change how the sink picks from the source's PDOs (the most power, unless
+// this is called). With a contract in place the new Request goes out from the
+// next swtimer_poll(), otherwise at the next negotiation. A PPS is stepped to
+// a new voltage by moving a voltage window.
+void sink_set_policy(const struct pdo_policy *policy);
+
+// What sink_get_info() can ask a PD 3.0 source for
+#define SINK_INFO_SOURCE_CAP_EXTENDED (1 << 0)
+#define SINK_INFO_STATUS (1 << 1)
+#define SINK_INFO_BATTERY_STATUS (1 << 2)
+#define SINK_INFO_MANUFACTURER_INFO (1 << 3)
+#define SINK_INFO_COUNTRY_CODES (1 << 4)
+// Asked for once the first contract is in place
+#define SINK_INFO_DEFAULT (SINK_INFO_SOURCE_CAP_EXTENDED | SINK_INFO_STATUS | SINK_INFO_MANUFACTURER_INFO)
+
+// Ask the source for each item in mask (SINK_INFO_*) in turn, between
+// negotiations, and log the answers. Ignored if the source is PD 2.0.
+void sink_get_info(uint32_t mask);
+
+// Run one iteration of the sink policy engine: service the FUSB302 if it has
+// anything to report. Timeouts are handled from swtimer_poll().
+void sink_poll();
+#endif
@@ -0,0 +1,97 @@
+// USB PD capture, built instead of the sink with `make SNIFFER=1`.
+//
+// This isn't an inline tap. The board is still the sink on the cable (the
+// FUSB302 keeps presenting Rd), it just never acknowledges anything: once
+// attached, the FUSB302 stops answering with GoodCRC, and listens for SOP' and
+// SOP'' as well as SOP. So plugged straight into a source, the trace shows the
+// source's side of a failed negotiation - Source_Capabilities, retried, then
+// hard resets, over and over, plus anything the source and an e-marked cable
+// say to each other over SOP'. That's enough to see what a source offers and
+// how it times its retries, but not a conversation between two other devices.
+// Every message it receives goes into the log as a raw LOG_RAW_PD record: the
+// SOP* token, header and data objects, stamped with the time the read started.
+// tools/pd_trace.py turns a dump of the log into pcapng for Wireshark.
+//
+// The trace shares the log's RAM ring and flash store (see log.c). Capturing
+// only copies the message into the ring, and it goes to flash from the main
+// loop once the line has been quiet for SNIFFER_QUIET_US (timed by quiet_timer,
+// so that the main loop wakes up for it). Keeping up with
+// back-to-back messages is down to reading the RX FIFO fast enough, which
+// is why sniffer builds run the I2C bus at 400 kHz (see pd_i2c.c).
+#include "sniffer.h"
+#include <stddef.h>
+#include "log.h"
+#include "pd.h"
+#include "swtimer.h"
+
+// Longer than any gap within a message exchange
+#define SNIFFER_QUIET_US (30000)
+
+struct sniffer_stats sniffer_stats;
+
+static int started = 0;
+static sniffer_detach_callback detach_callback;
+static struct swtimer quiet_timer;
+
+static void sniffer_capture(uint32_t time, const uint8_t *data, size_t size) {
+	swtimer_start(&quiet_timer, SNIFFER_QUIET_US, 0);
+
+	if (log_raw(LOG_RAW_PD, time, data, size)) {
+		sniffer_stats.captured++;
+	} else {
+		sniffer_stats.dropped++;
+	}
+}
+
+void sniffer_start(sniffer_detach_callback callback) {
+	detach_callback = callback;
+	pd_take_events();
+
+	// Never acknowledge anything, so the source never gets a contract going
+	// and keeps sending what it starts a negotiation with
+	pd_reg_update(PD_REG_SWITCHES1, PD_SWITCHES1_AUTO_CRC, 0);
+	pd_reg_update(PD_REG_CONTROL1, 0, PD_CONTROL1_ENSOP1 | PD_CONTROL1_ENSOP2);
+	// With no GoodCRC going out there's no I_GCRCSENT, but CRC_CHK changes with
+	// every message received
+	pd_reg_update(PD_REG_MASK1, PD_INTERRUPT_I_CRC_CHK, 0);
+	pd_reg_flush();
+
+	pd_set_rx_monitor(sniffer_capture);
+	swtimer_init(&quiet_timer, NULL, NULL);
+	swtimer_start(&quiet_timer, SNIFFER_QUIET_US, 0);
+	started = 1;
+}
+
+int sniffer_idle() {
+	return !started || !swtimer_running(&quiet_timer);
+}
+
+static void sniffer_stop() {
+	started = 0;
+	pd_set_rx_monitor(NULL);
+	swtimer_stop(&quiet_timer);
+
+	log_printf(
+		"sniffer: captured=%u,dropped=%u,rx_full=%u,flushed=%u",
+		sniffer_stats.captured, sniffer_stats.dropped, pd_rx_stats.full, pd_rx_stats.flushed
+	);
+
+	detach_callback();
+}
+
+void sniffer_poll() {
+	if (!started || !pd_interrupt_pending()) {
+		return;
+	}
+
+	// Messages come to sniffer_capture as they're read out. One at a time is
+	// enough, as pd_drain_rxfifo() keeps pd_interrupt_pending() set while
+	// there may be more.
+	struct pd_message message;
+	pd_drain_rxfifo(&message, 1);
+
+	uint16_t events = pd_take_events();
+	if ((events & PD_EVENT_VBUS_CHANGE) && (pd_status0() & PD_STATUS0_VBUSOK) == 0) {
+		sniffer_stop();
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef SNIFFER_H
+#define SNIFFER_H
+#include <stdint.h>
+
+struct sniffer_stats {
+	// Messages put in the trace, and messages that didn't fit in the log's RAM
+	// ring
+	uint32_t captured;
+	uint32_t dropped;
+};
+
+extern struct sniffer_stats sniffer_stats;
+
+// Called once VBUS has gone away and capture has stopped
+typedef void (*sniffer_detach_callback)();
+
+// Start capturing once the FUSB302 is attached. Runs until VBUS goes away.
+void sniffer_start(sniffer_detach_callback callback);
+
+// Returns 1 if nothing has been received for a while, so something slow (like
+// programming flash) is unlikely to hold up the next message
+int sniffer_idle();
+
+// Read out anything the FUSB302 has received
+void sniffer_poll();
+#endif
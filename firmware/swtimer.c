@@ -0,0 +1,163 @@
+// Software timers on top of the hardware timebase in swtimer_hw.c.
+//
+// Running timers are kept in a binary min-heap ordered by deadline, so the
+// next one to fire is always heap[0] and only that deadline needs to be
+// programmed into the hardware compare channel.
+#include "swtimer.h"
+#include <stddef.h>
+#include "swtimer_hw.h"
+
+static struct swtimer *heap[SWTIMER_MAX];
+static int heap_count = 0;
+
+static int swtimer_before(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) < 0;
+}
+
+static void swtimer_place(struct swtimer *timer, int index) {
+	heap[index] = timer;
+	timer->index = index;
+}
+
+static void swtimer_sift_up(int index) {
+	struct swtimer *timer = heap[index];
+
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		if (!swtimer_before(timer->deadline, heap[parent]->deadline)) {
+			break;
+		}
+
+		swtimer_place(heap[parent], index);
+		index = parent;
+	}
+
+	swtimer_place(timer, index);
+}
+
+static void swtimer_sift_down(int index) {
+	struct swtimer *timer = heap[index];
+
+	while (1) {
+		int child = index * 2 + 1;
+		if (child >= heap_count) {
+			break;
+		}
+		if (child + 1 < heap_count && swtimer_before(heap[child + 1]->deadline, heap[child]->deadline)) {
+			child++;
+		}
+		if (!swtimer_before(heap[child]->deadline, timer->deadline)) {
+			break;
+		}
+
+		swtimer_place(heap[child], index);
+		index = child;
+	}
+
+	swtimer_place(timer, index);
+}
+
+static void swtimer_remove(struct swtimer *timer) {
+	int index = timer->index;
+	timer->index = -1;
+
+	heap_count--;
+	if (index == heap_count) {
+		return;
+	}
+
+	// Fill the hole with the last timer and let it find its place
+	struct swtimer *moved = heap[heap_count];
+	swtimer_place(moved, index);
+	swtimer_sift_up(index);
+	swtimer_sift_down(moved->index);
+}
+
+static void swtimer_rearm() {
+	if (heap_count == 0) {
+		swtimer_hw_disarm();
+	} else {
+		swtimer_hw_arm(heap[0]->deadline);
+	}
+}
+
+void swtimer_setup() {
+	swtimer_hw_setup();
+}
+
+uint32_t swtimer_now() {
+	return swtimer_hw_now();
+}
+
+void swtimer_init(struct swtimer *timer, swtimer_callback callback, void *context) {
+	timer->deadline = 0;
+	timer->period = 0;
+	timer->callback = callback;
+	timer->context = context;
+	timer->index = -1;
+}
+
+int swtimer_start(struct swtimer *timer, uint32_t delay, uint32_t period) {
+	if (timer->index >= 0) {
+		swtimer_remove(timer);
+	} else if (heap_count == SWTIMER_MAX) {
+		return 0;
+	}
+
+	timer->deadline = swtimer_now() + delay;
+	timer->period = period;
+
+	heap_count++;
+	swtimer_place(timer, heap_count - 1);
+	swtimer_sift_up(heap_count - 1);
+
+	swtimer_rearm();
+	return 1;
+}
+
+void swtimer_stop(struct swtimer *timer) {
+	if (timer->index < 0) {
+		return;
+	}
+
+	swtimer_remove(timer);
+	swtimer_rearm();
+}
+
+int swtimer_running(struct swtimer *timer) {
+	return timer->index >= 0;
+}
+
+void swtimer_poll() {
+	uint32_t now = swtimer_now();
+
+	while (heap_count > 0 && !swtimer_before(now, heap[0]->deadline)) {
+		struct swtimer *timer = heap[0];
+		swtimer_remove(timer);
+
+		if (timer->period != 0) {
+			// Keep to the original schedule rather than drifting by however
+			// late this poll was
+			timer->deadline += timer->period;
+			heap_count++;
+			swtimer_place(timer, heap_count - 1);
+			swtimer_sift_up(heap_count - 1);
+		}
+
+		// May start or stop timers, including this one
+		if (timer->callback != NULL) {
+			timer->callback(timer);
+		}
+	}
+
+	swtimer_rearm();
+}
+
+int swtimer_next_deadline(uint32_t *deadline) {
+	if (heap_count == 0) {
+		return 0;
+	}
+
+	*deadline = heap[0]->deadline;
+	return 1;
+}
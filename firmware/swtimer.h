@@ -0,0 +1,49 @@
+#ifndef SWTIMER_H
+#define SWTIMER_H
+#include <stdint.h>
+
+// Most software timers that can be running at once
+#define SWTIMER_MAX (8)
+
+struct swtimer;
+typedef void (*swtimer_callback)(struct swtimer *timer);
+
+// A one-shot or periodic software timer. The struct is owned by the caller and
+// must stay valid while the timer is running.
+struct swtimer {
+	// swtimer_now() value the timer fires at
+	uint32_t deadline;
+	// Re-arms this many us after each expiry, or 0 for a one-shot timer
+	uint32_t period;
+
+	// Called from swtimer_poll(), so never from interrupt context. May be NULL
+	// for a timer that only marks out a window (see swtimer_running()).
+	swtimer_callback callback;
+	void *context;
+
+	// Slot in the heap, or -1 when the timer isn't running
+	int8_t index;
+};
+
+void swtimer_setup();
+
+// Free-running microsecond count. Wraps every ~71 minutes, so only compare
+// values by subtracting them.
+uint32_t swtimer_now();
+
+// Initialise a timer struct so it can be started
+void swtimer_init(struct swtimer *timer, swtimer_callback callback, void *context);
+
+// (Re)start a timer to fire after delay us, and then every period us if period
+// is non-zero. Returns 0 if too many timers are already running.
+int swtimer_start(struct swtimer *timer, uint32_t delay, uint32_t period);
+void swtimer_stop(struct swtimer *timer);
+int swtimer_running(struct swtimer *timer);
+
+// Run the callbacks of every timer that has expired. Call from the main loop.
+void swtimer_poll();
+
+// Returns 1 and the deadline of the earliest running timer, or 0 if there are
+// none running
+int swtimer_next_deadline(uint32_t *deadline);
+#endif
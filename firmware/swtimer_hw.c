@@ -0,0 +1,60 @@
+// 1 MHz timebase on TIMER1, the 32-bit general purpose timer.
+//
+// The counter free-runs over its whole range, so it doubles as swtimer_now().
+// Channel 0 is used in compare (timing) mode to interrupt at the next software
+// timer deadline - the interrupt itself does nothing but wake the CPU, the
+// callbacks run from swtimer_poll().
+//
+// See GD32F1x0 User Manual, section 15.2 "General level0 timer (TIMERx, x=1, 2)"
+#include "swtimer_hw.h"
+#include <gd32f1x0.h>
+#include <core_cm3.h>
+#include "gd32f1x0_libopt.h"
+
+// TIMER1 is clocked at 72 MHz (APB1 undivided)
+#define SWTIMER_HW_PRESCALER (72 - 1)
+
+void swtimer_hw_setup() {
+	rcu_periph_clock_enable(RCU_TIMER1);
+	timer_deinit(TIMER1);
+
+	timer_parameter_struct params = {
+		.prescaler = SWTIMER_HW_PRESCALER,
+		.alignedmode = TIMER_COUNTER_EDGE,
+		.counterdirection = TIMER_COUNTER_UP,
+		.period = 0xFFFFFFFF,
+		.clockdivision = TIMER_CKDIV_DIV1,
+		.repetitioncounter = 0,
+	};
+	timer_init(TIMER1, &params);
+
+	timer_interrupt_flag_clear(TIMER1, TIMER_INT_FLAG_CH0);
+	nvic_irq_enable(TIMER1_IRQn, 1, 0);
+
+	timer_enable(TIMER1);
+}
+
+uint32_t swtimer_hw_now() {
+	return TIMER_CNT(TIMER1);
+}
+
+void swtimer_hw_arm(uint32_t deadline) {
+	TIMER_CH0CV(TIMER1) = deadline;
+	timer_interrupt_flag_clear(TIMER1, TIMER_INT_FLAG_CH0);
+	timer_interrupt_enable(TIMER1, TIMER_INT_CH0);
+
+	// A compare only matches on the way past, so a deadline that's already gone
+	// would otherwise have to wait for the counter to wrap
+	if ((int32_t) (deadline - swtimer_hw_now()) <= 0) {
+		NVIC_SetPendingIRQ(TIMER1_IRQn);
+	}
+}
+
+void swtimer_hw_disarm() {
+	timer_interrupt_disable(TIMER1, TIMER_INT_CH0);
+}
+
+void timer1_isr() {
+	timer_interrupt_flag_clear(TIMER1, TIMER_INT_FLAG_CH0);
+	timer_interrupt_disable(TIMER1, TIMER_INT_CH0);
+}
@@ -0,0 +1,15 @@
+#ifndef SWTIMER_HW_H
+#define SWTIMER_HW_H
+#include <stdint.h>
+
+// Hardware timebase behind swtimer.c: a 1 MHz free-running counter with one
+// compare channel to wake the CPU at the next deadline
+
+void swtimer_hw_setup();
+uint32_t swtimer_hw_now();
+
+// Raise an interrupt once the counter reaches deadline (or straight away if it
+// already has)
+void swtimer_hw_arm(uint32_t deadline);
+void swtimer_hw_disarm();
+#endif
@@ -1,95 +1,298 @@
 import argparse
-import os
+import hashlib
+import threading
+import time
+import usb1
 from pdc002 import PDC002Bootloader
 
+APP_START = 0x0800_2c00
+APP_END = 0x0800_fc00
+ERASE_BLOCKS = range(0x2c, 0xf8 + 1)
+# ERASE takes an address in 256-byte units, and clears the page it's in
+ERASE_BLOCK_SIZE = 0x100
+PAGE_SIZE = 0x400
+PROG_SIZE = 0x28
+
 def parse_args():
     parser = argparse.ArgumentParser(description='PDC002 flashing tool')
     parser.add_argument('firmware', type=argparse.FileType('rb'))
+    parser.add_argument(
+        '--depth', type=int, default=PDC002Bootloader.DEPTH,
+        help='USB packets in flight at once (1 waits for each to go out before the next)'
+    )
+    parser.add_argument(
+        '--delta', action='store_true',
+        help='read the flash back first, and only erase and program the pages that differ'
+    )
+    parser.add_argument(
+        '--station', action='store_true',
+        help='flash every bootloader attached at once, rather than the first found'
+    )
 
     return parser.parse_args()
 
+def blank(data):
+    return all(b == 0xff for b in data)
+
+class Image:
+    '''
+    The firmware, split into PROG chunks once for every device to share. Blank
+    chunks are left out, since erased flash reads as 0xff already.
+    '''
+
+    def __init__(self, data):
+        self.data = data
+        self.sha256 = hashlib.sha256(data).digest()
+        self.page_chunks = {}
+        for page in range(0, len(data), PAGE_SIZE):
+            chunks = [
+                (offset, data[offset:min(offset + PROG_SIZE, page + PAGE_SIZE)])
+                for offset in range(page, page + PAGE_SIZE, PROG_SIZE)
+            ]
+            self.page_chunks[page] = [(offset, chunk) for offset, chunk in chunks if not blank(chunk)]
+
+class Reporter:
+    # Prints progress, tagged with the device in station mode, and remembers
+    # the last thing printed for the final report
+    def __init__(self, prefix=''):
+        self.prefix = prefix
+        self.last = None
+
+    def __call__(self, message):
+        self.last = message
+        print(f'{self.prefix}{message}', flush=True)
+
+    def rate(self, what, size, start):
+        elapsed = time.monotonic() - start
+        rate = size / elapsed if elapsed > 0 else 0
+        self(f'{what}: {size} bytes in {elapsed:.2f} s ({rate:.0f} bytes/s)')
+
+def pages_to_write(firmware, current):
+    # Offsets of the pages that differ, and of those which need erasing first
+    # because they aren't blank already
+    changed = []
+    erase = []
+    for offset in range(0, len(firmware), PAGE_SIZE):
+        page = firmware[offset:(offset + PAGE_SIZE)]
+        current_page = current[offset:(offset + PAGE_SIZE)]
+        if page == current_page:
+            continue
+
+        changed.append(offset)
+        if not blank(current_page):
+            erase.append(offset)
+
+    # The bootloader only starts an image with the signature fw_pad.py puts
+    # at the end, so if anything's changing, the signature page is cleared
+    # first and written last. An interrupted flash then leaves no signature,
+    # rather than a signature over a half-written image.
+    last = len(firmware) - PAGE_SIZE
+    if len(changed) != 0:
+        changed = [offset for offset in changed if offset != last] + [last]
+        if not blank(current[last:]):
+            erase = [last] + [offset for offset in erase if offset != last]
+
+    return changed, erase
+
+def write_pages(pdc, image, pages, erase, log):
+    # ERASE and PROG aren't answered, so they're sent back to back, and the
+    # FLASH_LOCK after them is answered once the device has got through them
+    # all (and pdc.sync() has cleared away any stray replies to them)
+    log('unlocking flash...')
+    if pdc.flash_unlock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: unlocking flash failed')
+        return False
+
+    log('erasing...')
+    start = time.monotonic()
+    for offset in erase:
+        pdc.erase(((APP_START + offset) >> 8) & 0xff)
+
+    log('locking flash...')
+    if pdc.flash_lock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: locking flash failed')
+        return False
+    log.rate('erase', len(erase) * PAGE_SIZE, start)
+
+    log('unlocking flash...')
+    if pdc.flash_unlock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: unlocking flash failed')
+        return False
+
+    log('programming...')
+    start = time.monotonic()
+    sent = 0
+    for page in pages:
+        for offset, chunk in image.page_chunks[page]:
+            pdc.prog(APP_START + offset, chunk)
+            sent += len(chunk)
+
+    log('locking flash...')
+    if pdc.flash_lock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: locking flash failed')
+        return False
+    log.rate('program', sent, start)
+
+    return True
+
+def write_all(pdc, image, log):
+    log('unlocking flash...')
+    if pdc.flash_unlock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: unlocking flash failed')
+        return False
+
+    log('erasing...')
+    start = time.monotonic()
+    for block in ERASE_BLOCKS:
+        pdc.erase(block)
+
+    log('locking flash...')
+    if pdc.flash_lock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: locking flash failed')
+        return False
+    log.rate('erase', len(ERASE_BLOCKS) * ERASE_BLOCK_SIZE, start)
+
+    log('unlocking flash...')
+    if pdc.flash_unlock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: unlocking flash failed')
+        return False
+
+    log('programming...')
+    start = time.monotonic()
+    for offset in range(0, len(image.data), PROG_SIZE):
+        pdc.prog(APP_START + offset, image.data[offset:(offset + PROG_SIZE)])
+
+    log('locking flash...')
+    if pdc.flash_lock() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: locking flash failed')
+        return False
+    log.rate('program', len(image.data), start)
+
+    return True
+
+def flash(pdc, image, delta, log):
+    firmware = image.data
+
+    log('checking status...')
+    if pdc.status_request() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: status check failed')
+        return False
+
+    start = time.monotonic()
+    if delta:
+        log('reading current firmware...')
+        current = pdc.read_big(APP_START, len(firmware))
+        log.rate('read', len(firmware), start)
+
+        pages, erase = pages_to_write(firmware, current)
+        log(f'{len(pages)} of {len(firmware) // PAGE_SIZE} pages to write, {len(erase)} to erase')
+        if len(pages) != 0 and not write_pages(pdc, image, pages, erase, log):
+            return False
+
+        # The rest has just been read back and matched
+        ranges = [(offset, PAGE_SIZE) for offset in pages]
+        expected_sha256 = hashlib.sha256(
+            b''.join(firmware[offset:(offset + length)] for offset, length in ranges)
+        ).digest()
+    else:
+        if not write_all(pdc, image, log):
+            return False
+
+        # The whole image streams back as fast as the device can send it
+        ranges = [(0, len(firmware))]
+        expected_sha256 = image.sha256
+
+    log('verifying...')
+    verify_start = time.monotonic()
+    sha256 = hashlib.sha256()
+    reads = [(offset, pdc.read_big(APP_START + offset, length, [sha256])) for offset, length in ranges]
+    if sha256.digest() != expected_sha256:
+        # Only worth comparing byte by byte to say where it went wrong
+        for offset, d in reads:
+            expected = firmware[offset:(offset + len(d))]
+            if d != expected:
+                offset += next(i for i in range(len(d)) if d[i] != expected[i])
+                log(f'abort: verification failed at address 0x{APP_START + offset:08x}')
+                return False
+    log.rate('verify', sum(length for _, length in ranges), verify_start)
+    if pdc.stray_statuses != 0:
+        log(f'{pdc.stray_statuses} stray status replies ignored')
+
+    log('resetting...')
+    if pdc.reset() != PDC002Bootloader.STATUS_SUCCESS:
+        log('abort: reset failed')
+        return False
+
+    elapsed = time.monotonic() - start
+    log(f'programming complete in {elapsed:.2f} s!')
+    return True
+
+def station(image, args):
+    paths = PDC002Bootloader.list_paths()
+    if len(paths) == 0:
+        print('abort: no bootloaders found')
+        return
+
+    print(f'flashing {len(paths)} devices: {" ".join(paths)}')
+    width = max(len(path) for path in paths)
+    results = {}
+
+    # One thread per device, each with its own libusb context. They spend
+    # their time waiting on USB, so the GIL isn't what limits them.
+    def worker(path):
+        log = Reporter(f'[{path:{width}s}] ')
+        start = time.monotonic()
+        ok = False
+        try:
+            with PDC002Bootloader.open(depth=args.depth, path=path) as pdc:
+                ok = flash(pdc, image, args.delta, log)
+        except (RuntimeError, OSError, usb1.USBError) as e:
+            # Opening a device another program has, or one being unplugged
+            # part way through
+            log(f'abort: {e}')
+        finally:
+            # Even if something else goes wrong, so the other devices still
+            # get reported
+            results[path] = (ok, time.monotonic() - start, log.last)
+
+    start = time.monotonic()
+    workers = [threading.Thread(target=worker, args=(path,)) for path in paths]
+    for thread in workers:
+        thread.start()
+    for thread in workers:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    print()
+    for path in paths:
+        ok, device_elapsed, last = results[path]
+        result = 'ok' if ok else last
+        print(f'{path:{width}s} {device_elapsed:7.2f} s  {result}')
+
+    flashed = sum(1 for ok, _, _ in results.values() if ok)
+    print(
+        f'{flashed} of {len(paths)} devices flashed in {elapsed:.2f} s '
+        f'({flashed / elapsed * 60:.1f} devices/minute)'
+    )
+
 def main():
     args = parse_args()
 
-    with PDC002Bootloader.open() as pdc:
-        print('checking status...')
-        if pdc.status_request() != PDC002Bootloader.STATUS_SUCCESS:
-            print('abort: status check failed')
-            return
-
-        print('unlocking flash...')
-        if pdc.flash_unlock() != PDC002Bootloader.STATUS_SUCCESS:
-            print('abort: unlocking flash failed')
-            return
-
-        print('erasing...')
-        for block in range(0x2c, 0xf8 + 1):
-            pdc.erase(block)
-
-        print('locking flash...')
-        if pdc.flash_lock() != PDC002Bootloader.STATUS_SUCCESS:
-            print('abort: locking flash failed')
-            return
-
-        print('unlocking flash...')
-        if pdc.flash_unlock() != PDC002Bootloader.STATUS_SUCCESS:
-            print('abort: unlocking flash failed')
-            return
-
-        print('programming...')
-        address = 0x0800_2c00
-        while True:
-            length = 0x400
-            block_data = args.firmware.read(length)
-
-            if len(block_data) == 0:
-                break
-
-            if len(block_data) != length:
-                print('abort: read block of length != 0x400 from firmware file')
-                return
-
-            i = 0
-            while length > 0:
-                length_to_prog = min(length, 0x28)
-
-                assert address >= 0x0800_2c00
-                assert address + length_to_prog <= 0x0800_fc00
-                pdc.prog(address, block_data[i:(i + length_to_prog)])
-
-                address += length_to_prog
-                i += length_to_prog
-                length -= length_to_prog
-
-        print('verifying...')
-        args.firmware.seek(0, os.SEEK_SET)
-
-        address = 0x0800_2c00
-        while True:
-            length = 0x40
-            block_data = args.firmware.read(length)
-
-            if len(block_data) == 0:
-                break
-
-            if len(block_data) != length:
-                print('abort: read block of length != 0x40 from firmware file')
-                return
-
-            d = pdc.read_big(address, length)
-            if d != block_data:
-                print(f'abort: verification failed for block of length 0x{length:x} at address 0x{address:08x}')
-                print(d)
-                print(block_data)
-
-            address += length
-
-        print('resetting...')
-        if pdc.reset() != PDC002Bootloader.STATUS_SUCCESS:
-            print('abort: reset failed')
-            return
-
-        print('programming complete!')
+    firmware = args.firmware.read()
+    if len(firmware) % PAGE_SIZE != 0:
+        print('abort: firmware file length is not a multiple of 0x400')
+        return
+    if APP_START + len(firmware) > APP_END:
+        print('abort: firmware file does not fit in flash')
+        return
+
+    image = Image(firmware)
+    if args.station:
+        station(image, args)
+        return
+
+    with PDC002Bootloader.open(depth=args.depth) as pdc:
+        flash(pdc, image, args.delta, Reporter())
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,229 @@
+import os
+import re
+import struct
+import sys
+from collections import namedtuple
+
+DEFAULT_ELF = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'firmware', 'firmware.elf')
+
+PAGE_SIZE = 1024
+PAGE_MAGIC = 0x4c47
+PAGE_HEADER_SIZE = 6
+
+RECORD_HEADER_SIZE = 4
+RECORD_SIZE_MASK = 0x3f
+RECORD_ABSOLUTE = 0x40
+RECORD_BOOT = 0x80
+
+FMT_OFFSET_MASK = 0x1fff
+ARGS_POS = 13
+
+# Raw records (log_raw() in firmware/log.h)
+FMT_RAW = 0x1fff
+RAW_PD = 0
+RAW_PROF = 1
+
+# raw is a Raw for raw records, and None for messages
+Record = namedtuple('Record', ['seq', 'boot', 'time_ms', 'text', 'raw'])
+Raw = namedtuple('Raw', ['kind', 'time_us', 'data'])
+
+# printf conversion, with the flags/width/precision kept and any length
+# modifier dropped (every argument is a 32-bit word)
+CONVERSION = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?([diouxXc%])')
+
+def load_formats(elf_path=DEFAULT_ELF):
+    # Only needed here, so that decoding alone works without pyelftools
+    from elftools.elf.elffile import ELFFile
+
+    with open(elf_path, 'rb') as f:
+        elf = ELFFile(f)
+        section = elf.get_section_by_name('.log_fmt')
+        if section is None:
+            raise ValueError(f'{elf_path} has no .log_fmt section')
+        return section.data()
+
+def load_store(elf_path=DEFAULT_ELF):
+    # Returns the store's (start, end) addresses, which move with the image size
+    from elftools.elf.elffile import ELFFile
+
+    with open(elf_path, 'rb') as f:
+        elf = ELFFile(f)
+        symtab = elf.get_section_by_name('.symtab')
+        if symtab is None:
+            raise ValueError(f'{elf_path} has no symbol table')
+
+        bounds = []
+        for name in ['_log_store_start', '_log_store_end']:
+            symbols = symtab.get_symbol_by_name(name)
+            if not symbols:
+                raise ValueError(f'{elf_path} has no {name}')
+            bounds.append(symbols[0]['st_value'])
+        return tuple(bounds)
+
+def format_string(formats, offset):
+    end = formats.index(b'\x00', offset)
+    return formats[offset:end].decode('ascii')
+
+def format_message(fmt, args):
+    args = list(args)
+
+    def convert(match):
+        spec, conversion = match.groups()
+        if conversion == '%':
+            return '%'
+
+        value = args.pop(0) if len(args) != 0 else 0
+        if conversion in 'di':
+            value = struct.unpack('<i', struct.pack('<I', value))[0]
+            conversion = 'd'
+        elif conversion == 'u':
+            conversion = 'd'
+
+        return f'%{spec}{conversion}' % value
+
+    return CONVERSION.sub(convert, fmt)
+
+def read_varint(data, i):
+    value = 0
+    shift = 0
+    while True:
+        b = data[i]
+        i += 1
+        value |= (b & 0x7f) << shift
+        shift += 7
+        if b & 0x80 == 0:
+            return value, i
+
+def crc8(data, crc=0xff):
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xff if crc & 0x80 else (crc << 1) & 0xff
+    return crc
+
+def page_sequence(header):
+    # Returns None if the page hasn't been started
+    seq, magic = struct.unpack('<IH', header[:PAGE_HEADER_SIZE])
+    if magic != PAGE_MAGIC:
+        return None
+    return seq
+
+def decode_body(body, formats):
+    header = body[0] | (body[1] << 8)
+    offset = header & FMT_OFFSET_MASK
+    count = header >> ARGS_POS
+
+    time_ms, i = read_varint(body, 2)
+
+    if offset == FMT_RAW:
+        us, i = read_varint(body, i)
+        size = body[i]
+        data = bytes(body[i + 1:i + 1 + size])
+        if len(data) != size:
+            raise IndexError('raw record cut short')
+        # Only the us past the ms until the page's times are added up
+        return time_ms, f'<raw {count}: {data.hex(" ")}>', Raw(count, us, data)
+
+    args = []
+    for _ in range(count):
+        arg, i = read_varint(body, i)
+        args.append(arg)
+
+    try:
+        text = format_message(format_string(formats, offset), args)
+    except ValueError:
+        text = f'<unknown format {offset:#x}: {args}>'
+    return time_ms, text, None
+
+def decode_page(page, formats):
+    # See firmware/log.c for the page and record layout
+    records = []
+    time_ms = 0
+
+    i = PAGE_HEADER_SIZE
+    while i + RECORD_HEADER_SIZE <= len(page):
+        flags = page[i]
+        if flags == 0xff:
+            break
+
+        size = RECORD_HEADER_SIZE + (flags & RECORD_SIZE_MASK)
+        record = page[i:i + size]
+        if len(record) != size or crc8(record[2:], crc8(record[:1])) != record[1]:
+            # Torn by a reset - the firmware carries on from the next page
+            break
+
+        seq = record[2] | (record[3] << 8)
+        try:
+            time, text, raw = decode_body(record[RECORD_HEADER_SIZE:], formats)
+        except IndexError:
+            break
+
+        if flags & RECORD_ABSOLUTE:
+            time_ms = time
+        else:
+            time_ms += time
+        if raw is not None:
+            raw = raw._replace(time_us=time_ms * 1000 + raw.time_us)
+        records.append(Record(seq, bool(flags & RECORD_BOOT), time_ms, text, raw))
+
+        i += size
+
+    return records
+
+def decode_store(data, formats):
+    # data is a dump of the whole store, from its first page
+    pages = []
+    for start in range(0, len(data) - PAGE_SIZE + 1, PAGE_SIZE):
+        page = data[start:start + PAGE_SIZE]
+        seq = page_sequence(page)
+        if seq is not None:
+            pages.append((seq, page))
+
+    records = []
+    for _, page in sorted(pages):
+        records.extend(decode_page(page, formats))
+    return records
+
+def read_newest(read, store, count, formats):
+    # Only reads as many pages as it takes to find count records, newest last.
+    # read(address, length) reads from the device.
+    start, end = store
+    pages = []
+    for page in range(start, end, PAGE_SIZE):
+        seq = page_sequence(read(page, PAGE_HEADER_SIZE))
+        if seq is not None:
+            pages.append((seq, page))
+
+    records = []
+    for _, page in sorted(pages, reverse=True):
+        records = decode_page(read(page, PAGE_SIZE), formats) + records
+        if len(records) >= count:
+            break
+    return records[-count:]
+
+def print_records(records):
+    prev_seq = None
+    for record in records:
+        if prev_seq is not None:
+            lost = (record.seq - prev_seq - 1) & 0xffff
+            if lost != 0:
+                print(f'--- {lost} records lost ---')
+        prev_seq = record.seq
+
+        if record.boot:
+            print('--- reset ---')
+        print(f'{record.seq:5d} [{record.time_ms:8d} ms] {record.text}')
+
+def main():
+    if len(sys.argv) not in [2, 3]:
+        print(f'usage: {sys.argv[0]} store.bin [firmware.elf]')
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+
+    elf_path = sys.argv[2] if len(sys.argv) == 3 else DEFAULT_ELF
+    print_records(decode_store(data, load_formats(elf_path)))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,77 @@
+import struct
+import sys
+
+import log_decode
+
+# pcapng, as described in draft-ietf-opsawg-pcapng
+BLOCK_SHB = 0x0a0d0d0a
+BLOCK_IDB = 0x00000001
+BLOCK_EPB = 0x00000006
+BYTE_ORDER_MAGIC = 0x1a2b3c4d
+
+OPT_END = 0
+IF_NAME = 2
+IF_TSRESOL = 9
+
+# No link type is registered for USB PD, so captures use the first one set
+# aside for private use. pd_trace_dissector.lua decodes it in Wireshark.
+LINKTYPE_USER0 = 147
+SNAPLEN = 64
+
+def option(code, value):
+    padding = bytes(-len(value) % 4)
+    return struct.pack('<HH', code, len(value)) + value + padding
+
+def block(block_type, body):
+    length = 12 + len(body)
+    return struct.pack('<II', block_type, length) + body + struct.pack('<I', length)
+
+def section_header():
+    return block(BLOCK_SHB, struct.pack('<IHHq', BYTE_ORDER_MAGIC, 1, 0, -1))
+
+def interface(name):
+    options = option(IF_NAME, name.encode('utf-8'))
+    # Timestamps in us
+    options += option(IF_TSRESOL, bytes([6]))
+    options += option(OPT_END, b'')
+    return block(BLOCK_IDB, struct.pack('<HHI', LINKTYPE_USER0, 0, SNAPLEN) + options)
+
+def packet(interface_id, time_us, data):
+    body = struct.pack('<IIIII', interface_id, time_us >> 32, time_us & 0xffffffff, len(data), len(data))
+    body += data + bytes(-len(data) % 4)
+    return block(BLOCK_EPB, body)
+
+def write_pcapng(f, records):
+    # Times are since reset, so each boot gets an interface of its own
+    f.write(section_header())
+
+    interfaces = 0
+    for record in records:
+        is_pd = record.raw is not None and record.raw.kind == log_decode.RAW_PD
+        if record.boot or (is_pd and interfaces == 0):
+            name = f'boot at record {record.seq}' if record.boot else 'earlier boot'
+            f.write(interface(name))
+            interfaces += 1
+
+        if is_pd:
+            f.write(packet(interfaces - 1, record.raw.time_us, record.raw.data))
+
+def main():
+    if len(sys.argv) != 3:
+        print(f'usage: {sys.argv[0]} store.bin trace.pcapng')
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+
+    # Only the raw records are wanted, so the format strings aren't needed
+    records = log_decode.decode_store(data, b'')
+
+    with open(sys.argv[2], 'wb') as f:
+        write_pcapng(f, records)
+
+    count = sum(1 for record in records if record.raw is not None and record.raw.kind == log_decode.RAW_PD)
+    print(f'{count} messages written to {sys.argv[2]}')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,151 @@
+-- Dissector for USB PD messages captured by the sniffer firmware, as written
+-- to pcapng by pd_trace.py: the FUSB302's SOP* token, then the message header
+-- and data objects, little-endian.
+
+local pd_proto = Proto("pdc_pd", "USB Power Delivery (PDC002 sniffer)")
+
+local pd_sop = ProtoField.uint8("pdc_pd.sop", "SOP*", base.HEX)
+local pd_header = ProtoField.uint16("pdc_pd.header", "Header", base.HEX)
+local pd_extended = ProtoField.uint16("pdc_pd.extended", "Extended", base.DEC, nil, 0x8000)
+local pd_data_object_count = ProtoField.uint16("pdc_pd.data_object_count", "Number of data objects", base.DEC, nil, 0x7000)
+local pd_message_id = ProtoField.uint16("pdc_pd.message_id", "Message ID", base.DEC, nil, 0x0e00)
+local pd_power_role = ProtoField.uint16("pdc_pd.power_role", "Port power role/cable plug", base.DEC, nil, 0x0100)
+local pd_spec_revision = ProtoField.uint16("pdc_pd.spec_revision", "Specification revision", base.DEC, nil, 0x00c0)
+local pd_data_role = ProtoField.uint16("pdc_pd.data_role", "Port data role", base.DEC, nil, 0x0020)
+local pd_message_type = ProtoField.uint16("pdc_pd.message_type", "Message type", base.HEX, nil, 0x001f)
+local pd_data_object = ProtoField.uint32("pdc_pd.data_object", "Data object", base.HEX)
+
+pd_proto.fields = {
+	pd_sop,
+	pd_header,
+	pd_extended,
+	pd_data_object_count,
+	pd_message_id,
+	pd_power_role,
+	pd_spec_revision,
+	pd_data_role,
+	pd_message_type,
+	pd_data_object
+}
+
+local pd_length_pe = ProtoExpert.new("pdc_pd.length_err", "Length doesn't match the header", expert.group.MALFORMED, expert.severity.ERROR)
+
+pd_proto.experts = {
+	pd_length_pe
+}
+
+local sop_names = {
+	[7] = "SOP",
+	[6] = "SOP'",
+	[5] = "SOP''",
+	[4] = "SOP'_Debug",
+	[3] = "SOP''_Debug"
+}
+
+-- USB PD R3.0 tables 6-5, 6-6 and 6-48
+local control_names = {
+	[0x01] = "GoodCRC",
+	[0x02] = "GotoMin",
+	[0x03] = "Accept",
+	[0x04] = "Reject",
+	[0x05] = "Ping",
+	[0x06] = "PS_RDY",
+	[0x07] = "Get_Source_Cap",
+	[0x08] = "Get_Sink_Cap",
+	[0x09] = "DR_Swap",
+	[0x0a] = "PR_Swap",
+	[0x0b] = "VCONN_Swap",
+	[0x0c] = "Wait",
+	[0x0d] = "Soft_Reset",
+	[0x0e] = "Data_Reset",
+	[0x0f] = "Data_Reset_Complete",
+	[0x10] = "Not_Supported",
+	[0x11] = "Get_Source_Cap_Extended",
+	[0x12] = "Get_Status",
+	[0x13] = "FR_Swap",
+	[0x14] = "Get_PPS_Status",
+	[0x15] = "Get_Country_Codes",
+	[0x16] = "Get_Sink_Cap_Extended"
+}
+
+local data_names = {
+	[0x01] = "Source_Capabilities",
+	[0x02] = "Request",
+	[0x03] = "BIST",
+	[0x04] = "Sink_Capabilities",
+	[0x05] = "Battery_Status",
+	[0x06] = "Alert",
+	[0x07] = "Get_Country_Info",
+	[0x08] = "Enter_USB",
+	[0x0f] = "Vendor_Defined"
+}
+
+local extended_names = {
+	[0x01] = "Source_Capabilities_Extended",
+	[0x02] = "Status",
+	[0x03] = "Get_Battery_Cap",
+	[0x04] = "Get_Battery_Status",
+	[0x05] = "Battery_Capabilities",
+	[0x06] = "Get_Manufacturer_Info",
+	[0x07] = "Manufacturer_Info",
+	[0x08] = "Security_Request",
+	[0x09] = "Security_Response",
+	[0x0a] = "Firmware_Update_Request",
+	[0x0b] = "Firmware_Update_Response",
+	[0x0c] = "PPS_Status",
+	[0x0d] = "Country_Info",
+	[0x0e] = "Country_Codes",
+	[0x0f] = "Sink_Capabilities_Extended"
+}
+
+function get_message_name(header)
+	local message_type = bit.band(header, 0x1f)
+	local data_object_count = bit.band(bit.rshift(header, 12), 0x7)
+
+	local name
+	if bit.band(header, 0x8000) ~= 0 then
+		name = extended_names[message_type]
+	elseif data_object_count == 0 then
+		name = control_names[message_type]
+	else
+		name = data_names[message_type]
+	end
+
+	return name or string.format("Reserved (0x%02x)", message_type)
+end
+
+function pd_proto.dissector(buffer, pinfo, tree)
+	pinfo.cols.protocol = "USB PD"
+
+	local subtree = tree:add(pd_proto, buffer(), "USB Power Delivery")
+
+	local sop = bit.rshift(buffer(0, 1):uint(), 5)
+	local sop_name = sop_names[sop] or "Unknown"
+	subtree:add(pd_sop, buffer(0, 1)):append_text(" (" .. sop_name .. ")")
+
+	local header = buffer(1, 2):le_uint()
+	local header_st = subtree:add_le(pd_header, buffer(1, 2))
+	header_st:add_le(pd_extended, buffer(1, 2))
+	header_st:add_le(pd_data_object_count, buffer(1, 2))
+	header_st:add_le(pd_message_id, buffer(1, 2))
+	header_st:add_le(pd_power_role, buffer(1, 2))
+	header_st:add_le(pd_spec_revision, buffer(1, 2))
+	header_st:add_le(pd_data_role, buffer(1, 2))
+	header_st:add_le(pd_message_type, buffer(1, 2))
+
+	local name = get_message_name(header)
+	local message_id = bit.band(bit.rshift(header, 9), 0x7)
+	pinfo.cols.info = string.format("%s %s (ID %d)", sop_name, name, message_id)
+
+	local data_object_count = bit.band(bit.rshift(header, 12), 0x7)
+	if buffer:len() ~= 3 + data_object_count * 4 then
+		header_st:add_proto_expert_info(pd_length_pe)
+		return
+	end
+
+	for i = 0,data_object_count-1 do
+		subtree:add_le(pd_data_object, buffer(3 + i * 4, 4))
+	end
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, pd_proto)
@@ -1,8 +1,21 @@
+from collections import deque
 from contextlib import contextmanager
 from dataclasses import dataclass
-import math
 import struct
+import time
 import usb1
+import zlib
+
+class Crc32:
+    # zlib's CRC-32, fed like a hashlib hash
+    def __init__(self):
+        self.value = 0
+
+    def update(self, data):
+        self.value = zlib.crc32(data, self.value)
+
+    def hexdigest(self):
+        return f'{self.value:08x}'
 
 @dataclass
 class Packet:
@@ -50,11 +63,102 @@ class Packet:
             payload=payload
         )
 
+class TransferEngine:
+    '''
+    Moves packets with libusb's asynchronous transfers, so the device never
+    waits on a host round trip between them. Up to `depth` OUT packets are in
+    flight at once, and as many IN transfers are kept submitted, so replies
+    stream into a queue as fast as the device sends them. libusb keeps the
+    transfers on an endpoint in order, and the device answers in order, so
+    replies can be matched up by position.
+    '''
+
+    OUT_ENDPOINT = 0x01
+    IN_ENDPOINT = 0x81
+    PACKET_SIZE = 64
+
+    def __init__(self, context, handle, depth=8, timeout_ms=1000):
+        self.context = context
+        self.timeout_ms = timeout_ms
+        self.replies = deque()
+        self.error = None
+
+        self.out_transfers = [handle.getTransfer() for _ in range(depth)]
+        self.free_out = list(self.out_transfers)
+
+        self.in_transfers = [handle.getTransfer() for _ in range(depth)]
+        for transfer in self.in_transfers:
+            transfer.setInterrupt(self.IN_ENDPOINT, self.PACKET_SIZE, callback=self._in_done)
+            transfer.submit()
+
+    def _out_done(self, transfer):
+        if transfer.getStatus() != usb1.TRANSFER_COMPLETED and self.error is None:
+            self.error = RuntimeError(f'OUT transfer failed (status {transfer.getStatus()})')
+        self.free_out.append(transfer)
+
+    def _in_done(self, transfer):
+        status = transfer.getStatus()
+        if status == usb1.TRANSFER_CANCELLED:
+            return
+
+        if status == usb1.TRANSFER_COMPLETED:
+            self.replies.append(Packet.from_bytes(bytes(transfer.getBuffer()[:transfer.getActualLength()])))
+        elif self.error is None:
+            self.error = RuntimeError(f'IN transfer failed (status {status})')
+
+        transfer.submit()
+
+    def _wait(self, done, what):
+        deadline = time.monotonic() + self.timeout_ms / 1000
+        while not done():
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise RuntimeError(f'timed out waiting for {what}')
+            self.context.handleEventsTimeout(tv=remaining)
+
+        if self.error is not None:
+            error, self.error = self.error, None
+            raise error
+
+    def write(self, packet):
+        # Returns as soon as the packet is queued, once there's room for it
+        self._wait(lambda: len(self.free_out) != 0 or self.error is not None, 'room to send')
+
+        transfer = self.free_out.pop()
+        transfer.setInterrupt(
+            self.OUT_ENDPOINT, packet.to_bytes(),
+            callback=self._out_done, timeout=self.timeout_ms
+        )
+        transfer.submit()
+
+    def flush(self):
+        # Wait until the device has taken every packet written
+        self._wait(lambda: len(self.free_out) == len(self.out_transfers) or self.error is not None, 'packets to send')
+
+    def read(self):
+        self._wait(lambda: len(self.replies) != 0 or self.error is not None, 'a reply')
+        return self.replies.popleft()
+
+    def close(self):
+        for transfer in self.in_transfers:
+            if transfer.isSubmitted():
+                try:
+                    transfer.cancel()
+                except usb1.USBErrorNotFound:
+                    pass
+
+        in_flight = self.in_transfers + self.out_transfers
+        deadline = time.monotonic() + self.timeout_ms / 1000
+        while any(t.isSubmitted() for t in in_flight) and time.monotonic() < deadline:
+            self.context.handleEventsTimeout(tv=0.01)
+
 class PDC002Bootloader:
     VID = 0x0716
     PID = 0x5036
 
     TIMEOUT = 1000
+    # OUT packets in flight at once
+    DEPTH = 8
 
     STATUS_ERROR = 0x01
     STATUS_SUCCESS = 0x02
@@ -67,16 +171,59 @@ class PDC002Bootloader:
     READ_BIG = 0x0B
     RESET = 0x17
 
-    def __init__(self, handle):
-        self.handle = handle
+    # Bytes of data in each READ_BIG reply
+    READ_BIG_REPLY_SIZE = 0x28
+    # The largest READ_BIG that's a whole number of replies, so when a long
+    # read is split up, every reply but the very last is full
+    READ_BIG_MAX = 65535 // READ_BIG_REPLY_SIZE * READ_BIG_REPLY_SIZE
+    # Read by sync(): the start of the bootloader, which is always there
+    SYNC_ADDRESS = 0x0800_0000
+
+    def __init__(self, engine):
+        self.engine = engine
+        # Set by ERASE and PROG, in case one's answered after all
+        self.unanswered = False
+        # STATUS_SUCCESS replies dropped by sync()
+        self.stray_statuses = 0
+
+    def device_path(device):
+        # Bus and port numbers, as Linux names devices in sysfs (1-2.4)
+        ports = '.'.join(str(port) for port in device.getPortNumberList())
+        return f'{device.getBusNumber()}-{ports}'
+
+    def list_paths(vid=VID, pid=PID):
+        # Paths of every bootloader attached, which stay the same as long as
+        # each is plugged into the same port
+        with usb1.USBContext() as context:
+            return sorted(
+                PDC002Bootloader.device_path(device)
+                for device in context.getDeviceIterator(skip_on_error=True)
+                if device.getVendorID() == vid and device.getProductID() == pid
+            )
+
+    def _open_path(context, vid, pid, path):
+        for device in context.getDeviceIterator(skip_on_error=True):
+            if (
+                device.getVendorID() == vid and device.getProductID() == pid and
+                PDC002Bootloader.device_path(device) == path
+            ):
+                return device.open()
+
+        return None
 
     @contextmanager
-    def open(vid=VID, pid=PID):
+    def open(vid=VID, pid=PID, depth=DEPTH, path=None):
+        # The first bootloader found, unless path picks one. Each open device
+        # has its own libusb context, so each can be driven from its own
+        # thread.
         with usb1.USBContext() as context:
-            handle = context.openByVendorIDAndProductID(
-                vid, pid,
-                skip_on_error=True
-            )
+            if path is None:
+                handle = context.openByVendorIDAndProductID(
+                    vid, pid,
+                    skip_on_error=True
+                )
+            else:
+                handle = PDC002Bootloader._open_path(context, vid, pid, path)
 
             if handle is None:
                 raise RuntimeError('could not open PDC002 device')
@@ -87,15 +234,20 @@ class PDC002Bootloader:
                 pass
 
             with handle.claimInterface(0):
-                yield PDC002Bootloader(handle)
+                engine = TransferEngine(context, handle, depth, PDC002Bootloader.TIMEOUT)
+                try:
+                    yield PDC002Bootloader(engine)
+                finally:
+                    engine.close()
 
     def write_packet(self, p):
-        self.handle.interruptWrite(0x01, p.to_bytes())
+        self.engine.write(p)
 
     def read_packet(self):
-        return Packet.from_bytes(
-            self.handle.interruptRead(0x81, 64, timeout=self.TIMEOUT)
-        )
+        return self.engine.read()
+
+    def flush(self):
+        self.engine.flush()
 
     def read_status(self):
         p = self.read_packet()
@@ -104,28 +256,51 @@ class PDC002Bootloader:
         else:
             raise RuntimeError('unexpected status response')
 
-    def status_request(self):
+    def sync(self):
+        # ERASE and PROG aren't supposed to be answered, but a STATUS_SUCCESS
+        # for one sometimes turns up anyway, and would be taken as the reply
+        # to whatever's sent next. The device answers in order, so once the
+        # reply to a READ_SMALL (which nothing else is answered with) comes
+        # back, anything before it has been too, and can be dropped.
         self.write_packet(Packet(
-            payload_type=self.STATUS_REQUEST,
-            payload=bytes()
+            payload_type=self.READ_SMALL,
+            payload=struct.pack('<IB', self.SYNC_ADDRESS, 1)
         ))
 
-        return self.read_status()
+        while True:
+            p = self.read_packet()
+            if p.payload_type == self.READ_SMALL:
+                break
+            elif p.payload_type == self.STATUS_SUCCESS:
+                self.stray_statuses += 1
+            elif p.payload_type == self.STATUS_ERROR:
+                raise RuntimeError('device reported an error for an earlier ERASE or PROG')
+            else:
+                raise RuntimeError(f'unexpected reply {p.payload_type:02x} while syncing')
+
+        self.unanswered = False
+
+    def command(self, payload_type, payload=bytes()):
+        # Send a command that's answered, once anything earlier that might
+        # still be is out of the way
+        if self.unanswered:
+            self.sync()
 
-    def flash_lock(self):
         self.write_packet(Packet(
-            payload_type=self.FLASH_LOCK,
-            payload=bytes()
+            payload_type=payload_type,
+            payload=payload
         ))
 
+    def status_request(self):
+        self.command(self.STATUS_REQUEST)
         return self.read_status()
 
-    def flash_unlock(self):
-        self.write_packet(Packet(
-            payload_type=self.FLASH_UNLOCK,
-            payload=bytes()
-        ))
+    def flash_lock(self):
+        self.command(self.FLASH_LOCK)
+        return self.read_status()
 
+    def flash_unlock(self):
+        self.command(self.FLASH_UNLOCK)
         return self.read_status()
 
     def erase(self, block):
@@ -133,6 +308,7 @@ class PDC002Bootloader:
             payload_type=self.ERASE,
             payload=bytes([0x00, block, 0x00, 0x08])
         ))
+        self.unanswered = True
 
     def prog(self, address, data):
         header = struct.pack('<IB', address, len(data))
@@ -141,15 +317,13 @@ class PDC002Bootloader:
             payload_type=self.PROG,
             payload=header + bytes(data)
         ))
+        self.unanswered = True
 
     def read_small(self, address, count):
         if count < 1 or count > 64:
             raise RuntimeError('READ_SMALL count must be between 1 and 64 bytes')
 
-        self.write_packet(Packet(
-            payload_type=self.READ_SMALL,
-            payload=struct.pack('<IB', address, count)
-        ))
+        self.command(self.READ_SMALL, struct.pack('<IB', address, count))
 
         p = self.read_packet()
         if p.payload_type != self.READ_SMALL:
@@ -157,36 +331,50 @@ class PDC002Bootloader:
 
         return p.payload
 
-    def read_big(self, address, count):
-        if count < 1 or count > 65535:
-            raise RuntimeError('READ_BIG count must be between 1 and 65535 bytes')
-
-        self.write_packet(Packet(
-            payload_type=self.READ_BIG,
-            payload=struct.pack('<IH', address, count)
-        ))
-
-        data = []
-
-        num_replies = math.ceil(count / 0x28)
-        for i in range(num_replies):
-            while True:
+    def read_big(self, address, count, hashes=()):
+        '''
+        Read count bytes, of any length, as a stream of READ_BIG replies. Each
+        reply goes straight into its place in the buffer returned, and into
+        each of hashes (anything with update(), like hashlib's) as it
+        arrives, so checking a digest costs nothing once the read is done.
+        '''
+        if count < 1:
+            raise RuntimeError('READ_BIG count must be at least 1 byte')
+
+        data = bytearray(count)
+        view = memoryview(data)
+
+        # Each READ_BIG is as big as the protocol allows, the next going out
+        # as soon as the last of the one before has come in
+        for start in range(0, count, self.READ_BIG_MAX):
+            length = min(count - start, self.READ_BIG_MAX)
+            self.command(self.READ_BIG, struct.pack('<IH', address + start, length))
+
+            # The replies have no sequence number, so each is checked for
+            # being the type expected, with at least the data expected where
+            # it falls in the stream. The last may be padded past the end of
+            # the read, and only what was asked for is kept.
+            for offset in range(start, start + length, self.READ_BIG_REPLY_SIZE):
+                size = min(start + length - offset, self.READ_BIG_REPLY_SIZE)
                 p = self.read_packet()
-                if p.payload_type == self.STATUS_SUCCESS:
-                    # TODO: HACK HACK HACK
-                    continue
                 if p.payload_type != self.READ_BIG:
-                    raise RuntimeError(f'did not get READ_BIG in reply to READ_BIG (got {p.payload_type:02x})')
-                break
-
-            data.extend(p.payload)
-
-        return bytes(data[:count])
+                    raise RuntimeError(
+                        f'did not get READ_BIG in reply to READ_BIG at 0x{address + offset:08x} '
+                        f'(got {p.payload_type:02x})'
+                    )
+                if len(p.payload) < size:
+                    raise RuntimeError(
+                        f'READ_BIG reply at 0x{address + offset:08x} had {len(p.payload)} bytes, '
+                        f'not {size}'
+                    )
+
+                payload = p.payload[:size]
+                view[offset:(offset + size)] = payload
+                for h in hashes:
+                    h.update(payload)
+
+        return data
 
     def reset(self):
-        self.write_packet(Packet(
-            payload_type=self.RESET,
-            payload=bytes()
-        ))
-
+        self.command(self.RESET)
         return self.read_status()
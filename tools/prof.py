@@ -0,0 +1,68 @@
+import struct
+import sys
+from collections import namedtuple
+
+import log_decode
+
+# The DWT cycle counter runs at the core clock
+CPU_HZ = 72000000
+
+# Body of a LOG_RAW_PROF record (prof_save() in firmware/prof.c)
+ZONE = struct.Struct('<HIIIQ')
+
+Zone = namedtuple('Zone', ['name', 'time_ms', 'count', 'min', 'max', 'total'])
+
+def decode_zone(raw, time_ms, formats):
+    name, count, min_cycles, max_cycles, total = ZONE.unpack(raw.data[:ZONE.size])
+    try:
+        name = log_decode.format_string(formats, name)
+    except ValueError:
+        name = f'<unknown zone {name:#x}>'
+    return Zone(name, time_ms, count, min_cycles, max_cycles, total)
+
+def newest_zones(records, formats):
+    # Each save writes every zone, so the newest record of each is the latest
+    # snapshot. Zones are returned in the order the firmware saves them.
+    zones = {}
+    for record in records:
+        raw = record.raw
+        if raw is None or raw.kind != log_decode.RAW_PROF or len(raw.data) < ZONE.size:
+            continue
+        zone = decode_zone(raw, record.time_ms, formats)
+        zones[zone.name] = zone
+    return list(zones.values())
+
+def us(cycles):
+    return cycles * 1000000 / CPU_HZ
+
+def print_zones(zones):
+    if len(zones) == 0:
+        print('no profiling records (was the firmware built with PROFILE=1?)')
+        return
+
+    print(f'{"zone":16s} {"count":>10s} {"min":>10s} {"avg":>10s} {"max":>10s} {"total":>14s}')
+    for zone in zones:
+        avg = zone.total / zone.count if zone.count != 0 else 0
+        print(
+            f'{zone.name:16s} {zone.count:10d} {zone.min:10d} {avg:10.1f} {zone.max:10d} {zone.total:14d} cycles'
+        )
+        print(
+            f'{"":16s} {"":10s} {us(zone.min):10.2f} {us(avg):10.2f} {us(zone.max):10.2f} {us(zone.total):14.1f} us'
+        )
+
+    print(f'saved at {zones[-1].time_ms} ms')
+
+def main():
+    if len(sys.argv) not in [2, 3]:
+        print(f'usage: {sys.argv[0]} store.bin [firmware.elf]')
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+
+    elf_path = sys.argv[2] if len(sys.argv) == 3 else log_decode.DEFAULT_ELF
+    formats = log_decode.load_formats(elf_path)
+    print_zones(newest_zones(log_decode.decode_store(data, formats), formats))
+
+if __name__ == '__main__':
+    main()
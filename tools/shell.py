@@ -1,4 +1,9 @@
-from pdc002 import PDC002Bootloader
+import hashlib
+import time
+from pdc002 import Crc32, PDC002Bootloader
+import log_decode
+import pd_trace
+import prof
 
 def print_status(s):
     if s == PDC002Bootloader.STATUS_SUCCESS:
@@ -28,8 +33,8 @@ def shell_main(pdc):
                 running = False
                 break
             elif cmd == 'r' or cmd == 'read':
-                if len(args) not in [1, 2, 3]:
-                    print('usage: read address [length] [base]')
+                if len(args) not in [1, 2, 3, 4]:
+                    print('usage: read address [length] [base] [elf]')
                     continue
 
                 address = int(args[0], 16)
@@ -51,15 +56,89 @@ def shell_main(pdc):
                         print('invalid base')
                         continue
 
+                elf_path = log_decode.DEFAULT_ELF
+                if len(args) >= 4:
+                    elf_path = args[3]
+
                 data = pdc.read_big(address, length)
                 if base == 'x':
                     data = ' '.join([f'{b:02x}' for b in data])
                     print(f'address {address:08x} = {data}')
                 else:
-                    messages = data.replace(b'\xff', b'\x00').decode('ascii').split('\x00')
-                    messages = [msg for msg in messages if len(msg) != 0]
-                    for message in messages:
-                        print(message)
+                    try:
+                        formats = log_decode.load_formats(elf_path)
+                    except (ImportError, OSError, ValueError) as e:
+                        print(f'can\'t load log formats: {e}')
+                        continue
+                    log_decode.print_records(log_decode.decode_store(data, formats))
+            elif cmd == 'l' or cmd == 'log':
+                if len(args) not in [0, 1, 2]:
+                    print('usage: log [count] [elf]')
+                    continue
+
+                count = 20
+                if len(args) >= 1:
+                    count = int(args[0])
+                    if count <= 0:
+                        print('invalid count')
+                        continue
+
+                elf_path = log_decode.DEFAULT_ELF
+                if len(args) >= 2:
+                    elf_path = args[1]
+
+                try:
+                    formats = log_decode.load_formats(elf_path)
+                    store = log_decode.load_store(elf_path)
+                except (ImportError, OSError, ValueError) as e:
+                    print(f'can\'t load log layout: {e}')
+                    continue
+
+                # Page headers fit in a single READ_SMALL reply
+                def read(address, length):
+                    if length <= 64:
+                        return pdc.read_small(address, length)
+                    return pdc.read_big(address, length)
+
+                records = log_decode.read_newest(read, store, count, formats)
+                log_decode.print_records(records)
+            elif cmd == 't' or cmd == 'trace':
+                if len(args) not in [1, 2]:
+                    print('usage: trace filename [elf]')
+                    continue
+
+                elf_path = log_decode.DEFAULT_ELF
+                if len(args) >= 2:
+                    elf_path = args[1]
+
+                try:
+                    start, end = log_decode.load_store(elf_path)
+                except (ImportError, OSError, ValueError) as e:
+                    print(f'can\'t load log layout: {e}')
+                    continue
+
+                records = log_decode.decode_store(pdc.read_big(start, end - start), b'')
+                with open(args[0], 'wb') as f:
+                    pd_trace.write_pcapng(f, records)
+                print(f'trace written to {args[0]}')
+            elif cmd == 'p' or cmd == 'prof':
+                if len(args) not in [0, 1]:
+                    print('usage: prof [elf]')
+                    continue
+
+                elf_path = log_decode.DEFAULT_ELF
+                if len(args) >= 1:
+                    elf_path = args[0]
+
+                try:
+                    formats = log_decode.load_formats(elf_path)
+                    start, end = log_decode.load_store(elf_path)
+                except (ImportError, OSError, ValueError) as e:
+                    print(f'can\'t load log layout: {e}')
+                    continue
+
+                records = log_decode.decode_store(pdc.read_big(start, end - start), formats)
+                prof.print_zones(prof.newest_zones(records, formats))
             elif cmd == 'd' or cmd == 'dump':
                 if len(args) != 3:
                     print('usage: dump address length filename')
@@ -77,9 +156,16 @@ def shell_main(pdc):
 
                 filename = args[2]
                 print(f'dumping to {filename}')
+                crc32 = Crc32()
+                sha256 = hashlib.sha256()
+                start = time.monotonic()
+                data = pdc.read_big(address, length, [crc32, sha256])
+                elapsed = time.monotonic() - start
                 with open(filename, 'wb') as f:
-                    f.write(pdc.read_big(address, length))
-                print('dump complete')
+                    f.write(data)
+                rate = length / elapsed if elapsed > 0 else 0
+                print(f'dump complete: {length} bytes in {elapsed:.2f} s ({rate:.0f} bytes/s)')
+                print(f'crc32 {crc32.hexdigest()} sha256 {sha256.hexdigest()}')
             elif cmd == 'status':
                 print_status(pdc.status_request())
             else: